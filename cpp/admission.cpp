@@ -0,0 +1,418 @@
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "admission.h"
+#include "trace.h"
+
+
+static inline uint32_t read_be16(const uchar *p)
+{
+    return ((uint32_t)p[0] << 8) | p[1];
+}
+
+
+static inline uint32_t read_be32(const uchar *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+
+static inline uint32_t read_le16(const uchar *p)
+{
+    return p[0] | ((uint32_t)p[1] << 8);
+}
+
+
+static inline uint32_t read_le24(const uchar *p)
+{
+    return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+}
+
+
+static inline uint32_t read_le32(const uchar *p)
+{
+    return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+//
+// IHDR is always the first chunk
+//
+static bool read_png_header(const uchar *data, size_t size, t_image_header &header)
+{
+    if(size < 26 || memcmp(data + 12, "IHDR", 4) != 0)
+    {
+        return false;
+    }
+
+    static const int channels[7] = { 1, 0, 3, 3, 2, 0, 4 };
+    const int color_type = data[25];
+    header.format = FORMAT_PNG;
+    header.width = (int)read_be32(data + 16);
+    header.height = (int)read_be32(data + 20);
+    header.channels = color_type < 7 && channels[color_type] ? channels[color_type] : 4;
+    header.depth = data[24] == 16 ? 2 : 1;
+    return true;
+}
+
+
+//
+// Walk the markers up to the first start of frame.  EXIF and ICC
+// segments before it are skipped by their length.
+//
+static bool read_jpeg_header(const uchar *data, size_t size, t_image_header &header)
+{
+    size_t pos = 2;
+    while(pos + 4 <= size)
+    {
+        if(data[pos] != 0xff)
+        {
+            return false;
+        }
+        const uchar marker = data[pos + 1];
+        if(marker == 0xff)
+        {
+            pos++;          // fill byte
+            continue;
+        }
+        if(marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7))
+        {
+            pos += 2;       // no length
+            continue;
+        }
+
+        const bool frame = marker >= 0xc0 && marker <= 0xcf &&
+                           marker != 0xc4 && marker != 0xc8 && marker != 0xcc;
+        if(frame)
+        {
+            if(pos + 10 > size)
+            {
+                return false;
+            }
+            header.format = FORMAT_JPEG;
+            header.height = (int)read_be16(data + pos + 5);
+            header.width = (int)read_be16(data + pos + 7);
+            header.channels = data[pos + 9];
+            header.depth = data[pos + 4] > 8 ? 2 : 1;
+            return true;
+        }
+        pos += 2 + read_be16(data + pos + 2);
+    }
+    return false;
+}
+
+
+static bool read_bmp_header(const uchar *data, size_t size, t_image_header &header)
+{
+    if(size < 30)
+    {
+        return false;
+    }
+
+    //
+    // a negative height is a top down bitmap; palettes decode to BGR
+    //
+    const int height = (int)read_le32(data + 22);
+    header.format = FORMAT_BMP;
+    header.width = (int)read_le32(data + 18);
+    header.height = height < 0 ? -height : height;
+    header.channels = read_le16(data + 28) == 32 ? 4 : 3;
+    header.depth = 1;
+    return true;
+}
+
+
+static bool read_webp_header(const uchar *data, size_t size, t_image_header &header)
+{
+    if(size < 30)
+    {
+        return false;
+    }
+
+    header.format = FORMAT_WEBP;
+    header.depth = 1;
+    if(memcmp(data + 12, "VP8 ", 4) == 0)
+    {
+        header.width = (int)(read_le16(data + 26) & 0x3fff);
+        header.height = (int)(read_le16(data + 28) & 0x3fff);
+        header.channels = 3;
+        return true;
+    }
+    if(memcmp(data + 12, "VP8L", 4) == 0)
+    {
+        const uint32_t bits = read_le32(data + 21);
+        header.width = (int)(bits & 0x3fff) + 1;
+        header.height = (int)((bits >> 14) & 0x3fff) + 1;
+        header.channels = 4;
+        return true;
+    }
+    if(memcmp(data + 12, "VP8X", 4) == 0)
+    {
+        header.width = (int)read_le24(data + 24) + 1;
+        header.height = (int)read_le24(data + 27) + 1;
+        header.channels = data[20] & 0x10 ? 4 : 3;
+        return true;
+    }
+    return false;
+}
+
+
+//
+// P1-P6: whitespace separated width, height and, except for
+// bitmaps, the maximum value, with # comments between them
+//
+static bool read_pnm_header(const uchar *data, size_t size, t_image_header &header)
+{
+    const char type = data[1];
+    int values[3] = { 0, 0, 0 };
+    const int value_count = type == '1' || type == '4' ? 2 : 3;
+
+    size_t pos = 2;
+    for(int i = 0; i < value_count; ++i)
+    {
+        while(pos < size && (isspace(data[pos]) || data[pos] == '#'))
+        {
+            if(data[pos] == '#')
+            {
+                while(pos < size && data[pos] != '\n')
+                {
+                    pos++;
+                }
+            }
+            else
+            {
+                pos++;
+            }
+        }
+        if(pos >= size || !isdigit(data[pos]))
+        {
+            return false;
+        }
+        while(pos < size && isdigit(data[pos]))
+        {
+            values[i] = values[i] * 10 + (data[pos++] - '0');
+        }
+    }
+
+    header.format = FORMAT_PNM;
+    header.width = values[0];
+    header.height = values[1];
+    header.channels = type == '3' || type == '6' ? 3 : 1;
+    header.depth = value_count == 3 && values[2] > 255 ? 2 : 1;
+    return true;
+}
+
+
+bool read_image_header(const uchar *data, size_t size, t_image_header &header)
+{
+    bool ok = false;
+    if(size >= 8 && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0)
+    {
+        ok = read_png_header(data, size, header);
+    }
+    else if(size >= 3 && data[0] == 0xff && data[1] == 0xd8 && data[2] == 0xff)
+    {
+        ok = read_jpeg_header(data, size, header);
+    }
+    else if(size >= 2 && data[0] == 'B' && data[1] == 'M')
+    {
+        ok = read_bmp_header(data, size, header);
+    }
+    else if(size >= 12 && memcmp(data, "RIFF", 4) == 0 && memcmp(data + 8, "WEBP", 4) == 0)
+    {
+        ok = read_webp_header(data, size, header);
+    }
+    else if(size >= 3 && data[0] == 'P' && data[1] >= '1' && data[1] <= '6')
+    {
+        ok = read_pnm_header(data, size, header);
+    }
+    return ok && header.width > 0 && header.height > 0 && header.channels > 0;
+}
+
+
+bool read_image_header(const std::string &path, t_image_header &header)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if(!f)
+    {
+        return false;
+    }
+
+    //
+    // enough for a JPEG's EXIF and ICC segments ahead of its frame
+    //
+    std::vector<uchar> data(1024 * 1024);
+    const size_t size = fread(&data[0], 1, data.size(), f);
+    fclose(f);
+    return read_image_header(&data[0], size, header);
+}
+
+
+size_t estimate_image_footprint(const t_image_header &header, int scale, int count, const t_split_config *config)
+{
+    //
+    // only JPEG decodes at a reduced scale
+    //
+    if(header.format != FORMAT_JPEG)
+    {
+        scale = 1;
+    }
+    const int width = (header.width + scale - 1) / scale;
+    const int height = (header.height + scale - 1) / scale;
+    const size_t pixels = (size_t)width * height;
+    const size_t native = (size_t)header.channels * header.depth;
+
+    //
+    // the decoded 8-bit BGR image, and the decoder's own
+    // buffer when the file is stored otherwise
+    //
+    size_t bytes = pixels * 3;
+    if(native != 3)
+    {
+        bytes += pixels * native;
+    }
+
+    //
+    // the scratch includes the border rule's fill
+    //
+    bytes += get_class_map_size(width, height, get_class_map_count(count, config));
+    bytes += get_scratch_size(count, config);
+    return bytes;
+}
+
+
+t_admission_plan plan_admission(const t_image_header *header, int count, const t_split_config *config,
+                                size_t budget, bool downsample)
+{
+    t_admission_plan plan;
+    plan.scale = 1;
+    plan.known = header != NULL;
+    if(!header)
+    {
+        plan.bytes = budget;
+        return plan;
+    }
+
+    plan.bytes = estimate_image_footprint(*header, 1, count, config);
+    while(budget > 0 && plan.bytes > budget && downsample && header->format == FORMAT_JPEG && plan.scale < 8)
+    {
+        plan.scale *= 2;
+        plan.bytes = estimate_image_footprint(*header, plan.scale, count, config);
+    }
+    return plan;
+}
+
+
+static int get_decode_flag(const t_admission_plan &plan)
+{
+    return plan.scale == 8 ? cv::IMREAD_REDUCED_COLOR_8 :
+           plan.scale == 4 ? cv::IMREAD_REDUCED_COLOR_4 :
+           plan.scale == 2 ? cv::IMREAD_REDUCED_COLOR_2 : cv::IMREAD_COLOR;
+}
+
+
+cv::Mat decode_planned(const t_admission_plan &plan, const std::string &path)
+{
+    return cv::imread(path, get_decode_flag(plan));
+}
+
+
+cv::Mat decode_planned(const t_admission_plan &plan, const std::vector<uchar> &encoded)
+{
+    return cv::imdecode(encoded, get_decode_flag(plan));
+}
+
+
+t_memory_budget::t_memory_budget(size_t budget)
+    : budget(budget), used(0), next_ticket(0), serving(0)
+{
+}
+
+
+void t_memory_budget::set_budget(size_t value)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        budget = value;
+    }
+    changed.notify_all();
+}
+
+
+size_t t_memory_budget::get_budget() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return budget;
+}
+
+
+bool t_memory_budget::acquire(size_t bytes, bool wait)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if(!wait)
+    {
+        used += bytes;
+        return false;
+    }
+
+    //
+    // Jobs are admitted in ticket order.  The job being served starts
+    // once it fits next to the jobs running, or alone if it is larger
+    // than the whole budget.
+    //
+    const uint64_t ticket = next_ticket++;
+    const uint64_t start = is_tracing() ? get_trace_time() : 0;
+    bool waited = false;
+    while(budget > 0 && (ticket != serving || (used > 0 && used + bytes > budget)))
+    {
+        waited = true;
+        changed.wait(lock);
+    }
+    if(waited && start > 0 && is_tracing())
+    {
+        trace_event("admission wait", start, get_trace_time(), "megabytes", (int64_t)(bytes >> 20));
+    }
+
+    //
+    // a budget of 0 doesn't queue, so a ticket may be skipped
+    //
+    if(ticket >= serving)
+    {
+        serving = ticket + 1;
+    }
+    used += bytes;
+    lock.unlock();
+
+    //
+    // the next ticket may fit too
+    //
+    changed.notify_all();
+    return waited;
+}
+
+
+void t_memory_budget::release(size_t bytes)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        used -= bytes;
+    }
+    changed.notify_all();
+}
+
+
+size_t t_memory_budget::get_used() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return used;
+}
+
+
+size_t t_memory_budget::get_waiting() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return (size_t)(next_ticket - serving);
+}
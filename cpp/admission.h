@@ -0,0 +1,151 @@
+//
+// admission.h
+//
+// Admission control for batch and service work.  Before an image is
+// decoded its size is read from the file's header (PNG, JPEG, BMP, WebP
+// and PNM) and its memory footprint estimated: the decoded image, the
+// decoder's own buffer when the file isn't 8-bit BGR, the class map, the
+// split scratch and the border flood fill.  A job starts only once its
+// footprint fits the free part of a memory budget; jobs are admitted in
+// the order they asked, so a large one is never starved by small ones.
+//
+// A JPEG whose footprint exceeds the whole budget is decoded at 1/2, 1/4
+// or 1/8 scale when downsampling is allowed; libjpeg scales while it
+// decodes, so the full size image never exists.  OpenCV decodes the other
+// formats whole, so shrinking them afterwards wouldn't lower the peak.  A
+// job that still doesn't fit waits until it can run alone.
+//
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <opencv2/opencv.hpp>
+
+#include "dominant_colors.h"
+
+
+typedef enum t_image_format
+{
+    FORMAT_UNKNOWN,
+    FORMAT_PNG,
+    FORMAT_JPEG,
+    FORMAT_BMP,
+    FORMAT_WEBP,
+    FORMAT_PNM
+} t_image_format;
+
+
+typedef struct t_image_header
+{
+    t_image_format  format;
+    int             width;
+    int             height;
+    int             channels;           // as stored in the file
+    int             depth;              // bytes per channel as stored, 1 or 2
+} t_image_header;
+
+
+//
+// How to decode a job and what it is charged against the budget
+//
+typedef struct t_admission_plan
+{
+    int             scale;              // 1, 2, 4 or 8: decode at 1/scale
+    size_t          bytes;              // estimated peak footprint
+    bool            known;              // false if the header couldn't be read
+} t_admission_plan;
+
+
+//
+// Read the size of an encoded image, from memory or from the start of
+// a file.  Returns false for other formats and truncated headers.
+//
+bool read_image_header(const uchar *data, size_t size, t_image_header &header);
+bool read_image_header(const std::string &path, t_image_header &header);
+
+//
+// The peak bytes of finding 'count' colors in the image decoded at
+// 1/scale, encoded bytes not included
+//
+size_t estimate_image_footprint(const t_image_header &header, int scale, int count,
+                                const t_split_config *config = NULL);
+
+//
+// The smallest scale whose footprint fits 'budget'; always 1 if
+// 'downsample' is off or the image isn't a JPEG.  An image whose header
+// can't be read is planned as taking the whole budget.
+//
+t_admission_plan plan_admission(const t_image_header *header, int count, const t_split_config *config,
+                                size_t budget, bool downsample);
+
+//
+// Decode as 8-bit BGR at the plan's scale
+//
+cv::Mat decode_planned(const t_admission_plan &plan, const std::string &path);
+cv::Mat decode_planned(const t_admission_plan &plan, const std::vector<uchar> &encoded);
+
+
+//
+// Bytes in use against a budget.  acquire blocks until the bytes fit,
+// first come first served; a job larger than the budget is admitted
+// alone.  A budget of 0 admits everything at once.
+//
+class t_memory_budget
+{
+public:
+    t_memory_budget(size_t budget = 0);
+
+    void set_budget(size_t budget);
+    size_t get_budget() const;
+
+    //
+    // Returns true if the job had to wait.  Without 'wait' the bytes
+    // are taken at once, even past the budget.
+    //
+    bool acquire(size_t bytes, bool wait = true);
+    void release(size_t bytes);
+
+    size_t get_used() const;
+    size_t get_waiting() const;
+
+private:
+    size_t                      budget;
+    size_t                      used;
+    uint64_t                    next_ticket;        // given to the next job to ask
+    uint64_t                    serving;            // the ticket that may be admitted next
+    mutable std::mutex          mutex;
+    std::condition_variable     changed;
+};
+
+
+//
+// Holds an admission for the lifetime of the object
+//
+class t_admission
+{
+public:
+    t_admission(t_memory_budget &budget, size_t bytes, bool wait = true)
+        : budget(budget), bytes(bytes)
+    {
+        waited = budget.acquire(bytes, wait);
+    }
+
+    ~t_admission()
+    {
+        budget.release(bytes);
+    }
+
+    bool waited;
+
+private:
+    t_memory_budget     &budget;
+    size_t              bytes;
+};
+
+#endif
@@ -0,0 +1,613 @@
+#include <string.h>
+#include <sys/stat.h>
+#include <vector>
+#include <mutex>
+#include <unordered_map>
+#include <opencv2/opencv.hpp>
+
+#include "async.h"
+#include "trace.h"
+#include "perf_counters.h"
+#include "metrics.h"
+
+
+t_cancel_handle create_cancel_token(double timeout_seconds)
+{
+    t_cancel_handle token = std::make_shared<t_cancel_token>();
+    init_cancel_token(token.get(), timeout_seconds);
+    return token;
+}
+
+
+t_worker_pool& get_library_pool()
+{
+    static t_worker_pool pool(0, true);
+    return pool;
+}
+
+
+static bool g_library_downsample = true;
+
+
+t_memory_budget& get_library_budget()
+{
+    static t_memory_budget budget;
+    return budget;
+}
+
+
+void set_library_memory_budget(size_t bytes, bool downsample)
+{
+    g_library_downsample = downsample;
+    get_library_budget().set_budget(bytes);
+}
+
+
+//
+// Per worker buffers.  They grow to the largest image a worker
+// sees and are reused for the requests that follow.  A request
+// run at a preempted request's split boundary has its own set.
+//
+typedef struct t_request_buffers
+{
+    std::vector<uchar>      class_map;
+    std::vector<uchar>      scratch;
+} t_request_buffers;
+
+static thread_local int g_request_depth = 0;
+
+
+//
+// Counts the requests running on the thread for the lifetime of the object
+//
+class t_request_nesting
+{
+public:
+    t_request_nesting()
+        : depth(g_request_depth++)
+    {
+    }
+
+    ~t_request_nesting()
+    {
+        g_request_depth--;
+    }
+
+    const int   depth;      // 0 unless another request is preempted below this one
+};
+
+
+t_find_result run_find_request(const t_find_request &request, const t_cancel_token *cancel)
+{
+    t_find_result result;
+    result.status = FIND_FAILED;
+    result.scale = 1;
+
+    if(request.count <= 0 || request.count > get_max_color_count(NULL))
+    {
+        return result;
+    }
+    if(is_cancelled(cancel))
+    {
+        result.status = cancel->cancelled.load() ? FIND_CANCELLED : FIND_TIMED_OUT;
+        return result;
+    }
+
+    t_request_nesting nesting;
+    try
+    {
+        //
+        // Size up an encoded image from its header and wait for its
+        // footprint to fit the budget.  The admission is released only
+        // after the image and the buffers below.  A preempting request
+        // doesn't wait: the request below it can't resume, and release
+        // its bytes, until it is done.
+        //
+        t_memory_budget &budget = get_library_budget();
+        const bool encoded = request.image.empty() && !request.encoded.empty();
+        const bool file = request.image.empty() && request.encoded.empty() && !request.path.empty();
+        t_image_header header;
+        const bool known = budget.get_budget() > 0 &&
+                           (encoded ? read_image_header(&request.encoded[0], request.encoded.size(), header) :
+                            file ? read_image_header(request.path, header) : false);
+        const t_admission_plan plan = plan_admission(known ? &header : NULL, request.count, NULL,
+                                                     encoded || file ? budget.get_budget() : 0,
+                                                     g_library_downsample);
+        std::unique_ptr<t_admission> admission;
+        {
+            t_stage_timer timer(STAGE_ADMISSION);
+            admission.reset(new t_admission(budget, plan.bytes, nesting.depth == 0));
+        }
+        if(admission->waited)
+        {
+            count_metric(METRIC_ADMISSION_WAITS);
+        }
+        if(plan.scale > 1)
+        {
+            count_metric(METRIC_DOWNSAMPLED);
+            result.scale = plan.scale;
+        }
+
+        //
+        // decode here, on the worker, rather than on the caller's thread
+        //
+        cv::Mat img = request.image;
+        if(encoded)
+        {
+            t_trace_span span("decode");
+            t_perf_scope counters(PERF_DECODE);
+            t_stage_timer timer(STAGE_DECODE);
+            img = decode_planned(plan, request.encoded);
+        }
+        else if(file)
+        {
+            t_trace_span span("decode");
+            t_perf_scope counters(PERF_DECODE);
+            t_stage_timer timer(STAGE_DECODE);
+            img = decode_planned(plan, request.path);
+        }
+
+        if(img.empty() || img.type() != CV_8UC3)
+        {
+            result.status = FIND_DECODE_FAILED;
+            return result;
+        }
+
+        static thread_local t_request_buffers worker_buffers[2];
+        t_request_buffers nested_buffers;
+        t_request_buffers &buffers = nesting.depth < 2 ? worker_buffers[nesting.depth] : nested_buffers;
+        const size_t class_map_size = get_class_map_size(img.cols, img.rows, request.count);
+        count_metric(buffers.class_map.size() >= class_map_size &&
+                     buffers.scratch.size() >= get_scratch_size(request.count) ?
+                     METRIC_BUFFER_HITS : METRIC_BUFFER_MISSES);
+        if(buffers.class_map.size() < class_map_size)
+        {
+            buffers.class_map.resize(class_map_size);
+        }
+        if(buffers.scratch.size() < get_scratch_size(request.count))
+        {
+            buffers.scratch.resize(get_scratch_size(request.count));
+        }
+
+        t_arena arena;
+        arena.base = &buffers.scratch[0];
+        arena.size = buffers.scratch.size();
+        arena.used = 0;
+
+        result.colors.resize(request.count);
+        result.weights.resize(request.count);
+
+        t_split_status status = SPLIT_COMPLETE;
+        const int found = find_dominant_colors_into(img, request.count, &result.colors[0], &result.weights[0],
+                                                    &buffers.class_map[0], class_map_size, &arena,
+                                                    cancel, &status);
+
+        //
+        // with a budget nothing the request allocated outlives its admission
+        //
+        if(budget.get_budget() > 0)
+        {
+            std::vector<uchar>().swap(buffers.class_map);
+            std::vector<uchar>().swap(buffers.scratch);
+        }
+
+        if(found < 0)
+        {
+            result.colors.clear();
+            result.weights.clear();
+            return result;
+        }
+
+        result.colors.resize(found);
+        result.weights.resize(found);
+        result.status = status == SPLIT_CANCELLED ? FIND_CANCELLED :
+                        status == SPLIT_TIMED_OUT ? FIND_TIMED_OUT : FIND_OK;
+    }
+    catch(...)
+    {
+        result.status = FIND_FAILED;
+        result.colors.clear();
+        result.weights.clear();
+    }
+
+    return result;
+}
+
+
+//
+// Identical requests in flight at the same time share one computation.
+// A request is identified by its count and either a hash of its encoded
+// bytes, which are compared in full on a hash match, or its path with the
+// file's size and modification time.  Requests with a decoded image
+// aren't coalesced.  The key is made and compared on the pool thread that
+// picks the request up, so the caller never hashes, stats or compares.
+//
+typedef struct t_coalesced_waiter
+{
+    t_find_callback                         callback;
+    t_cancel_handle                         token;          // may be empty
+    int64_t                                 submitted;      // steady clock nanoseconds
+} t_coalesced_waiter;
+
+
+typedef struct t_coalesced_request
+{
+    std::shared_ptr<const t_find_request>   request;        // the first request's copy
+    uint64_t                                hash;
+    int64_t                                 file_size;      // -1 unless a path request
+    int64_t                                 file_time;
+    t_task_priority                         priority;       // the lane it runs in
+    t_cancel_token                          token;          // the shared computation's
+    std::mutex                              mutex;          // guards the fields below
+    std::vector<t_coalesced_waiter>         waiters;        // the first one leads
+    bool                                    finished;       // the waiters were answered
+} t_coalesced_request;
+
+typedef std::shared_ptr<t_coalesced_request> t_coalesced_handle;
+typedef std::unordered_multimap<uint64_t, t_coalesced_handle> t_in_flight_map;
+typedef std::unordered_multimap<const t_cancel_token*, t_coalesced_handle> t_token_map;
+
+//
+// Guards the maps only; a group's own fields are guarded by its mutex,
+// which is taken first when both are held
+//
+static std::mutex g_coalesce_mutex;
+static t_in_flight_map g_in_flight;         // by hash
+static t_token_map g_coalesced_tokens;      // the groups each waiter's token belongs to
+
+
+//
+// A 64-bit hash of a byte string, four multiply-rotate lanes of
+// 8 bytes in the manner of xxHash64, so a large body hashes at
+// memory speed
+//
+static uint64_t hash_bytes(const uchar *data, size_t size)
+{
+    const uint64_t prime1 = 0x9e3779b185ebca87ULL;
+    const uint64_t prime2 = 0xc2b2ae3d27d4eb4fULL;
+    uint64_t lanes[4] = { prime1 + prime2, prime2, 0, 0 - prime1 };
+
+    size_t pos = 0;
+    for(; pos + 32 <= size; pos += 32)
+    {
+        for(int i = 0; i < 4; ++i)
+        {
+            uint64_t word;
+            memcpy(&word, data + pos + i * 8, 8);
+            lanes[i] += word * prime2;
+            lanes[i] = ((lanes[i] << 31) | (lanes[i] >> 33)) * prime1;
+        }
+    }
+
+    uint64_t hash = size;
+    for(int i = 0; i < 4; ++i)
+    {
+        hash = (hash ^ lanes[i]) * prime1;
+        hash = (hash << 27) | (hash >> 37);
+    }
+    for(; pos < size; ++pos)
+    {
+        hash = (hash ^ data[pos]) * prime1;
+        hash = (hash << 11) | (hash >> 53);
+    }
+
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    return hash;
+}
+
+
+//
+// Fill in the identity of a request.  Returns false if it can't be
+// coalesced.
+//
+static bool get_coalesce_key(const t_find_request &request, t_coalesced_request &key)
+{
+    key.file_size = -1;
+    key.file_time = 0;
+    if(!request.image.empty())
+    {
+        return false;
+    }
+    if(!request.encoded.empty())
+    {
+        key.hash = hash_bytes(&request.encoded[0], request.encoded.size());
+        return true;
+    }
+
+    struct stat st;
+    if(request.path.empty() || stat(request.path.c_str(), &st) != 0)
+    {
+        return false;
+    }
+    key.hash = hash_bytes((const uchar*)request.path.data(), request.path.size());
+    key.file_size = (int64_t)st.st_size;
+    key.file_time = (int64_t)st.st_mtime;
+    return true;
+}
+
+
+static bool is_same_request(const t_coalesced_request &group, const t_find_request &request,
+                            const t_coalesced_request &key)
+{
+    const t_find_request &first = *group.request;
+    if(first.count != request.count || group.file_size != key.file_size || group.file_time != key.file_time)
+    {
+        return false;
+    }
+    if(key.file_size >= 0)
+    {
+        return first.path == request.path;
+    }
+    return first.encoded.size() == request.encoded.size() &&
+           memcmp(&first.encoded[0], &request.encoded[0], request.encoded.size()) == 0;
+}
+
+
+//
+// The shared computation runs until its own deadline, so it answers a
+// waiter in time only if that deadline is no earlier than the waiter's
+//
+static bool covers_deadline(const t_coalesced_request &group, int64_t deadline)
+{
+    return group.token.deadline == 0 || (deadline != 0 && deadline <= group.token.deadline);
+}
+
+
+//
+// Add a waiter to an identical computation running at the same or a more
+// urgent priority and covering the waiter's deadline.  The bytes are
+// compared without a lock; the group's request never changes.  Returns
+// false if there is none to join.
+//
+static bool join_coalesced(const t_coalesced_request &key, const t_find_request &request,
+                           const t_coalesced_waiter &waiter, t_task_priority priority)
+{
+    std::vector<t_coalesced_handle> candidates;
+    {
+        std::lock_guard<std::mutex> lock(g_coalesce_mutex);
+        std::pair<t_in_flight_map::iterator, t_in_flight_map::iterator> range = g_in_flight.equal_range(key.hash);
+        for(t_in_flight_map::iterator it = range.first; it != range.second; ++it)
+        {
+            candidates.push_back(it->second);
+        }
+    }
+
+    const int64_t deadline = waiter.token ? waiter.token->deadline : 0;
+    for(size_t i = 0; i < candidates.size(); ++i)
+    {
+        t_coalesced_request &running = *candidates[i];
+        if(running.priority > priority || !covers_deadline(running, deadline) ||
+           !is_same_request(running, request, key))
+        {
+            continue;
+        }
+
+        //
+        // join, unless the computation is answering its waiters or every
+        // waiter so far gave up and it is stopping
+        //
+        std::lock_guard<std::mutex> lock(running.mutex);
+        if(running.finished || running.token.cancelled.load())
+        {
+            continue;
+        }
+        running.waiters.push_back(waiter);
+        if(waiter.token)
+        {
+            std::lock_guard<std::mutex> maps(g_coalesce_mutex);
+            g_coalesced_tokens.insert(std::make_pair(waiter.token.get(), candidates[i]));
+        }
+        count_metric(METRIC_COALESCED);
+        return true;
+    }
+    return false;
+}
+
+
+//
+// The shared result as one waiter sees it: a waiter cancelled, or past
+// its deadline, by the time the computation ends is told so
+//
+static t_find_status get_waiter_status(const t_coalesced_waiter &waiter, t_find_status status)
+{
+    if(status != FIND_OK || !waiter.token)
+    {
+        return status;
+    }
+    if(waiter.token->cancelled.load())
+    {
+        return FIND_CANCELLED;
+    }
+    return is_cancelled(waiter.token.get()) ? FIND_TIMED_OUT : FIND_OK;
+}
+
+
+//
+// Hand the shared result to every waiter.  The group is closed first,
+// so a request picked up now starts a new computation.
+//
+static void finish_coalesced(const t_coalesced_handle &group, const t_find_result &result)
+{
+    std::vector<t_coalesced_waiter> waiters;
+    {
+        std::lock_guard<std::mutex> lock(group->mutex);
+        group->finished = true;
+        waiters.swap(group->waiters);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(g_coalesce_mutex);
+        std::pair<t_in_flight_map::iterator, t_in_flight_map::iterator> range = g_in_flight.equal_range(group->hash);
+        for(t_in_flight_map::iterator it = range.first; it != range.second; ++it)
+        {
+            if(it->second == group)
+            {
+                g_in_flight.erase(it);
+                break;
+            }
+        }
+
+        for(size_t i = 0; i < waiters.size(); ++i)
+        {
+            std::pair<t_token_map::iterator, t_token_map::iterator> tokens =
+                g_coalesced_tokens.equal_range(waiters[i].token.get());
+            for(t_token_map::iterator it = tokens.first; it != tokens.second; ++it)
+            {
+                if(it->second == group)
+                {
+                    g_coalesced_tokens.erase(it);
+                    break;
+                }
+            }
+        }
+    }
+
+    for(size_t i = 0; i < waiters.size(); ++i)
+    {
+        t_find_result answer = result;
+        answer.status = get_waiter_status(waiters[i], result.status);
+
+        //
+        // t_find_status and the request counters are in the same order
+        //
+        count_metric((t_metric_counter)(METRIC_REQUESTS_OK + (int)answer.status));
+        observe_stage(STAGE_REQUEST, (get_steady_ns() - waiters[i].submitted) / 1e9);
+        if(waiters[i].callback)
+        {
+            waiters[i].callback(answer);
+        }
+    }
+}
+
+
+void cancel_request(const t_cancel_handle &token)
+{
+    if(!token)
+    {
+        return;
+    }
+    token->cancelled.store(true);
+
+    std::vector<t_coalesced_handle> groups;
+    {
+        std::lock_guard<std::mutex> lock(g_coalesce_mutex);
+        std::pair<t_token_map::iterator, t_token_map::iterator> range = g_coalesced_tokens.equal_range(token.get());
+        for(t_token_map::iterator it = range.first; it != range.second; ++it)
+        {
+            groups.push_back(it->second);
+        }
+    }
+
+    //
+    // a shared computation stops once every one of its waiters is cancelled
+    //
+    for(size_t g = 0; g < groups.size(); ++g)
+    {
+        t_coalesced_request &group = *groups[g];
+        std::lock_guard<std::mutex> lock(group.mutex);
+        bool all = true;
+        for(size_t i = 0; i < group.waiters.size() && all; ++i)
+        {
+            all = group.waiters[i].token && group.waiters[i].token->cancelled.load();
+        }
+        if(all)
+        {
+            group.token.cancelled.store(true);
+        }
+    }
+}
+
+
+//
+// Run a request on the calling pool thread.  A request that joins an
+// identical one in flight returns at once and is answered by it;
+// otherwise the request leads and answers everyone who joined.
+//
+static void run_coalesced(const std::shared_ptr<const t_find_request> &request, const t_coalesced_waiter &waiter,
+                          t_task_priority priority)
+{
+    t_coalesced_handle group = std::make_shared<t_coalesced_request>();
+    if(!get_coalesce_key(*request, *group))
+    {
+        t_find_result result = run_find_request(*request, waiter.token.get());
+        count_metric((t_metric_counter)(METRIC_REQUESTS_OK + (int)result.status));
+        observe_stage(STAGE_REQUEST, (get_steady_ns() - waiter.submitted) / 1e9);
+        if(waiter.callback)
+        {
+            waiter.callback(result);
+        }
+        return;
+    }
+
+    if(join_coalesced(*group, *request, waiter, priority))
+    {
+        return;
+    }
+
+    //
+    // The first request leads.  The computation runs under its own
+    // token with the first request's deadline, so that cancelling
+    // the first request alone doesn't stop it for the others.
+    //
+    group->request = request;
+    group->priority = priority;
+    group->token.cancelled.store(waiter.token && waiter.token->cancelled.load());
+    group->token.deadline = waiter.token ? waiter.token->deadline : 0;
+    group->waiters.push_back(waiter);
+    group->finished = false;
+    {
+        std::lock_guard<std::mutex> lock(g_coalesce_mutex);
+        g_in_flight.insert(std::make_pair(group->hash, group));
+        if(waiter.token)
+        {
+            g_coalesced_tokens.insert(std::make_pair(waiter.token.get(), group));
+        }
+    }
+
+    finish_coalesced(group, run_find_request(*request, &group->token));
+}
+
+
+void find_dominant_colors_async(const t_find_request &request, const t_find_callback &callback,
+                                t_cancel_handle cancel, t_task_priority priority)
+{
+    //
+    // The task holds a reference on the request and the token, so the
+    // caller may drop both as soon as this returns
+    //
+    std::shared_ptr<const t_find_request> copy = std::make_shared<t_find_request>(request);
+    t_coalesced_waiter waiter;
+    waiter.callback = callback;
+    waiter.token = cancel;
+    waiter.submitted = get_steady_ns();
+
+    const uint64_t queued = is_tracing() ? get_trace_time() : 0;
+    get_library_pool().submit([copy, waiter, priority, queued](int group)
+    {
+        set_trace_image(-1);
+        if(queued > 0 && is_tracing())
+        {
+            trace_event("queue wait", queued, get_trace_time(), "group", group);
+        }
+        observe_stage(STAGE_QUEUE_WAIT, (get_steady_ns() - waiter.submitted) / 1e9);
+
+        run_coalesced(copy, waiter, priority);
+    }, -1, priority);
+}
+
+
+std::future<t_find_result> find_dominant_colors_async(const t_find_request &request,
+                                                      t_cancel_handle cancel, t_task_priority priority)
+{
+    std::shared_ptr<std::promise<t_find_result> > promise = std::make_shared<std::promise<t_find_result> >();
+    std::future<t_find_result> future = promise->get_future();
+
+    find_dominant_colors_async(request, [promise](const t_find_result &result)
+    {
+        promise->set_value(result);
+    }, cancel, priority);
+
+    return future;
+}
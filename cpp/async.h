@@ -0,0 +1,180 @@
+//
+// async.h
+//
+// A non blocking interface to the dominant color engine for callers that
+// run on an event loop.  Requests are decoded and split on a worker pool
+// owned by the library, so the calling thread only queues work and is
+// never blocked.  Results are delivered through a std::future, a callback
+// run on the pool thread, or, when built as C++20, a co_await-able object.
+//
+// Every request may carry a cancel token.  The engine checks it between
+// splits and once per band of rows in every pixel pass, so a cancelled
+// request frees its worker within a fraction of one split.
+//
+// Identical requests in flight at once, the same count and the same
+// encoded bytes or the same unchanged file, are coalesced: when a worker
+// picks a request up it joins the computation of an identical request
+// already running, and that result is handed to every waiter.  The key is
+// hashed and compared on the worker, never on the caller's thread.  The
+// computation keeps the first request's deadline, so a request only joins
+// one whose deadline is no earlier than its own, and it stops only once
+// every waiter is cancelled.  A waiter cancelled, or past its deadline,
+// when the result arrives gets it marked FIND_CANCELLED or FIND_TIMED_OUT.
+//
+// A request is queued in the pool's interactive lane or its batch lane
+// (see worker_pool.h).  An interactive request may run on a worker in the
+// middle of a batch request's split; it is then admitted against the
+// memory budget without waiting, as the batch request it interrupts holds
+// its own admission until it resumes.  A request only joins an identical
+// one running at the same or a more urgent priority.
+//
+
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <future>
+#include <functional>
+#include <opencv2/opencv.hpp>
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+#define DC_HAVE_COROUTINES 1
+#endif
+
+#include "dominant_colors.h"
+#include "worker_pool.h"
+#include "admission.h"
+
+
+//
+// The image to process.  The first of 'image', 'encoded' and 'path'
+// that is set is used; encoded images and files are decoded on the pool.
+//
+typedef struct t_find_request
+{
+    cv::Mat                 image;          // 8-bit, 3 channel BGR
+    std::vector<uchar>      encoded;        // PNG, JPEG, ... bytes
+    std::string             path;
+    int                     count;
+} t_find_request;
+
+
+typedef enum t_find_status
+{
+    FIND_OK,
+    FIND_CANCELLED,         // the colors split before the cancel are returned
+    FIND_TIMED_OUT,         // the colors split before the deadline are returned
+    FIND_DECODE_FAILED,
+    FIND_FAILED             // bad arguments or out of memory
+} t_find_status;
+
+
+typedef struct t_find_result
+{
+    t_find_status           status;
+    std::vector<cv::Vec3b>  colors;         // BGR, indexed by class id
+    std::vector<double>     weights;        // fraction of the pixels of each color
+    int                     scale;          // > 1 if decoded at 1/scale to fit the memory budget
+} t_find_result;
+
+
+typedef std::shared_ptr<t_cancel_token> t_cancel_handle;
+typedef std::function<void(const t_find_result &result)> t_find_callback;
+
+
+//
+// A new token, not cancelled.  Cancel with cancel_request.  With
+// timeout_seconds > 0 the request also stops that long from now.
+//
+t_cancel_handle create_cancel_token(double timeout_seconds = 0);
+void cancel_request(const t_cancel_handle &token);
+
+//
+// The pool async requests run on.  It is created with one worker per cpu
+// on first use and lives until exit.
+//
+t_worker_pool& get_library_pool();
+
+//
+// Admit encoded and file requests against a memory budget in bytes,
+// 0 for none (the default); see admission.h.  With 'downsample' a
+// request larger than the whole budget is decoded at a reduced scale,
+// otherwise it waits to run alone.  With a budget the per worker
+// buffers aren't kept between requests, so all a request allocates is
+// inside its admission.  Call before queuing requests.
+//
+void set_library_memory_budget(size_t bytes, bool downsample);
+t_memory_budget& get_library_budget();
+
+//
+// Run a request synchronously on the calling thread
+//
+t_find_result run_find_request(const t_find_request &request, const t_cancel_token *cancel);
+
+//
+// Queue a request on the library pool and return at once.  The
+// callback variant calls 'callback' on the pool thread that ran it;
+// the callback must not throw.
+//
+std::future<t_find_result> find_dominant_colors_async(const t_find_request &request,
+                                                      t_cancel_handle cancel = t_cancel_handle(),
+                                                      t_task_priority priority = PRIORITY_INTERACTIVE);
+void find_dominant_colors_async(const t_find_request &request, const t_find_callback &callback,
+                                t_cancel_handle cancel = t_cancel_handle(),
+                                t_task_priority priority = PRIORITY_INTERACTIVE);
+
+
+#ifdef DC_HAVE_COROUTINES
+
+//
+// co_await find_dominant_colors_co(request, token) suspends the coroutine,
+// runs the request on the library pool and resumes the coroutine on the
+// pool thread with the result.  Event loops that must resume on their own
+// thread should use the callback variant and post back to the loop.
+//
+class t_find_awaitable
+{
+public:
+    t_find_awaitable(const t_find_request &request, t_cancel_handle cancel)
+        : request(request), cancel(cancel)
+    {
+    }
+
+    bool await_ready() const
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        find_dominant_colors_async(request, [this, handle](const t_find_result &r)
+        {
+            result = r;
+            handle.resume();
+        }, cancel);
+    }
+
+    t_find_result await_resume()
+    {
+        return std::move(result);
+    }
+
+private:
+    t_find_request          request;
+    t_cancel_handle         cancel;
+    t_find_result           result;
+};
+
+
+inline t_find_awaitable find_dominant_colors_co(const t_find_request &request,
+                                                t_cancel_handle cancel = t_cancel_handle())
+{
+    return t_find_awaitable(request, cancel);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,161 @@
+#include <chrono>
+#include <mutex>
+
+#include "batch.h"
+#include "admission.h"
+#include "trace.h"
+#include "perf_counters.h"
+
+
+std::vector<t_batch_node_report> run_batch(const std::vector<std::string> &paths,
+                                           const t_batch_config &config,
+                                           const t_batch_callback &callback,
+                                           double *wall_seconds)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    t_worker_pool pool(config.threads, config.numa);
+
+    //
+    // per group image and megapixel counts
+    //
+    std::mutex mutex;
+    std::vector<size_t> images(pool.get_group_count(), 0);
+    std::vector<double> megapixels(pool.get_group_count(), 0);
+    std::vector<t_pool_group_stats> stats;
+    t_memory_budget budget(config.memory_budget);
+
+    for(size_t i = 0; i < paths.size(); ++i)
+    {
+        const uint64_t queued = is_tracing() ? get_trace_time() : 0;
+        pool.submit([&, i, queued](int group)
+        {
+            std::chrono::steady_clock::time_point image_start = std::chrono::steady_clock::now();
+            set_trace_image((int64_t)i);
+            if(queued > 0 && is_tracing())
+            {
+                trace_event("queue wait", queued, get_trace_time(), "group", group);
+            }
+            t_trace_span image_span("image");
+
+            t_batch_result result;
+            result.index = i;
+            result.path = paths[i];
+            result.node = group;
+            result.megapixels = 0;
+            result.status = SPLIT_COMPLETE;
+
+            //
+            // Size the image up from its header and wait until its
+            // footprint fits the memory budget.  Without a budget nothing
+            // is read ahead and the admission is free.
+            //
+            t_image_header header;
+            const bool known = config.memory_budget > 0 && read_image_header(paths[i], header);
+            const t_admission_plan plan = plan_admission(known ? &header : NULL, config.count, &config.split,
+                                                         config.memory_budget, config.downsample);
+            t_admission admission(budget, plan.bytes);
+            result.scale = plan.scale;
+
+            //
+            // the timeout covers the rest of the task, decode included
+            //
+            t_cancel_token token;
+            init_cancel_token(&token, config.timeout);
+
+            //
+            // Decode on the worker so the image buffer is first touched,
+            // and placed, on this worker's node.  The class map is created
+            // inside find_dominant_colors on the same thread.
+            //
+            cv::Mat img;
+            {
+                t_trace_span span("decode");
+                t_perf_scope counters(PERF_DECODE);
+                img = decode_planned(plan, paths[i]);
+            }
+            result.ok = img.data != NULL;
+            if(result.ok)
+            {
+                result.megapixels = img.rows * (double)img.cols / 1e6;
+                t_class_map classes;
+                t_color_node *root = build_color_tree(img, config.count, classes, &token, &result.status,
+                                                       &config.split);
+
+                std::vector<t_color_node*> leaves = get_leaves(root);
+                for(size_t l = 0; l < leaves.size(); ++l)
+                {
+                    if(leaves[l]->pixel_count > 0)
+                    {
+                        result.colors.push_back(get_node_color(leaves[l]));
+                        result.weights.push_back(leaves[l]->pixel_count / root->pixel_count);
+                    }
+                }
+                free_color_tree(root);
+            }
+            img.release();
+
+            std::chrono::duration<double> d = std::chrono::steady_clock::now() - image_start;
+            result.seconds = d.count();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if(result.ok)
+            {
+                images[group]++;
+                megapixels[group] += result.megapixels;
+            }
+            if(callback)
+            {
+                callback(result);
+            }
+        });
+    }
+
+    pool.wait_idle();
+    stats = pool.get_stats();
+
+    std::vector<t_batch_node_report> report;
+    for(size_t g = 0; g < stats.size(); ++g)
+    {
+        t_batch_node_report r;
+        r.pool = stats[g];
+        r.images = images[g];
+        r.megapixels = megapixels[g];
+        report.push_back(r);
+    }
+
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    if(wall_seconds)
+    {
+        *wall_seconds = d.count();
+    }
+    return report;
+}
+
+
+void print_batch_report(FILE *out, const std::vector<t_batch_node_report> &report, double wall_seconds)
+{
+    fprintf(out, "%-6s %8s %7s %8s %8s %10s %10s %10s\n",
+            "node", "workers", "pinned", "images", "stolen", "MP", "images/s", "MP/s");
+
+    size_t total_images = 0;
+    double total_mp = 0;
+    for(size_t i = 0; i < report.size(); ++i)
+    {
+        const t_batch_node_report &r = report[i];
+        total_images += r.images;
+        total_mp += r.megapixels;
+
+        fprintf(out, "%-6d %8d %7s %8zu %8zu %10.1f %10.2f %10.2f\n",
+                r.pool.node, r.pool.workers, r.pool.pinned ? "yes" : "no",
+                r.images, r.pool.stolen, r.megapixels,
+                wall_seconds > 0 ? r.images / wall_seconds : 0,
+                wall_seconds > 0 ? r.megapixels / wall_seconds : 0);
+    }
+
+    fprintf(out, "%-6s %8s %7s %8zu %8s %10.1f %10.2f %10.2f\n",
+            "total", "", "", total_images, "", total_mp,
+            wall_seconds > 0 ? total_images / wall_seconds : 0,
+            wall_seconds > 0 ? total_mp / wall_seconds : 0);
+    fprintf(out, "wall time %.2fs\n", wall_seconds);
+}
@@ -0,0 +1,82 @@
+//
+// batch.h
+//
+// Finds the dominant colors of many images on a NUMA aware worker pool.
+// Each image is decoded, split and released by a single task, so its whole
+// pipeline runs on one node and its buffers are allocated node-locally.
+//
+// With a memory budget each image is sized up from its header before it
+// is decoded and waits until its footprint fits; see admission.h.
+//
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include <opencv2/opencv.hpp>
+
+#include "worker_pool.h"
+#include "dominant_colors.h"
+
+
+typedef struct t_batch_config
+{
+    int         count;          // colors per image
+    int         threads;        // workers, 0 for one per cpu
+    bool        numa;           // group and pin the workers per NUMA node
+    double      timeout;        // seconds per image, 0 for none
+    size_t      memory_budget;  // bytes the images in flight may take, 0 for no limit
+    bool        downsample;     // decode images larger than the budget at a reduced scale
+    t_split_config split;       // how the classes are split
+} t_batch_config;
+
+
+typedef struct t_batch_result
+{
+    size_t                  index;          // position of the image in the batch
+    std::string             path;
+    bool                    ok;             // false if the image couldn't be read
+    t_split_status          status;         // SPLIT_TIMED_OUT if 'colors' is partial
+    std::vector<cv::Vec3b>  colors;
+    std::vector<double>     weights;        // fraction of the pixels of each color
+    int                     node;           // NUMA node the image was processed on
+    int                     scale;          // > 1 if decoded at 1/scale to fit the memory budget
+    double                  megapixels;
+    double                  seconds;
+} t_batch_result;
+
+
+typedef struct t_batch_node_report
+{
+    t_pool_group_stats      pool;
+    size_t                  images;
+    double                  megapixels;
+} t_batch_node_report;
+
+
+//
+// Called once per image as it completes.  Calls are serialized
+// but arrive in completion order, not input order.
+//
+typedef std::function<void(const t_batch_result &result)> t_batch_callback;
+
+
+//
+// Process every image in 'paths' and return the per-node report.
+// An image that runs past the timeout keeps the colors split so far.
+// The wall clock time of the whole batch is stored in 'wall_seconds'.
+//
+std::vector<t_batch_node_report> run_batch(const std::vector<std::string> &paths,
+                                           const t_batch_config &config,
+                                           const t_batch_callback &callback,
+                                           double *wall_seconds);
+
+//
+// Print the per-node throughput of a batch
+//
+void print_batch_report(FILE *out, const std::vector<t_batch_node_report> &report, double wall_seconds);
+
+#endif
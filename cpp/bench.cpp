@@ -0,0 +1,1469 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <chrono>
+#include <string>
+#include <atomic>
+#include <new>
+#include <queue>
+#include <thread>
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+
+#include "dominant_colors.h"
+#include "buffer_allocator.h"
+#include "palette.h"
+#include "palette_index.h"
+#include "palette_distance.h"
+#include "worker_pool.h"
+#include "perf_counters.h"
+#include "trace.h"
+#include "metrics.h"
+
+using namespace std;
+
+
+//
+// Benchmarks for the dominant color engine.
+//
+// Usage: benchDominantColors <mode> [--name=value ...]
+//
+
+
+//
+// A counting allocator.  Every heap allocation made by this process while
+// g_count_allocations is set is counted, both through operator new and,
+// on glibc, through malloc and friends (OpenCV allocates with malloc).
+//
+static std::atomic<bool> g_count_allocations(false);
+static std::atomic<size_t> g_allocation_count(0);
+
+static inline void count_allocation()
+{
+    if(g_count_allocations)
+    {
+        g_allocation_count++;
+    }
+}
+
+#if defined(__GLIBC__)
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t n, size_t size);
+extern "C" void* __libc_realloc(void *ptr, size_t size);
+extern "C" void* __libc_memalign(size_t alignment, size_t size);
+
+extern "C" void* malloc(size_t size)
+{
+    count_allocation();
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t n, size_t size)
+{
+    count_allocation();
+    return __libc_calloc(n, size);
+}
+
+extern "C" void* realloc(void *ptr, size_t size)
+{
+    count_allocation();
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    count_allocation();
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr ? 0 : 12;
+}
+#endif
+
+void* operator new(size_t size)
+{
+    count_allocation();
+    void *ptr = malloc(size ? size : 1);
+    if(!ptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+
+//
+// Returns the value of '--name=value' from the cmd line or 'fallback'
+//
+static double get_option(int argc, char* argv[], const char *name, double fallback)
+{
+    const size_t len = strlen(name);
+    for(int i = 2; i < argc; ++i)
+    {
+        if(strncmp(argv[i], "--", 2) == 0 &&
+           strncmp(argv[i] + 2, name, len) == 0 &&
+           argv[i][2 + len] == '=')
+        {
+            return atof(argv[i] + 3 + len);
+        }
+    }
+    return fallback;
+}
+
+
+//
+// True if the bare '--name' flag is on the cmd line
+//
+static bool has_flag(int argc, char* argv[], const char *name)
+{
+    for(int i = 2; i < argc; ++i)
+    {
+        if(strncmp(argv[i], "--", 2) == 0 && strcmp(argv[i] + 2, name) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double, std::milli> d = std::chrono::steady_clock::now() - start;
+    return d.count();
+}
+
+
+//
+// Fill an image with a smooth gradient plus noise so that the
+// splits have some real structure to work on.
+//
+static void fill_synthetic_image(cv::Mat img, unsigned int seed)
+{
+    srand(seed);
+    for(int y = 0; y < img.rows; ++y)
+    {
+        cv::Vec3b *ptr = img.ptr<cv::Vec3b>(y);
+        for(int x = 0; x < img.cols; ++x)
+        {
+            ptr[x] = cv::Vec3b((uchar)((x * 255 / img.cols + rand() % 32) & 0xff),
+                               (uchar)((y * 255 / img.rows + rand() % 32) & 0xff),
+                               (uchar)(((x + y) * 127 / (img.cols + img.rows) + rand() % 64) & 0xff));
+        }
+    }
+}
+
+
+//
+// The bytes of this process currently backed by transparent huge pages,
+// or -1 if the kernel doesn't report it.
+//
+static long get_anon_huge_page_kb()
+{
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if(!f)
+    {
+        return -1;
+    }
+
+    char line[256];
+    long kb = -1;
+    while(fgets(line, sizeof(line), f))
+    {
+        if(sscanf(line, "AnonHugePages: %ld kB", &kb) == 1)
+        {
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+
+//
+// Run the per-pixel pipeline over a large synthetic image with and without
+// huge page advice on the working buffers.
+//
+static int bench_alloc(int argc, char* argv[])
+{
+    const double megapixels = get_option(argc, argv, "megapixels", 50);
+    const int count = (int)get_option(argc, argv, "count", 8);
+    const int repeat = (int)get_option(argc, argv, "repeat", 3);
+
+    const int width = 8000;
+    const int height = (int)(megapixels * 1000000 / width);
+
+    char thp[128] = "unknown";
+    FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if(f)
+    {
+        if(fgets(thp, sizeof(thp), f))
+        {
+            thp[strcspn(thp, "\n")] = 0;
+        }
+        fclose(f);
+    }
+
+    printf("image %dx%d (%.1f MP), %d colors, %d runs\n", width, height, megapixels, count, repeat);
+    printf("transparent_hugepage: %s\n\n", thp);
+
+    //
+    // counters are reset per mode and reported after its row
+    //
+    const bool perf_counters = has_flag(argc, argv, "perf-counters");
+    printf("%-12s %12s %12s %12s %16s\n", "huge_pages", "tree_ms", "render_ms", "total_ms", "AnonHugePages_kB");
+
+    for(int mode = 0; mode < 2; ++mode)
+    {
+        t_buffer_config config = get_default_buffer_config();
+        config.huge_pages = (mode == 1);
+        set_buffer_config(config);
+
+        const char *reason = NULL;
+        const bool counting = perf_counters && start_perf_counters(&reason);
+
+        double tree_ms = 0;
+        double render_ms = 0;
+        long huge_kb = 0;
+        for(int r = 0; r < repeat; ++r)
+        {
+            cv::Mat img = create_buffer_mat(height, width, CV_8UC3, cv::Scalar(0));
+            fill_synthetic_image(img, 1234);
+
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            t_class_map classes;
+            t_color_node *root = build_color_tree(img, count, classes);
+            tree_ms += elapsed_ms(start);
+
+            start = std::chrono::steady_clock::now();
+            cv::Mat quantized = get_quantized_image(classes, root);
+            cv::Mat viewable = get_viewable_image(classes);
+            render_ms += elapsed_ms(start);
+
+            huge_kb = get_anon_huge_page_kb();
+            free_color_tree(root);
+        }
+
+        printf("%-12s %12.1f %12.1f %12.1f %16ld\n", config.huge_pages ? "on" : "off",
+               tree_ms / repeat, render_ms / repeat, (tree_ms + render_ms) / repeat, huge_kb);
+
+        if(counting)
+        {
+            stop_perf_counters();
+            printf("\n");
+            print_perf_report(stdout);
+            printf("\n");
+        }
+        else if(perf_counters)
+        {
+            printf("hardware counters unavailable: %s\n", reason);
+        }
+    }
+
+    return 0;
+}
+
+
+//
+// A split config checked by bench_noalloc.  'allocates' marks the center
+// and saliency weightings, whose small weight map is the one documented
+// allocation; their count is reported but doesn't fail the check.
+// 'traced' runs the config with tracing and metrics recording.
+//
+typedef struct t_noalloc_case
+{
+    const char          *name;
+    t_split_config      config;
+    bool                allocates;
+    bool                traced;
+} t_noalloc_case;
+
+
+//
+// Compare the palette of find_dominant_colors_into with the leaves of
+// build_color_tree, which index it by class id.  Returns false on the
+// first color or weight that differs.
+//
+static bool matches_color_tree(cv::Mat img, int count, const t_split_config &config, int found,
+                               const cv::Vec3b *colors, const double *weights)
+{
+    t_class_map classes;
+    t_color_node *root = build_color_tree(img, count, classes, NULL, NULL, &config);
+    std::vector<t_color_node*> leaves = get_leaves(root);
+
+    bool match = (int)leaves.size() == found;
+    const double total = root->pixel_count;
+    for(size_t i = 0; match && i < leaves.size(); ++i)
+    {
+        const int id = leaves[i]->classid;
+        const double weight = total > 0 ? leaves[i]->pixel_count / total : 0;
+        match = id >= 0 && id < found && colors[id] == get_node_color(leaves[i]) &&
+                fabs(weights[id] - weight) <= 1e-12;
+    }
+
+    free_color_tree(root);
+    return match;
+}
+
+
+//
+// Check that find_dominant_colors_into makes no heap allocations, for
+// every split policy, exclusion rule and weighting and with tracing and
+// metrics on, and that its palette matches build_color_tree's.  Also
+// compares its time with build_color_tree.  Each config is warmed up
+// once first, so the per thread trace ring and metrics slot are in
+// place.  Exits with 1 on an allocation or a mismatch.
+//
+static int bench_noalloc(int argc, char* argv[])
+{
+    const double megapixels = get_option(argc, argv, "megapixels", 2);
+    const int repeat = (int)get_option(argc, argv, "repeat", 5);
+    const int counts[] = { 1, 4, 6, 16, 64, 300 };
+    const int count_count = sizeof(counts) / sizeof(counts[0]);
+
+    const int width = 2000;
+    const int height = (int)(megapixels * 1000000 / width);
+    cv::Mat img(height, width, CV_8UC3);
+    fill_synthetic_image(img, 42);
+
+    //
+    // a flat backdrop around the image gives the border rule a fill,
+    // and white, black and gray patches give the color rules pixels
+    //
+    const int margin = height / 8;
+    for(int y = 0; y < height; ++y)
+    {
+        cv::Vec3b *ptr = img.ptr<cv::Vec3b>(y);
+        for(int x = 0; x < width; ++x)
+        {
+            if(y < margin || y >= height - margin || x < margin || x >= width - margin)
+            {
+                ptr[x] = cv::Vec3b(240, 240, 240);
+            }
+            else if(y < height / 2 && x < width / 4)
+            {
+                ptr[x] = cv::Vec3b(255, 255, 255);
+            }
+            else if(y < height / 2 && x < width / 3)
+            {
+                ptr[x] = cv::Vec3b(5, 5, 5);
+            }
+            else if(y < height / 2 && x < width / 2)
+            {
+                ptr[x] = cv::Vec3b(128, 130, 129);
+            }
+        }
+    }
+
+    cv::Mat weight_map(height / 4, width / 4, CV_8UC1);
+    for(int y = 0; y < weight_map.rows; ++y)
+    {
+        uchar *ptr = weight_map.ptr<uchar>(y);
+        for(int x = 0; x < weight_map.cols; ++x)
+        {
+            ptr[x] = (uchar)((x + y) % 256);
+        }
+    }
+
+    std::vector<t_noalloc_case> cases;
+    const char *names[] = { "default", "border", "colors", "excl-all", "sse", "optimal", "count",
+                            "center", "saliency", "map", "traced" };
+    const int case_count = sizeof(names) / sizeof(names[0]);
+    for(int k = 0; k < case_count; ++k)
+    {
+        t_noalloc_case c;
+        c.name = names[k];
+        c.config = get_default_split_config();
+        c.allocates = false;
+        c.traced = false;
+        cases.push_back(c);
+    }
+    cases[1].config.exclude = EXCLUDE_BORDER;
+    cases[2].config.exclude = EXCLUDE_WHITE | EXCLUDE_BLACK | EXCLUDE_GRAY;
+    cases[3].config.exclude = EXCLUDE_WHITE | EXCLUDE_BLACK | EXCLUDE_GRAY | EXCLUDE_BORDER;
+    cases[4].config.policy = SPLIT_MAX_SSE_REDUCTION;
+    cases[5].config.optimal_threshold = true;
+    cases[6].config.policy = SPLIT_MAX_COUNT;
+    cases[7].config.weighting = WEIGHT_CENTER;
+    cases[7].allocates = true;
+    cases[8].config.weighting = WEIGHT_SALIENCY;
+    cases[8].allocates = true;
+    cases[9].config.weighting = WEIGHT_MAP;
+    cases[9].config.weight_map = weight_map;
+    cases[10].traced = true;
+
+    //
+    // buffers big enough for the largest count and every config
+    //
+    const int max_count = counts[count_count - 1];
+    size_t class_map_size = 0;
+    size_t scratch_size = 0;
+    for(size_t k = 0; k < cases.size(); ++k)
+    {
+        class_map_size = std::max(class_map_size,
+                                  get_class_map_size(width, height, get_class_map_count(max_count, &cases[k].config)));
+        scratch_size = std::max(scratch_size, get_scratch_size(max_count, &cases[k].config));
+    }
+    std::vector<cv::Vec3b> colors(max_count);
+    std::vector<double> weights(max_count);
+    std::vector<uchar> class_map(class_map_size);
+    std::vector<uchar> scratch_memory(scratch_size);
+    t_arena scratch;
+    scratch.base = &scratch_memory[0];
+    scratch.size = scratch_memory.size();
+    scratch.used = 0;
+
+    printf("image %dx%d, %d runs per count\n\n", width, height, repeat);
+    printf("%-9s %-6s %8s %14s %8s %16s %12s\n", "config", "count", "colors", "allocations", "palette",
+           "into_ms", "tree_ms");
+
+    int failures = 0;
+    for(size_t k = 0; k < cases.size(); ++k)
+    {
+        const t_split_config *config = &cases[k].config;
+        if(cases[k].traced)
+        {
+            start_trace();
+            start_metrics();
+        }
+
+        for(int c = 0; c < count_count; ++c)
+        {
+            const int count = counts[c];
+
+            find_dominant_colors_into(img, count, &colors[0], &weights[0], &class_map[0], class_map.size(),
+                                      &scratch, NULL, NULL, config);
+
+            g_allocation_count = 0;
+            g_count_allocations = true;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            int found = 0;
+            for(int r = 0; r < repeat; ++r)
+            {
+                found = find_dominant_colors_into(img, count, &colors[0], &weights[0],
+                                                  &class_map[0], class_map.size(), &scratch,
+                                                  NULL, NULL, config);
+            }
+            const double into_ms = elapsed_ms(start) / repeat;
+            g_count_allocations = false;
+            const size_t allocations = g_allocation_count;
+
+            start = std::chrono::steady_clock::now();
+            for(int r = 0; r < repeat; ++r)
+            {
+                t_class_map classes;
+                free_color_tree(build_color_tree(img, count, classes, NULL, NULL, config));
+            }
+            const double tree_ms = elapsed_ms(start) / repeat;
+
+            const bool match = found > 0 && matches_color_tree(img, count, *config, found, &colors[0], &weights[0]);
+
+            printf("%-9s %-6d %8d %14zu %8s %16.2f %12.2f\n", cases[k].name, count, found, allocations,
+                   match ? "same" : "DIFFERS", into_ms, tree_ms);
+            if((allocations > 0 && !cases[k].allocates) || !match)
+            {
+                failures++;
+            }
+        }
+
+        if(cases[k].traced)
+        {
+            stop_trace();
+        }
+    }
+
+    printf("\n%s\n", failures ? "FAILED: find_dominant_colors_into allocated or its palette differs"
+                              : "OK: no allocations beyond the weight maps, and the same palettes");
+    return failures ? 1 : 0;
+}
+
+
+//
+// The resident set size of this process in MB
+//
+static double get_rss_mb()
+{
+    FILE *f = fopen("/proc/self/status", "r");
+    if(!f)
+    {
+        return -1;
+    }
+
+    char line[256];
+    long kb = -1;
+    while(fgets(line, sizeof(line), f))
+    {
+        if(sscanf(line, "VmRSS: %ld kB", &kb) == 1)
+        {
+            break;
+        }
+    }
+    fclose(f);
+    return kb / 1024.0;
+}
+
+
+//
+// Synthetic palettes of 3 to 8 colors.  Each color is a jittered copy of
+// a color from one of 'themes', so palettes drawn from the same theme are
+// near neighbors, as photos of similar scenes are.
+//
+static void make_synthetic_palettes(const std::vector<std::vector<cv::Vec3b> > &themes, size_t count,
+                                    unsigned int seed, std::vector<t_palette> &palettes)
+{
+    srand(seed);
+    palettes.resize(count);
+    for(size_t i = 0; i < count; ++i)
+    {
+        const std::vector<cv::Vec3b> &theme = themes[rand() % themes.size()];
+        const int n = 3 + rand() % 6;
+
+        std::vector<cv::Vec3b> colors(n);
+        std::vector<double> weights(n);
+        for(int c = 0; c < n; ++c)
+        {
+            const cv::Vec3b base = theme[rand() % theme.size()];
+            for(int k = 0; k < 3; ++k)
+            {
+                colors[c][k] = (uchar)std::min(255, std::max(0, base[k] + rand() % 25 - 12));
+            }
+            weights[c] = 1 + rand() % 100;
+        }
+        palettes[i] = make_palette(colors, weights);
+    }
+}
+
+
+//
+// Build a palette index over synthetic palettes and measure query
+// latency and recall against an exact search at several 'ef'.
+//
+static int bench_index(int argc, char* argv[])
+{
+    const size_t count = (size_t)get_option(argc, argv, "palettes", 1000000);
+    const int queries = (int)get_option(argc, argv, "queries", 200);
+    const int k = (int)get_option(argc, argv, "k", 10);
+    const int m = (int)get_option(argc, argv, "m", 16);
+    const int ef_construction = (int)get_option(argc, argv, "ef-construction", 100);
+    const int threads = (int)get_option(argc, argv, "threads", 0);
+
+    srand(42);
+    std::vector<std::vector<cv::Vec3b> > themes(4096);
+    for(size_t t = 0; t < themes.size(); ++t)
+    {
+        themes[t].resize(8);
+        for(size_t c = 0; c < themes[t].size(); ++c)
+        {
+            themes[t][c] = cv::Vec3b((uchar)(rand() % 256), (uchar)(rand() % 256), (uchar)(rand() % 256));
+        }
+    }
+
+    std::vector<t_palette> palettes;
+    std::vector<t_palette> query_palettes;
+    make_synthetic_palettes(themes, count, 1, palettes);
+    make_synthetic_palettes(themes, queries, 2, query_palettes);
+    std::vector<std::string> names(count);
+
+    printf("%zu palettes, m %d, ef_construction %d, %d queries, k %d\n\n", count, m, ef_construction, queries, k);
+
+    const double rss_before = get_rss_mb();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    t_palette_index index(m, ef_construction);
+    index.add(names, palettes, threads);
+    const double build_ms = elapsed_ms(start);
+    printf("build %.1fs (%.0f palettes/s), index %.0f MB\n\n", build_ms / 1000, count / (build_ms / 1000),
+           get_rss_mb() - rss_before);
+    palettes.clear();
+
+    start = std::chrono::steady_clock::now();
+    std::vector<std::vector<t_palette_match> > exact(queries);
+    for(int q = 0; q < queries; ++q)
+    {
+        exact[q] = index.search_exact(query_palettes[q], k);
+    }
+    const double exact_ms = elapsed_ms(start) / queries;
+
+    printf("%-8s %12s %12s %10s\n", "ef", "us/query", "queries/s", "recall");
+    printf("%-8s %12.1f %12.1f %10.4f\n", "exact", exact_ms * 1000, 1000 / exact_ms, 1.0);
+
+    const int efs[] = { 16, 32, 64, 128, 256 };
+    for(size_t e = 0; e < sizeof(efs) / sizeof(efs[0]); ++e)
+    {
+        size_t hits = 0;
+        size_t total = 0;
+        start = std::chrono::steady_clock::now();
+        for(int q = 0; q < queries; ++q)
+        {
+            std::vector<t_palette_match> found = index.search(query_palettes[q], k, efs[e]);
+
+            //
+            // a hit is any result within the exact k-th distance, so ties count
+            //
+            const float limit = exact[q].empty() ? 0 : exact[q].back().distance;
+            for(size_t i = 0; i < found.size(); ++i)
+            {
+                hits += found[i].distance <= limit;
+            }
+            total += exact[q].size();
+        }
+        const double ms = elapsed_ms(start) / queries;
+        printf("%-8d %12.1f %12.1f %10.4f\n", efs[e], ms * 1000, 1000 / ms, total ? hits / (double)total : 0);
+    }
+
+    return 0;
+}
+
+
+//
+// Compare palette distances one at a time with get_palette_distance
+// against the batched kernels on one thread and on every cpu.
+//
+static int bench_distance(int argc, char* argv[])
+{
+    const size_t count = (size_t)get_option(argc, argv, "palettes", 200000);
+    const size_t rows = (size_t)get_option(argc, argv, "rows", 500);
+    const int threads = (int)get_option(argc, argv, "threads", 0);
+
+    srand(42);
+    std::vector<std::vector<cv::Vec3b> > themes(256);
+    for(size_t t = 0; t < themes.size(); ++t)
+    {
+        themes[t].resize(8);
+        for(size_t c = 0; c < themes[t].size(); ++c)
+        {
+            themes[t][c] = cv::Vec3b((uchar)(rand() % 256), (uchar)(rand() % 256), (uchar)(rand() % 256));
+        }
+    }
+
+    std::vector<t_palette> palettes;
+    make_synthetic_palettes(themes, count, 1, palettes);
+    const t_palette_batch batch = make_palette_batch(palettes);
+    std::vector<float> distances(std::max(count, rows * rows));
+
+    printf("%zu palettes, %zu x %zu matrix\n\n", count, rows, rows);
+    printf("%-10s %-10s %-10s %12s %14s\n", "metric", "shape", "engine", "ms", "pairs/s");
+
+    //
+    // one against many
+    //
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    float checksum = 0;
+    for(size_t i = 0; i < count; ++i)
+    {
+        distances[i] = get_palette_distance(palettes[0], palettes[i]);
+        checksum += distances[i];
+    }
+    double ms = elapsed_ms(start);
+    printf("%-10s %-10s %-10s %12.1f %14.0f\n", "chamfer", "1:N", "scalar", ms, count / ms * 1000);
+
+    float max_error = 0;
+    for(int metric = 0; metric < 2; ++metric)
+    {
+        for(int engine = 0; engine < 2; ++engine)
+        {
+            t_distance_config config = get_default_distance_config();
+            config.metric = metric == 0 ? PALETTE_CHAMFER : PALETTE_SINKHORN;
+            config.threads = engine == 0 ? 1 : threads;
+
+            const size_t n = metric == 0 ? count : count / 10;
+            t_palette_batch targets = batch;
+            targets.count = n;
+
+            start = std::chrono::steady_clock::now();
+            get_palette_distances(palettes[0], targets, config, &distances[0]);
+            ms = elapsed_ms(start);
+            printf("%-10s %-10s %-10s %12.1f %14.0f\n", metric == 0 ? "chamfer" : "sinkhorn", "1:N",
+                   engine == 0 ? "batch x1" : "batch", ms, n / ms * 1000);
+
+            if(metric == 0)
+            {
+                for(size_t i = 0; i < n; ++i)
+                {
+                    max_error = std::max(max_error, fabsf(distances[i] - get_palette_distance(palettes[0], palettes[i])));
+                }
+            }
+        }
+    }
+
+    //
+    // many against many
+    //
+    std::vector<t_palette> first(palettes.begin(), palettes.begin() + std::min(rows, count));
+    const t_palette_batch matrix = make_palette_batch(first);
+    for(int metric = 0; metric < 2; ++metric)
+    {
+        t_distance_config config = get_default_distance_config();
+        config.metric = metric == 0 ? PALETTE_CHAMFER : PALETTE_SINKHORN;
+        config.threads = threads;
+
+        start = std::chrono::steady_clock::now();
+        get_palette_distance_matrix(matrix, matrix, config, &distances[0]);
+        ms = elapsed_ms(start);
+        const double pairs = (double)matrix.count * matrix.count;
+        printf("%-10s %-10s %-10s %12.1f %14.0f\n", metric == 0 ? "chamfer" : "sinkhorn", "N:N", "batch",
+               ms, pairs / ms * 1000);
+    }
+
+    printf("\nlargest difference from get_palette_distance: %g (checksum %g)\n", max_error, checksum);
+    return 0;
+}
+
+
+//
+// The original implementation from main.cpp, kept as the reference the
+// engine is measured against: a byte per pixel class map starting at 1,
+// a cv::Mat per pixel for the sums and a tree walk for every choice.
+// Only the png output is left out.
+//
+typedef struct t_reference_node
+{
+    cv::Mat     mean;
+    cv::Mat     covariance;
+    uchar       classid;
+
+    t_reference_node *left;
+    t_reference_node *right;
+} t_reference_node;
+
+
+static void reference_mean_cov(cv::Mat img, cv::Mat classes, t_reference_node *node)
+{
+    cv::Mat mean = cv::Mat(3, 1, CV_64FC1, cv::Scalar(0));
+    cv::Mat cov  = cv::Mat(3, 3, CV_64FC1, cv::Scalar(0));
+
+    double pixcount = 0;
+    for(int y = 0; y < img.rows; ++y)
+    {
+        cv::Vec3b *ptr = img.ptr<cv::Vec3b>(y);
+        uchar *ptrClass = classes.ptr<uchar>(y);
+        for(int x = 0; x < img.cols; ++x)
+        {
+            if(ptrClass[x] != node->classid)
+            {
+                continue;
+            }
+
+            cv::Mat scaled = cv::Mat(3, 1, CV_64FC1, cv::Scalar(0));
+            scaled.at<double>(0) = ptr[x][0] / 255.0f;
+            scaled.at<double>(1) = ptr[x][1] / 255.0f;
+            scaled.at<double>(2) = ptr[x][2] / 255.0f;
+
+            mean = mean + scaled;
+            cov  = cov + (scaled * scaled.t());
+            pixcount++;
+        }
+    }
+
+    cov = cov - (mean * mean.t()) / pixcount;
+    mean = mean / pixcount;
+
+    node->mean = mean.clone();
+    node->covariance = cov.clone();
+}
+
+
+static void reference_leaves(t_reference_node *root, std::vector<t_reference_node*> &leaves)
+{
+    std::queue<t_reference_node*> queue;
+    queue.push(root);
+    while(queue.size() > 0)
+    {
+        t_reference_node *current = queue.front();
+        queue.pop();
+        if(current->left && current->right)
+        {
+            queue.push(current->left);
+            queue.push(current->right);
+            continue;
+        }
+        leaves.push_back(current);
+    }
+}
+
+
+static t_reference_node* reference_max_eigenvalue_node(t_reference_node *root)
+{
+    std::vector<t_reference_node*> leaves;
+    reference_leaves(root, leaves);
+
+    double max_eigen = -1;
+    t_reference_node *ret = root;
+    cv::Mat eigenvalues, eigenvectors;
+    for(size_t i = 0; i < leaves.size(); ++i)
+    {
+        cv::eigen(leaves[i]->covariance, eigenvalues, eigenvectors);
+        if(eigenvalues.at<double>(0) > max_eigen)
+        {
+            max_eigen = eigenvalues.at<double>(0);
+            ret = leaves[i];
+        }
+    }
+    return ret;
+}
+
+
+static void reference_partition(cv::Mat img, cv::Mat classes, uchar nextid, t_reference_node *node)
+{
+    cv::Mat eigenvalues, eigenvectors;
+    cv::eigen(node->covariance, eigenvalues, eigenvectors);
+    cv::Mat eig = eigenvectors.row(0);
+    cv::Mat comparison_value = eig * node->mean;
+
+    node->left = new t_reference_node();
+    node->right = new t_reference_node();
+    node->left->classid = nextid;
+    node->right->classid = nextid + 1;
+
+    for(int y = 0; y < img.rows; ++y)
+    {
+        cv::Vec3b *ptr = img.ptr<cv::Vec3b>(y);
+        uchar *ptrClass = classes.ptr<uchar>(y);
+        for(int x = 0; x < img.cols; ++x)
+        {
+            if(ptrClass[x] != node->classid)
+            {
+                continue;
+            }
+
+            cv::Mat scaled = cv::Mat(3, 1, CV_64FC1, cv::Scalar(0));
+            scaled.at<double>(0) = ptr[x][0] / 255.0f;
+            scaled.at<double>(1) = ptr[x][1] / 255.0f;
+            scaled.at<double>(2) = ptr[x][2] / 255.0f;
+
+            cv::Mat this_value = eig * scaled;
+            ptrClass[x] = this_value.at<double>(0, 0) <= comparison_value.at<double>(0, 0) ? node->left->classid
+                                                                                           : node->right->classid;
+        }
+    }
+}
+
+
+static void reference_free(t_reference_node *node)
+{
+    if(node)
+    {
+        reference_free(node->left);
+        reference_free(node->right);
+        delete node;
+    }
+}
+
+
+static std::vector<cv::Vec3b> reference_find_dominant_colors(cv::Mat img, int count)
+{
+    cv::Mat classes = cv::Mat(img.rows, img.cols, CV_8UC1, cv::Scalar(1));
+    t_reference_node *root = new t_reference_node();
+    root->classid = 1;
+    reference_mean_cov(img, classes, root);
+
+    //
+    // class ids are handed out in order, so the next is 2 * i + 2
+    //
+    for(int i = 0; i < count - 1; ++i)
+    {
+        t_reference_node *next = reference_max_eigenvalue_node(root);
+        reference_partition(img, classes, (uchar)(2 * i + 2), next);
+        reference_mean_cov(img, classes, next->left);
+        reference_mean_cov(img, classes, next->right);
+    }
+
+    std::vector<t_reference_node*> leaves;
+    reference_leaves(root, leaves);
+    std::vector<cv::Vec3b> colors;
+    for(size_t i = 0; i < leaves.size(); ++i)
+    {
+        cv::Mat mean = leaves[i]->mean;
+        colors.push_back(cv::Vec3b(mean.at<double>(0) * 255.0f, mean.at<double>(1) * 255.0f,
+                                   mean.at<double>(2) * 255.0f));
+    }
+
+    reference_free(root);
+    return colors;
+}
+
+
+//
+// The peak resident set size of this process in MB.  Writing 5 to
+// clear_refs resets the peak, so each configuration reports its own;
+// where that isn't allowed the peak is the process's so far.
+//
+static void reset_peak_rss()
+{
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if(f)
+    {
+        fputs("5", f);
+        fclose(f);
+    }
+}
+
+
+static double get_peak_rss_mb()
+{
+    FILE *f = fopen("/proc/self/status", "r");
+    if(!f)
+    {
+        return -1;
+    }
+
+    char line[256];
+    long kb = -1;
+    while(fgets(line, sizeof(line), f))
+    {
+        if(sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+        {
+            break;
+        }
+    }
+    fclose(f);
+    return kb / 1024.0;
+}
+
+
+typedef struct t_scaling_row
+{
+    const char  *experiment;        // strong, weak or reference
+    double      megapixels;         // of one image
+    int         width;
+    int         height;
+    int         threads;
+    int         images;
+    double      seconds;
+    double      speedup;
+    double      efficiency;
+    double      mp_per_second;
+    double      peak_rss_mb;
+} t_scaling_row;
+
+
+static void print_scaling_row(const t_scaling_row &row, bool json, bool first)
+{
+    if(json)
+    {
+        printf("%s\n  {\"experiment\": \"%s\", \"megapixels\": %.4f, \"width\": %d, \"height\": %d, "
+               "\"threads\": %d, \"images\": %d, \"seconds\": %.6f, \"speedup\": %.4f, \"efficiency\": %.4f, "
+               "\"mp_per_second\": %.3f, \"peak_rss_mb\": %.1f}",
+               first ? "" : ",", row.experiment, row.megapixels, row.width, row.height, row.threads, row.images,
+               row.seconds, row.speedup, row.efficiency, row.mp_per_second, row.peak_rss_mb);
+    }
+    else
+    {
+        printf("%s,%.4f,%d,%d,%d,%d,%.6f,%.4f,%.4f,%.3f,%.1f\n", row.experiment, row.megapixels, row.width,
+               row.height, row.threads, row.images, row.seconds, row.speedup, row.efficiency, row.mp_per_second,
+               row.peak_rss_mb);
+    }
+    fflush(stdout);
+}
+
+
+//
+// Split 'images' copies of 'img' on a pool of 'threads' workers and
+// return the wall clock seconds.  The image is shared read only; every
+// task builds and frees its own tree and class map, as a batch does.
+//
+static double run_scaling_workload(cv::Mat img, int count, int threads, int images, bool numa)
+{
+    t_worker_pool pool(threads, numa);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for(int i = 0; i < images; ++i)
+    {
+        pool.submit([img, count](int)
+        {
+            t_class_map classes;
+            t_color_node *root = build_color_tree(img, count, classes);
+            free_color_tree(root);
+        });
+    }
+    pool.wait_idle();
+    return elapsed_ms(start) / 1000;
+}
+
+
+//
+// Strong scaling splits a fixed number of images over 1..N threads, weak
+// scaling gives every thread the same number of images.  Sizes run from a
+// thumbnail to --max-megapixels.  Every image size gets enough images per
+// thread to make up about --work-megapixels, so small sizes aren't timed
+// on a handful of microseconds.
+//
+// Strong rows report speedup T1/Tn and efficiency speedup/n.  Weak rows
+// report the scaled speedup n*T1/Tn and efficiency T1/Tn.  Reference rows
+// time the original implementation on one image, up to
+// --reference-megapixels, with 'speedup' the engine's single thread gain
+// over it.  Rows go to stdout as CSV, or JSON with --json.
+//
+static int bench_scaling(int argc, char* argv[])
+{
+    const int max_threads = (int)get_option(argc, argv, "threads", std::thread::hardware_concurrency());
+    const double max_megapixels = get_option(argc, argv, "max-megapixels", 100);
+    const double work_megapixels = get_option(argc, argv, "work-megapixels", 12);
+    const double reference_megapixels = get_option(argc, argv, "reference-megapixels", 2);
+    const int count = (int)get_option(argc, argv, "count", 8);
+    const bool numa = !has_flag(argc, argv, "no-numa");
+    const bool json = has_flag(argc, argv, "json");
+
+    std::vector<int> thread_counts;
+    for(int t = 1; t < max_threads; t *= 2)
+    {
+        thread_counts.push_back(t);
+    }
+    thread_counts.push_back(std::max(max_threads, 1));
+
+    const double sizes[] = { 0.02, 1, 12, 100 };
+
+    if(json)
+    {
+        printf("[");
+    }
+    else
+    {
+        printf("experiment,megapixels,width,height,threads,images,seconds,speedup,efficiency,mp_per_second,peak_rss_mb\n");
+    }
+
+    bool first = true;
+    for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && sizes[s] <= max_megapixels; ++s)
+    {
+        //
+        // 4:3 synthetic images
+        //
+        const int width = (int)lrint(sqrt(sizes[s] * 1000000 * 4 / 3));
+        const int height = (int)lrint(sizes[s] * 1000000 / width);
+        const double megapixels = (double)width * height / 1000000;
+        cv::Mat img = create_buffer_mat(height, width, CV_8UC3, cv::Scalar(0));
+        fill_synthetic_image(img, 1234);
+
+        const int per_thread = std::max(1, (int)ceil(work_megapixels / megapixels));
+
+        for(int experiment = 0; experiment < 2; ++experiment)
+        {
+            const bool strong = experiment == 0;
+            double base_seconds = 0;
+            for(size_t t = 0; t < thread_counts.size(); ++t)
+            {
+                const int threads = thread_counts[t];
+                const int images = per_thread * (strong ? thread_counts.back() : threads);
+
+                reset_peak_rss();
+                t_scaling_row row;
+                row.experiment = strong ? "strong" : "weak";
+                row.megapixels = megapixels;
+                row.width = width;
+                row.height = height;
+                row.threads = threads;
+                row.images = images;
+                row.seconds = run_scaling_workload(img, count, threads, images, numa);
+                row.peak_rss_mb = get_peak_rss_mb();
+                row.mp_per_second = megapixels * images / row.seconds;
+                if(t == 0)
+                {
+                    base_seconds = row.seconds;
+                }
+                if(strong)
+                {
+                    row.speedup = base_seconds / row.seconds;
+                    row.efficiency = row.speedup / threads;
+                }
+                else
+                {
+                    row.efficiency = base_seconds / row.seconds;
+                    row.speedup = row.efficiency * threads;
+                }
+                print_scaling_row(row, json, first);
+                first = false;
+            }
+        }
+
+        if(megapixels <= reference_megapixels && count < 128)
+        {
+            const double engine_seconds = run_scaling_workload(img, count, 1, 1, numa);
+
+            reset_peak_rss();
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            reference_find_dominant_colors(img, count);
+
+            t_scaling_row row;
+            row.experiment = "reference";
+            row.megapixels = megapixels;
+            row.width = width;
+            row.height = height;
+            row.threads = 1;
+            row.images = 1;
+            row.seconds = elapsed_ms(start) / 1000;
+            row.peak_rss_mb = get_peak_rss_mb();
+            row.mp_per_second = megapixels / row.seconds;
+            row.speedup = row.seconds / engine_seconds;
+            row.efficiency = 1;
+            print_scaling_row(row, json, first);
+            first = false;
+        }
+    }
+
+    if(json)
+    {
+        printf("\n]\n");
+    }
+    return 0;
+}
+
+
+//
+// The quantization error of 'quantized' against 'img': the mean squared
+// error per channel, in 0-255 units, and the mean CIE76 delta E.  Runs of
+// identical pixel pairs reuse the last L*a*b* conversion.
+//
+static void get_quantization_error(cv::Mat img, cv::Mat quantized, double &mse, double &delta_e)
+{
+    double squared = 0;
+    double delta = 0;
+    for(int y = 0; y < img.rows; ++y)
+    {
+        const cv::Vec3b *ptr = img.ptr<cv::Vec3b>(y);
+        const cv::Vec3b *ptrQuantized = quantized.ptr<cv::Vec3b>(y);
+
+        cv::Vec3b last = ptr[0];
+        cv::Vec3b last_quantized = ptrQuantized[0];
+        double last_delta = -1;
+        for(int x = 0; x < img.cols; ++x)
+        {
+            for(int k = 0; k < 3; ++k)
+            {
+                const double d = (double)ptr[x][k] - ptrQuantized[x][k];
+                squared += d * d;
+            }
+
+            if(last_delta < 0 || ptr[x] != last || ptrQuantized[x] != last_quantized)
+            {
+                last = ptr[x];
+                last_quantized = ptrQuantized[x];
+                float a[3], b[3];
+                bgr_to_lab(last, a);
+                bgr_to_lab(last_quantized, b);
+                last_delta = sqrt((a[0] - b[0]) * (a[0] - b[0]) + (a[1] - b[1]) * (a[1] - b[1]) +
+                                  (a[2] - b[2]) * (a[2] - b[2]));
+            }
+            delta += last_delta;
+        }
+    }
+
+    const double pixels = (double)img.rows * img.cols;
+    mse = squared / (pixels * 3);
+    delta_e = delta / pixels;
+}
+
+
+//
+// Quantize with cv::kmeans over every pixel, k-means++ seeded, keeping
+// the best of 'attempts' runs.  Returns the quantized image.
+//
+static cv::Mat kmeans_quantize(cv::Mat img, int count, int attempts)
+{
+    cv::Mat samples(img.rows * img.cols, 3, CV_32FC1);
+    for(int y = 0; y < img.rows; ++y)
+    {
+        const cv::Vec3b *ptr = img.ptr<cv::Vec3b>(y);
+        for(int x = 0; x < img.cols; ++x)
+        {
+            float *sample = samples.ptr<float>(y * img.cols + x);
+            sample[0] = ptr[x][0];
+            sample[1] = ptr[x][1];
+            sample[2] = ptr[x][2];
+        }
+    }
+
+    cv::Mat labels, centers;
+    cv::kmeans(samples, count, labels,
+               cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT, 20, 1.0),
+               attempts, cv::KMEANS_PP_CENTERS, centers);
+
+    cv::Mat quantized(img.rows, img.cols, CV_8UC3);
+    for(int y = 0; y < img.rows; ++y)
+    {
+        cv::Vec3b *ptr = quantized.ptr<cv::Vec3b>(y);
+        for(int x = 0; x < img.cols; ++x)
+        {
+            const float *center = centers.ptr<float>(labels.at<int>(y * img.cols + x, 0));
+            ptr[x] = cv::Vec3b(cv::saturate_cast<uchar>(center[0]), cv::saturate_cast<uchar>(center[1]),
+                               cv::saturate_cast<uchar>(center[2]));
+        }
+    }
+    return quantized;
+}
+
+
+//
+// The quantizers compared by bench_quality.  The eigen-split engines run
+// build_color_tree with a split config; the k-means engines run cv::kmeans
+// with the given number of attempts.
+//
+typedef struct t_quality_engine
+{
+    const char      *name;
+    int             attempts;           // 0 for an eigen-split engine
+    t_split_policy  policy;
+    bool            optimal_threshold;
+} t_quality_engine;
+
+
+typedef struct t_quality_result
+{
+    double      ms;
+    double      peak_mb;            // peak RSS above the RSS at the start
+    double      mse;
+    double      delta_e;
+} t_quality_result;
+
+
+static t_quality_result run_quality_engine(cv::Mat img, int count, const t_quality_engine &engine)
+{
+    //
+    // a forked child starts with its parent's peak, so reset it
+    //
+    t_quality_result result;
+    reset_peak_rss();
+    const double rss_before = get_rss_mb();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    cv::Mat quantized;
+    if(engine.attempts > 0)
+    {
+        quantized = kmeans_quantize(img, count, engine.attempts);
+    }
+    else
+    {
+        t_split_config config = get_default_split_config();
+        config.policy = engine.policy;
+        config.optimal_threshold = engine.optimal_threshold;
+
+        t_class_map classes;
+        t_color_node *root = build_color_tree(img, count, classes, NULL, NULL, &config);
+        quantized = get_quantized_image(classes, root);
+        free_color_tree(root);
+    }
+
+    result.ms = elapsed_ms(start);
+    result.peak_mb = get_peak_rss_mb() - rss_before;
+    get_quantization_error(img, quantized, result.mse, result.delta_e);
+    return result;
+}
+
+
+//
+// Run an engine in a forked child, so its peak RSS is its own and not
+// hidden by memory an earlier engine freed back to the heap.  Falls back
+// to running in process if the child can't be made.
+//
+static t_quality_result run_isolated_quality_engine(cv::Mat img, int count, const t_quality_engine &engine)
+{
+    int fds[2];
+    if(pipe(fds) != 0)
+    {
+        return run_quality_engine(img, count, engine);
+    }
+
+    fflush(stdout);
+    const pid_t pid = fork();
+    if(pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return run_quality_engine(img, count, engine);
+    }
+    if(pid == 0)
+    {
+        close(fds[0]);
+        const t_quality_result result = run_quality_engine(img, count, engine);
+        const ssize_t written = write(fds[1], &result, sizeof(result));
+        _exit(written == sizeof(result) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    t_quality_result result;
+    const bool ok = read(fds[0], &result, sizeof(result)) == sizeof(result);
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+    if(!ok)
+    {
+        result.ms = result.peak_mb = result.mse = result.delta_e = NAN;
+    }
+    return result;
+}
+
+
+//
+// Quantize every image of the corpus with each engine and report time,
+// peak memory and the quantization error.  The corpus is the image paths
+// on the cmd line, or synthetic images if none are given.  Times include
+// rendering the quantized image, which every engine needs to be scored.
+//
+static int bench_quality(int argc, char* argv[])
+{
+    const int count = (int)get_option(argc, argv, "count", 8);
+    const int max_attempts = (int)get_option(argc, argv, "attempts", 5);
+    const double megapixels = get_option(argc, argv, "megapixels", 1);
+
+    std::vector<t_quality_engine> engines;
+    const t_quality_engine eigen = { "eigen", 0, SPLIT_MAX_EIGENVALUE, false };
+    const t_quality_engine eigen_optimal = { "eigen-optimal", 0, SPLIT_MAX_EIGENVALUE, true };
+    const t_quality_engine sse_optimal = { "sse-optimal", 0, SPLIT_MAX_SSE_REDUCTION, true };
+    engines.push_back(eigen);
+    engines.push_back(eigen_optimal);
+    engines.push_back(sse_optimal);
+    for(int attempts = 1; attempts <= max_attempts; attempts += 2)
+    {
+        const t_quality_engine kmeans = { "kmeans", attempts, SPLIT_MAX_EIGENVALUE, false };
+        engines.push_back(kmeans);
+    }
+
+    std::vector<std::string> paths;
+    for(int i = 2; i < argc; ++i)
+    {
+        if(strncmp(argv[i], "--", 2) != 0)
+        {
+            paths.push_back(argv[i]);
+        }
+    }
+    const size_t image_count = paths.empty() ? 3 : paths.size();
+
+    printf("%zu images, %d colors\n\n", image_count, count);
+    printf("%-24s %-14s %8s %10s %10s %10s %10s\n", "image", "engine", "attempts", "ms", "peak_mb", "mse", "delta_e");
+
+    std::vector<double> total_ms(engines.size(), 0);
+    std::vector<double> total_mse(engines.size(), 0);
+    std::vector<double> total_delta_e(engines.size(), 0);
+    size_t scored = 0;
+    for(size_t i = 0; i < image_count; ++i)
+    {
+        std::string name;
+        cv::Mat img;
+        if(paths.empty())
+        {
+            const int width = (int)lrint(sqrt(megapixels * 1000000 * 4 / 3));
+            img = cv::Mat((int)lrint(megapixels * 1000000 / width), width, CV_8UC3);
+            fill_synthetic_image(img, 1000 + (unsigned int)i);
+            name = "synthetic-" + std::to_string(i);
+        }
+        else
+        {
+            name = paths[i];
+            img = cv::imread(paths[i]);
+            if(img.empty())
+            {
+                fprintf(stderr, "Unable to open the file: %s\n", paths[i].c_str());
+                continue;
+            }
+        }
+
+        if((size_t)img.rows * img.cols < (size_t)count)
+        {
+            fprintf(stderr, "Fewer pixels than colors: %s\n", name.c_str());
+            continue;
+        }
+
+        for(size_t e = 0; e < engines.size(); ++e)
+        {
+            const t_quality_result result = run_isolated_quality_engine(img, count, engines[e]);
+            printf("%-24s %-14s %8d %10.1f %10.1f %10.2f %10.3f\n", name.c_str(), engines[e].name,
+                   engines[e].attempts, result.ms, result.peak_mb, result.mse, result.delta_e);
+
+            total_ms[e] += result.ms;
+            total_mse[e] += result.mse;
+            total_delta_e[e] += result.delta_e;
+        }
+        scored++;
+    }
+
+    if(scored > 0)
+    {
+        printf("\n%-24s %-14s %8s %10s %10s %10s %10s\n", "mean", "engine", "attempts", "ms", "", "mse", "delta_e");
+        for(size_t e = 0; e < engines.size(); ++e)
+        {
+            printf("%-24s %-14s %8d %10.1f %10s %10.2f %10.3f\n", "", engines[e].name, engines[e].attempts,
+                   total_ms[e] / scored, "", total_mse[e] / scored, total_delta_e[e] / scored);
+        }
+    }
+    return scored == image_count ? 0 : 1;
+}
+
+
+static void print_usage(const char *name)
+{
+    printf("Usage: %s <mode> [options]\n", name);
+    printf("Modes:\n");
+    printf("  alloc   pipeline time with and without huge page advice\n");
+    printf("          --megapixels=50 --count=8 --repeat=3 --perf-counters\n");
+    printf("  noalloc check find_dominant_colors_into allocates nothing and matches build_color_tree\n");
+    printf("          --megapixels=2 --repeat=5\n");
+    printf("  index   palette index build time, query time and recall\n");
+    printf("          --palettes=1000000 --queries=200 --k=10 --m=16 --ef-construction=100 --threads=0\n");
+    printf("  distance batched palette distances against one at a time\n");
+    printf("          --palettes=200000 --rows=500 --threads=0\n");
+    printf("  scaling strong and weak scaling over threads and image sizes, and the original implementation\n");
+    printf("          --threads=<cpus> --max-megapixels=100 --work-megapixels=12 --reference-megapixels=2\n");
+    printf("          --count=8 --no-numa --json\n");
+    printf("  quality time, memory and quantization error of the eigen-split engines against cv::kmeans\n");
+    printf("          --count=8 --attempts=5 --megapixels=1 [image...]\n");
+}
+
+
+int main(int argc, char* argv[])
+{
+    if(argc < 2)
+    {
+        print_usage(argv[0]);
+        return 0;
+    }
+
+    if(strcmp(argv[1], "alloc") == 0)
+    {
+        return bench_alloc(argc, argv);
+    }
+    if(strcmp(argv[1], "noalloc") == 0)
+    {
+        return bench_noalloc(argc, argv);
+    }
+    if(strcmp(argv[1], "index") == 0)
+    {
+        return bench_index(argc, argv);
+    }
+    if(strcmp(argv[1], "distance") == 0)
+    {
+        return bench_distance(argc, argv);
+    }
+    if(strcmp(argv[1], "scaling") == 0)
+    {
+        return bench_scaling(argc, argv);
+    }
+    if(strcmp(argv[1], "quality") == 0)
+    {
+        return bench_quality(argc, argv);
+    }
+
+    print_usage(argv[0]);
+    return 1;
+}
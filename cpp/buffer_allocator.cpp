@@ -0,0 +1,218 @@
+#include <stdlib.h>
+#include <atomic>
+#include <opencv2/opencv.hpp>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#include "buffer_allocator.h"
+
+
+//
+// OpenCV 4 changed the type of the access flags passed to the allocator
+//
+#if CV_VERSION_MAJOR >= 4
+typedef cv::AccessFlag t_access_flags;
+#else
+typedef int t_access_flags;
+#endif
+
+
+//
+// Transparent huge pages are 2MB on the platforms we run on.  Large
+// buffers are aligned to this so that they start on a huge page boundary.
+//
+static const size_t huge_page_size = 2 * 1024 * 1024;
+
+
+static t_buffer_config g_config = get_default_buffer_config();
+
+static std::atomic<size_t> g_allocations(0);
+static std::atomic<size_t> g_large_allocations(0);
+static std::atomic<size_t> g_advised_bytes(0);
+
+
+t_buffer_config get_default_buffer_config()
+{
+    t_buffer_config config;
+    config.huge_pages = true;
+    config.alignment = 64;
+    config.large_threshold = 4 * 1024 * 1024;
+    return config;
+}
+
+
+t_buffer_config get_buffer_config()
+{
+    return g_config;
+}
+
+
+void set_buffer_config(const t_buffer_config &config)
+{
+    g_config = config;
+
+    //
+    // posix_memalign needs a power of two that is a multiple of sizeof(void*)
+    //
+    size_t alignment = sizeof(void*);
+    while(alignment < config.alignment)
+    {
+        alignment *= 2;
+    }
+    g_config.alignment = alignment;
+}
+
+
+t_buffer_stats get_buffer_stats()
+{
+    t_buffer_stats stats;
+    stats.allocations = g_allocations;
+    stats.large_allocations = g_large_allocations;
+    stats.advised_bytes = g_advised_bytes;
+    return stats;
+}
+
+
+void reset_buffer_stats()
+{
+    g_allocations = 0;
+    g_large_allocations = 0;
+    g_advised_bytes = 0;
+}
+
+
+//
+// Allocate 'size' bytes according to the current configuration
+//
+static void* allocate_buffer(size_t size)
+{
+    const bool large = size >= g_config.large_threshold;
+    size_t alignment = g_config.alignment;
+    if(large && g_config.huge_pages && alignment < huge_page_size)
+    {
+        alignment = huge_page_size;
+    }
+
+    void *ptr = NULL;
+    if(posix_memalign(&ptr, alignment, size) != 0)
+    {
+        return NULL;
+    }
+
+    g_allocations++;
+    if(large)
+    {
+        g_large_allocations++;
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        //
+        // The advice is only a hint.  If transparent huge pages are
+        // disabled on the host the call fails and we carry on with
+        // regular pages.
+        //
+        if(g_config.huge_pages && madvise(ptr, size, MADV_HUGEPAGE) == 0)
+        {
+            g_advised_bytes += size;
+        }
+#endif
+    }
+
+    return ptr;
+}
+
+
+//
+// A cv::MatAllocator modelled on OpenCV's standard allocator that
+// obtains its memory from allocate_buffer.
+//
+class t_buffer_mat_allocator : public cv::MatAllocator
+{
+public:
+    cv::UMatData* allocate(int dims, const int* sizes, int type, void* data0,
+                           size_t* step, t_access_flags /*flags*/,
+                           cv::UMatUsageFlags /*usageFlags*/) const
+    {
+        size_t total = CV_ELEM_SIZE(type);
+        for(int i = dims - 1; i >= 0; --i)
+        {
+            if(step)
+            {
+                if(data0 && step[i] != CV_AUTOSTEP)
+                {
+                    CV_Assert(total <= step[i]);
+                    total = step[i];
+                }
+                else
+                {
+                    step[i] = total;
+                }
+            }
+            total *= sizes[i];
+        }
+
+        uchar *data = data0 ? (uchar*)data0 : (uchar*)allocate_buffer(total);
+        if(!data)
+        {
+            throw std::bad_alloc();
+        }
+
+        cv::UMatData *u = new cv::UMatData(this);
+        u->data = u->origdata = data;
+        u->size = total;
+        if(data0)
+        {
+            u->flags |= cv::UMatData::USER_ALLOCATED;
+        }
+        return u;
+    }
+
+    bool allocate(cv::UMatData* u, t_access_flags /*accessFlags*/,
+                  cv::UMatUsageFlags /*usageFlags*/) const
+    {
+        return u != NULL;
+    }
+
+    void deallocate(cv::UMatData* u) const
+    {
+        if(!u)
+        {
+            return;
+        }
+
+        CV_Assert(u->urefcount == 0);
+        CV_Assert(u->refcount == 0);
+        if(!(u->flags & cv::UMatData::USER_ALLOCATED))
+        {
+            free(u->origdata);
+            u->origdata = 0;
+        }
+        delete u;
+    }
+};
+
+
+cv::MatAllocator* get_buffer_allocator()
+{
+    static t_buffer_mat_allocator allocator;
+    return &allocator;
+}
+
+
+void install_buffer_allocator()
+{
+#if CV_VERSION_MAJOR > 3 || (CV_VERSION_MAJOR == 3 && CV_VERSION_MINOR >= 4)
+    cv::Mat::setDefaultAllocator(get_buffer_allocator());
+#endif
+}
+
+
+cv::Mat create_buffer_mat(int rows, int cols, int type, const cv::Scalar &value)
+{
+    cv::Mat ret;
+    ret.allocator = get_buffer_allocator();
+    ret.create(rows, cols, type);
+    ret = value;
+    return ret;
+}
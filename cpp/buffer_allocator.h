@@ -0,0 +1,65 @@
+//
+// buffer_allocator.h
+//
+// An OpenCV Mat allocator for the large working buffers of the engine
+// (the decoded image, the class map and the rendered outputs).  Every
+// buffer is 64 byte aligned.  Buffers above a size threshold are aligned
+// to the 2MB huge page size and advised with madvise(MADV_HUGEPAGE) so
+// the kernel can back them with transparent huge pages, which cuts the
+// TLB misses of the per-pixel loops on 50-100MP images.
+//
+
+#ifndef BUFFER_ALLOCATOR_H
+#define BUFFER_ALLOCATOR_H
+
+#include <stddef.h>
+#include <opencv2/opencv.hpp>
+
+
+typedef struct t_buffer_config
+{
+    bool        huge_pages;         // advise large buffers with MADV_HUGEPAGE
+    size_t      alignment;          // alignment of every buffer in bytes
+    size_t      large_threshold;    // buffers this big or bigger are 'large'
+} t_buffer_config;
+
+
+typedef struct t_buffer_stats
+{
+    size_t      allocations;        // total buffers handed out
+    size_t      large_allocations;  // buffers at or above the threshold
+    size_t      advised_bytes;      // bytes advised for huge pages
+} t_buffer_stats;
+
+
+//
+// The default configuration: huge pages on, 64 byte alignment and
+// a 4MB threshold for large buffers.
+//
+t_buffer_config get_default_buffer_config();
+
+t_buffer_config get_buffer_config();
+void set_buffer_config(const t_buffer_config &config);
+
+t_buffer_stats get_buffer_stats();
+void reset_buffer_stats();
+
+//
+// The allocator itself.  It can be assigned to Mat::allocator before
+// calling Mat::create.
+//
+cv::MatAllocator* get_buffer_allocator();
+
+//
+// Make the buffer allocator OpenCV's default allocator so that Mats
+// created inside OpenCV (e.g. by imread) use it too.  This is a no-op
+// on OpenCV versions without Mat::setDefaultAllocator.
+//
+void install_buffer_allocator();
+
+//
+// Create a Mat backed by the buffer allocator and fill it with 'value'
+//
+cv::Mat create_buffer_mat(int rows, int cols, int type, const cv::Scalar &value);
+
+#endif
@@ -0,0 +1,375 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <unordered_map>
+
+#include "color_index.h"
+
+
+static const char index_magic[4] = { 'D', 'C', 'C', 'I' };
+static const uint32_t index_version = 1;
+
+//
+// The L*a*b* box the bins cover.  Colors from 8-bit sRGB fall inside it.
+//
+static const float lab_min[3] = { 0, -128, -128 };
+static const float lab_max[3] = { 100, 128, 128 };
+
+
+t_color_index::t_color_index(float bin_size)
+{
+    set_bin_size(bin_size);
+}
+
+
+void t_color_index::set_bin_size(float size)
+{
+    bin_size = size < 1 ? 1 : size;
+    bins_l = (int)ceil((lab_max[0] - lab_min[0]) / bin_size) + 1;
+    bins_ab = (int)ceil((lab_max[1] - lab_min[1]) / bin_size);
+    lists.assign((size_t)bins_l * bins_ab * bins_ab, t_posting_list());
+    for(size_t i = 0; i < lists.size(); ++i)
+    {
+        lists[i].last_id = 0;
+        lists[i].count = 0;
+    }
+}
+
+
+int t_color_index::get_bin(int l, int a, int b) const
+{
+    return (l * bins_ab + a) * bins_ab + b;
+}
+
+
+size_t t_color_index::size() const
+{
+    return names.size();
+}
+
+
+size_t t_color_index::get_posting_count() const
+{
+    size_t count = 0;
+    for(size_t i = 0; i < lists.size(); ++i)
+    {
+        count += lists[i].count;
+    }
+    return count;
+}
+
+
+size_t t_color_index::get_posting_bytes() const
+{
+    size_t bytes = 0;
+    for(size_t i = 0; i < lists.size(); ++i)
+    {
+        bytes += lists[i].bytes.size();
+    }
+    return bytes;
+}
+
+
+const std::string& t_color_index::get_name(uint32_t id) const
+{
+    return names[id];
+}
+
+
+//
+// The bin of one axis and the color's position inside it in sixteenths
+//
+static void get_bin_position(float value, int axis, float bin_size, int bins, int &bin, int &sixteenth)
+{
+    const float offset = value - lab_min[axis];
+    bin = std::min(std::max((int)floorf(offset / bin_size), 0), bins - 1);
+
+    const float fraction = (offset - bin * bin_size) / bin_size;
+    sixteenth = std::min(std::max((int)(fraction * 16), 0), 15);
+}
+
+
+uint32_t t_color_index::add(const std::string &name, const t_palette &palette)
+{
+    const uint32_t id = (uint32_t)names.size();
+    names.push_back(name);
+
+    for(size_t i = 0; i < palette.colors.size(); ++i)
+    {
+        const t_palette_color &color = palette.colors[i];
+        const int weight = (int)lrintf(std::min(std::max(color.weight, 0.0f), 1.0f) * 255);
+        if(weight == 0)
+        {
+            continue;
+        }
+
+        int bin[3];
+        int sixteenth[3];
+        get_bin_position(color.lab[0], 0, bin_size, bins_l, bin[0], sixteenth[0]);
+        get_bin_position(color.lab[1], 1, bin_size, bins_ab, bin[1], sixteenth[1]);
+        get_bin_position(color.lab[2], 2, bin_size, bins_ab, bin[2], sixteenth[2]);
+
+        //
+        // the gap from the list's previous image, seven bits a byte
+        //
+        t_posting_list &list = lists[get_bin(bin[0], bin[1], bin[2])];
+        uint32_t gap = id - list.last_id;
+        while(gap >= 0x80)
+        {
+            list.bytes.push_back((uint8_t)(gap | 0x80));
+            gap >>= 7;
+        }
+        list.bytes.push_back((uint8_t)gap);
+
+        list.bytes.push_back((uint8_t)weight);
+        list.bytes.push_back((uint8_t)(sixteenth[0] << 4 | sixteenth[1]));
+        list.bytes.push_back((uint8_t)sixteenth[2]);
+
+        list.last_id = id;
+        list.count++;
+    }
+
+    return id;
+}
+
+
+std::vector<t_color_hit> t_color_index::search(const float lab[3], float radius, float min_coverage,
+                                               size_t limit) const
+{
+    const int bins[3] = { bins_l, bins_ab, bins_ab };
+    int first[3];
+    int last[3];
+    for(int k = 0; k < 3; ++k)
+    {
+        int unused;
+        get_bin_position(lab[k] - radius, k, bin_size, bins[k], first[k], unused);
+        get_bin_position(lab[k] + radius, k, bin_size, bins[k], last[k], unused);
+    }
+
+    std::unordered_map<uint32_t, t_color_hit> hits;
+    const float radius2 = radius * radius;
+
+    for(int l = first[0]; l <= last[0]; ++l)
+    {
+        for(int a = first[1]; a <= last[1]; ++a)
+        {
+            for(int b = first[2]; b <= last[2]; ++b)
+            {
+                //
+                // skip bins whose box the radius doesn't reach
+                //
+                const int bin[3] = { l, a, b };
+                float origin[3];
+                float gap2 = 0;
+                for(int k = 0; k < 3; ++k)
+                {
+                    origin[k] = lab_min[k] + bin[k] * bin_size;
+                    const float nearest = std::min(std::max(lab[k], origin[k]), origin[k] + bin_size);
+                    gap2 += (lab[k] - nearest) * (lab[k] - nearest);
+                }
+                if(gap2 > radius2)
+                {
+                    continue;
+                }
+
+                const t_posting_list &list = lists[get_bin(l, a, b)];
+                const uint8_t *p = list.bytes.data();
+                const uint8_t *end = p + list.bytes.size();
+                uint32_t id = 0;
+                while(p < end)
+                {
+                    uint32_t gap = 0;
+                    int shift = 0;
+                    while(*p & 0x80)
+                    {
+                        gap |= (uint32_t)(*p++ & 0x7f) << shift;
+                        shift += 7;
+                    }
+                    gap |= (uint32_t)*p++ << shift;
+                    id += gap;
+
+                    const float weight = p[0] / 255.0f;
+                    const int sixteenth[3] = { p[1] >> 4, p[1] & 0x0f, p[2] };
+                    p += 3;
+
+                    float d2 = 0;
+                    for(int k = 0; k < 3; ++k)
+                    {
+                        const float v = origin[k] + (sixteenth[k] + 0.5f) * bin_size / 16;
+                        d2 += (lab[k] - v) * (lab[k] - v);
+                    }
+                    if(d2 > radius2)
+                    {
+                        continue;
+                    }
+
+                    t_color_hit &hit = hits[id];
+                    if(hit.coverage == 0)
+                    {
+                        hit.id = id;
+                        hit.distance = INFINITY;
+                    }
+                    hit.coverage += weight;
+                    hit.distance = std::min(hit.distance, sqrtf(d2));
+                }
+            }
+        }
+    }
+
+    std::vector<t_color_hit> result;
+    for(std::unordered_map<uint32_t, t_color_hit>::const_iterator i = hits.begin(); i != hits.end(); ++i)
+    {
+        if(i->second.coverage >= min_coverage)
+        {
+            result.push_back(i->second);
+        }
+    }
+
+    std::sort(result.begin(), result.end(), [](const t_color_hit &x, const t_color_hit &y)
+    {
+        if(x.coverage != y.coverage)
+        {
+            return x.coverage > y.coverage;
+        }
+        return x.distance < y.distance;
+    });
+
+    if(limit > 0 && result.size() > limit)
+    {
+        result.resize(limit);
+    }
+    return result;
+}
+
+
+//
+// File layout, native byte order:
+//   "DCCI", version, bin_size, image count
+//   every posting list: count, last id, byte length, bytes
+//   the names, each as a length and its bytes
+//
+bool t_color_index::save(const char *path) const
+{
+    FILE *out = fopen(path, "wb");
+    if(!out)
+    {
+        return false;
+    }
+
+    const uint32_t count = (uint32_t)names.size();
+    bool ok = fwrite(index_magic, 4, 1, out) == 1 &&
+              fwrite(&index_version, sizeof(index_version), 1, out) == 1 &&
+              fwrite(&bin_size, sizeof(bin_size), 1, out) == 1 &&
+              fwrite(&count, sizeof(count), 1, out) == 1;
+
+    for(size_t i = 0; ok && i < lists.size(); ++i)
+    {
+        const t_posting_list &list = lists[i];
+        const uint64_t length = list.bytes.size();
+        ok = fwrite(&list.count, sizeof(list.count), 1, out) == 1 &&
+             fwrite(&list.last_id, sizeof(list.last_id), 1, out) == 1 &&
+             fwrite(&length, sizeof(length), 1, out) == 1 &&
+             fwrite(list.bytes.data(), 1, length, out) == length;
+    }
+
+    for(size_t i = 0; ok && i < names.size(); ++i)
+    {
+        const uint32_t length = (uint32_t)names[i].size();
+        ok = fwrite(&length, sizeof(length), 1, out) == 1 &&
+             fwrite(names[i].data(), 1, length, out) == length;
+    }
+
+    return fclose(out) == 0 && ok;
+}
+
+
+bool t_color_index::load(const char *path)
+{
+    FILE *in = fopen(path, "rb");
+    if(!in)
+    {
+        return false;
+    }
+
+    char magic[4];
+    uint32_t version = 0;
+    float size = 0;
+    uint32_t count = 0;
+    bool ok = fread(magic, 4, 1, in) == 1 && memcmp(magic, index_magic, 4) == 0 &&
+              fread(&version, sizeof(version), 1, in) == 1 && version == index_version &&
+              fread(&size, sizeof(size), 1, in) == 1 && size >= 1 && size <= 256 &&
+              fread(&count, sizeof(count), 1, in) == 1;
+
+    if(ok)
+    {
+        set_bin_size(size);
+    }
+
+    for(size_t i = 0; ok && i < lists.size(); ++i)
+    {
+        t_posting_list &list = lists[i];
+        uint64_t length = 0;
+        ok = fread(&list.count, sizeof(list.count), 1, in) == 1 &&
+             fread(&list.last_id, sizeof(list.last_id), 1, in) == 1 &&
+             fread(&length, sizeof(length), 1, in) == 1 &&
+             length <= (uint64_t)list.count * 8 && (list.count == 0 || list.last_id < count);
+        if(ok)
+        {
+            list.bytes.resize(length);
+            ok = fread(list.bytes.data(), 1, length, in) == length;
+        }
+    }
+
+    names.clear();
+    for(size_t i = 0; ok && i < count; ++i)
+    {
+        uint32_t length = 0;
+        ok = fread(&length, sizeof(length), 1, in) == 1 && length < (1u << 20);
+        if(ok)
+        {
+            std::string name(length, '\0');
+            ok = fread(&name[0], 1, length, in) == length;
+            names.push_back(name);
+        }
+    }
+    fclose(in);
+
+    //
+    // every list must decode to exactly its postings and end at its last id
+    //
+    for(size_t i = 0; ok && i < lists.size(); ++i)
+    {
+        const t_posting_list &list = lists[i];
+        const uint8_t *p = list.bytes.data();
+        const uint8_t *end = p + list.bytes.size();
+        uint64_t id = 0;
+        uint32_t postings = 0;
+        while(ok && p < end)
+        {
+            uint64_t gap = 0;
+            int shift = 0;
+            while(p < end && (*p & 0x80) && shift < 35)
+            {
+                gap |= (uint64_t)(*p++ & 0x7f) << shift;
+                shift += 7;
+            }
+            ok = end - p >= 4;
+            if(ok)
+            {
+                gap |= (uint64_t)*p++ << shift;
+                id += gap;
+                p += 3;
+                postings++;
+            }
+        }
+        ok = ok && postings == list.count && (list.count == 0 || id == list.last_id);
+    }
+
+    if(!ok)
+    {
+        set_bin_size(bin_size);
+        names.clear();
+    }
+    return ok;
+}
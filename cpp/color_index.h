@@ -0,0 +1,77 @@
+//
+// color_index.h
+//
+// An inverted index from colors to the images containing them.  L*a*b*
+// space is cut into cubic bins of 'bin_size' delta E and every palette
+// color is posted to the bin it falls in, with the fraction of its image
+// it covers.  A query for a color within a radius reads only the bins the
+// radius reaches.
+//
+// Posting lists are append only byte streams, one per bin.  Each posting
+// is the gap from the previous image id as a varint, the coverage in one
+// byte and the position of the color inside its bin in 12 bits, which is
+// enough to test the radius to a sixteenth of a bin.  A posting is
+// usually 4 bytes.
+//
+
+#ifndef COLOR_INDEX_H
+#define COLOR_INDEX_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "palette.h"
+
+
+typedef struct t_color_hit
+{
+    uint32_t    id;             // order in which the image was added
+    float       coverage;       // fraction of the image within the radius
+    float       distance;       // delta E of its nearest color
+} t_color_hit;
+
+
+class t_color_index
+{
+public:
+    t_color_index(float bin_size = 8);
+
+    //
+    // Post every color of an image's palette.  Returns the image id.
+    //
+    uint32_t add(const std::string &name, const t_palette &palette);
+
+    //
+    // The images with at least 'min_coverage' of their pixels within
+    // 'radius' delta E of 'lab', most covered first, at most 'limit'.
+    //
+    std::vector<t_color_hit> search(const float lab[3], float radius, float min_coverage, size_t limit) const;
+
+    size_t size() const;
+    size_t get_posting_count() const;
+    size_t get_posting_bytes() const;
+    const std::string& get_name(uint32_t id) const;
+
+    bool save(const char *path) const;
+    bool load(const char *path);
+
+private:
+    typedef struct t_posting_list
+    {
+        std::vector<uint8_t>    bytes;
+        uint32_t                last_id;
+        uint32_t                count;
+    } t_posting_list;
+
+    void set_bin_size(float size);
+    int get_bin(int l, int a, int b) const;
+
+    float                           bin_size;
+    int                             bins_l;
+    int                             bins_ab;
+    std::vector<t_posting_list>     lists;
+    std::vector<std::string>        names;
+};
+
+#endif
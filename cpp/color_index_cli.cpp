@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "palette.h"
+#include "color_index.h"
+
+
+void print_usage(const char *name)
+{
+    printf("Usage: %s build [options] <index> <palettes>\n", name);
+    printf("       %s query [options] <index> <#rrggbb>\n", name);
+    printf("Palettes are read one per line, as printed by getDominantColors --batch --weights:\n");
+    printf("  <name> #rrggbb:<weight> #rrggbb:<weight> ...\n");
+    printf("Use - to read them from stdin.\n");
+    printf("Options:\n");
+    printf("  --bin=<n>               bin size in delta E when building (default 8)\n");
+    printf("  --radius=<n>            match colors within this delta E (default 10)\n");
+    printf("  --min-coverage=<n>      only images with at least this fraction within the radius (default 0.05)\n");
+    printf("  --limit=<n>             print at most n images, 0 for all (default 20)\n");
+}
+
+
+int main(int argc, char* argv[])
+{
+    float bin_size = 8;
+    float radius = 10;
+    float min_coverage = 0.05f;
+    int limit = 20;
+
+    std::vector<char*> args;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(strncmp(argv[i], "--bin=", 6) == 0)
+        {
+            bin_size = (float)atof(argv[i] + 6);
+        }
+        else if(strncmp(argv[i], "--radius=", 9) == 0)
+        {
+            radius = (float)atof(argv[i] + 9);
+        }
+        else if(strncmp(argv[i], "--min-coverage=", 15) == 0)
+        {
+            min_coverage = (float)atof(argv[i] + 15);
+        }
+        else if(strncmp(argv[i], "--limit=", 8) == 0)
+        {
+            limit = atoi(argv[i] + 8);
+        }
+        else if(strncmp(argv[i], "--", 2) == 0)
+        {
+            printf("Unknown option: %s\n", argv[i]);
+            print_usage(argv[0]);
+            return 3;
+        }
+        else
+        {
+            args.push_back(argv[i]);
+        }
+    }
+
+    if(args.size() == 3 && strcmp(args[0], "build") == 0)
+    {
+        FILE *in = strcmp(args[2], "-") == 0 ? stdin : fopen(args[2], "r");
+        if(!in)
+        {
+            fprintf(stderr, "Unable to open the file: %s\n", args[2]);
+            return 1;
+        }
+
+        std::vector<std::string> names;
+        std::vector<t_palette> palettes;
+        read_palette_file(in, names, palettes);
+        if(in != stdin)
+        {
+            fclose(in);
+        }
+
+        t_color_index index(bin_size);
+        for(size_t i = 0; i < palettes.size(); ++i)
+        {
+            index.add(names[i], palettes[i]);
+        }
+
+        if(!index.save(args[1]))
+        {
+            fprintf(stderr, "Unable to write the index: %s\n", args[1]);
+            return 1;
+        }
+        fprintf(stderr, "Indexed %zu images, %zu postings in %zu bytes\n",
+                index.size(), index.get_posting_count(), index.get_posting_bytes());
+        return 0;
+    }
+
+    if(args.size() == 3 && strcmp(args[0], "query") == 0)
+    {
+        t_color_index index;
+        if(!index.load(args[1]))
+        {
+            fprintf(stderr, "Unable to read the index: %s\n", args[1]);
+            return 1;
+        }
+
+        //
+        // the query color is parsed as a one color palette
+        //
+        std::string line = std::string("query ") + args[2];
+        std::string name;
+        std::vector<cv::Vec3b> colors;
+        std::vector<double> weights;
+        if(!parse_palette_line(line.c_str(), name, colors, weights) || colors.size() != 1)
+        {
+            printf("The color needs to be given as #rrggbb. You picked: %s\n", args[2]);
+            return 2;
+        }
+
+        float lab[3];
+        bgr_to_lab(colors[0], lab);
+
+        //
+        // one line per image: its name, coverage and the delta E of its nearest color
+        //
+        std::vector<t_color_hit> hits = index.search(lab, radius, min_coverage, limit > 0 ? limit : 0);
+        for(size_t i = 0; i < hits.size(); ++i)
+        {
+            printf("%s %.4f %.2f\n", index.get_name(hits[i].id).c_str(), hits[i].coverage, hits[i].distance);
+        }
+        return 0;
+    }
+
+    print_usage(argv[0]);
+    return args.empty() ? 0 : 1;
+}
@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <queue>
+
+#include "color_model.h"
+#include "buffer_allocator.h"
+
+
+static const char model_magic[4] = { 'D', 'C', 'M', 'F' };
+
+
+static size_t align8(size_t size)
+{
+    return (size + 7) & ~(size_t)7;
+}
+
+
+std::vector<uchar> serialize_color_model(t_color_node *root, const char *name)
+{
+    //
+    // number the nodes breadth first, root first
+    //
+    std::vector<t_color_node*> order;
+    std::queue<t_color_node*> queue;
+    queue.push(root);
+    int class_count = 0;
+    while(!queue.empty())
+    {
+        t_color_node *node = queue.front();
+        queue.pop();
+        order.push_back(node);
+
+        if(node->left && node->right)
+        {
+            queue.push(node->left);
+            queue.push(node->right);
+        }
+        else
+        {
+            class_count = std::max(class_count, node->classid + 1);
+        }
+    }
+
+    t_model_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, model_magic, sizeof(model_magic));
+    header.version = COLOR_MODEL_VERSION;
+    strncpy(header.name, name ? name : "", sizeof(header.name) - 1);
+    header.node_count = (uint32_t)order.size();
+    header.class_count = (uint32_t)class_count;
+    header.node_offset = (uint32_t)align8(sizeof(t_model_header));
+    header.class_offset = (uint32_t)align8(header.node_offset + order.size() * sizeof(t_model_node));
+    header.size = align8(header.class_offset + class_count * sizeof(t_model_class));
+
+    std::vector<uchar> bytes(header.size, 0);
+    memcpy(&bytes[0], &header, sizeof(header));
+    t_model_node *nodes = (t_model_node*)&bytes[header.node_offset];
+    t_model_class *classes = (t_model_class*)&bytes[header.class_offset];
+
+    //
+    // children follow their parent in breadth first order, so their
+    // indices are handed out as the parents are written
+    //
+    int next_child = 1;
+    const double total = root->pixel_count;
+    for(size_t i = 0; i < order.size(); ++i)
+    {
+        const t_color_node *node = order[i];
+        t_model_node &out = nodes[i];
+
+        if(node->left && node->right)
+        {
+            //
+            // the same plane, in the same arithmetic, as partition_class
+            //
+            const double *eig = node->eigenvector;
+            out.normal[0] = eig[0];
+            out.normal[1] = eig[1];
+            out.normal[2] = eig[2];
+            out.threshold = node->threshold;
+            out.left = next_child++;
+            out.right = next_child++;
+            out.classid = -1;
+        }
+        else
+        {
+            out.left = -1;
+            out.right = -1;
+            out.classid = node->classid;
+
+            const cv::Vec3b color = get_node_color(node);
+            t_model_class &c = classes[node->classid];
+            c.bgr[0] = color[0];
+            c.bgr[1] = color[1];
+            c.bgr[2] = color[2];
+            c.weight = total > 0 ? (float)(node->pixel_count / total) : 0;
+        }
+    }
+
+    return bytes;
+}
+
+
+bool write_model_file(const char *path, const std::vector<std::vector<uchar> > &models)
+{
+    FILE *out = fopen(path, "wb");
+    if(!out)
+    {
+        return false;
+    }
+
+    bool ok = true;
+    for(size_t i = 0; ok && i < models.size(); ++i)
+    {
+        ok = fwrite(models[i].data(), 1, models[i].size(), out) == models[i].size();
+    }
+    return fclose(out) == 0 && ok;
+}
+
+
+//
+// Check a model lies within 'available' bytes and its tree is well formed:
+// every child index is in range and after its parent, so the walk always
+// moves forward and ends at a leaf with a valid class.
+//
+static bool check_model(const uchar *base, size_t available, t_color_model &model)
+{
+    if(available < sizeof(t_model_header))
+    {
+        return false;
+    }
+
+    const t_model_header *header = (const t_model_header*)base;
+    if(memcmp(header->magic, model_magic, sizeof(model_magic)) != 0 || header->version != COLOR_MODEL_VERSION ||
+       header->size > available || header->size % 8 != 0 || header->name[sizeof(header->name) - 1] != 0 ||
+       header->node_count == 0 || header->class_count == 0 ||
+       header->node_offset % 8 != 0 || header->class_offset % 8 != 0 ||
+       header->node_offset < sizeof(t_model_header) ||
+       header->node_offset + (uint64_t)header->node_count * sizeof(t_model_node) > header->class_offset ||
+       header->class_offset + (uint64_t)header->class_count * sizeof(t_model_class) > header->size)
+    {
+        return false;
+    }
+
+    model.header = header;
+    model.nodes = (const t_model_node*)(base + header->node_offset);
+    model.classes = (const t_model_class*)(base + header->class_offset);
+
+    for(uint32_t i = 0; i < header->node_count; ++i)
+    {
+        const t_model_node &node = model.nodes[i];
+        if(node.classid >= 0)
+        {
+            if((uint32_t)node.classid >= header->class_count)
+            {
+                return false;
+            }
+        }
+        else if(node.left <= (int32_t)i || node.right <= (int32_t)i ||
+                (uint32_t)node.left >= header->node_count || (uint32_t)node.right >= header->node_count)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+bool open_model_file(const char *path, t_model_file &file)
+{
+    file.base = NULL;
+    file.size = 0;
+    file.models.clear();
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        return false;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(t_model_header))
+    {
+        close(fd);
+        return false;
+    }
+
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED)
+    {
+        return false;
+    }
+
+    file.base = base;
+    file.size = st.st_size;
+
+    size_t offset = 0;
+    while(offset < file.size)
+    {
+        t_color_model model;
+        if(!check_model((const uchar*)base + offset, file.size - offset, model))
+        {
+            close_model_file(file);
+            return false;
+        }
+        file.models.push_back(model);
+        offset += model.header->size;
+    }
+    return true;
+}
+
+
+void close_model_file(t_model_file &file)
+{
+    if(file.base)
+    {
+        munmap(file.base, file.size);
+    }
+    file.base = NULL;
+    file.size = 0;
+    file.models.clear();
+}
+
+
+const t_color_model* find_color_model(const t_model_file &file, const char *name)
+{
+    for(size_t i = 0; i < file.models.size(); ++i)
+    {
+        if(strcmp(file.models[i].header->name, name) == 0)
+        {
+            return &file.models[i];
+        }
+    }
+    return NULL;
+}
+
+
+std::vector<cv::Vec3b> get_model_colors(const t_color_model &model)
+{
+    std::vector<cv::Vec3b> colors(model.header->class_count);
+    for(uint32_t i = 0; i < model.header->class_count; ++i)
+    {
+        const t_model_class &c = model.classes[i];
+        colors[i] = cv::Vec3b(c.bgr[0], c.bgr[1], c.bgr[2]);
+    }
+    return colors;
+}
+
+
+//
+// Runs of identical pixels are common, so each row remembers the
+// last pixel it classified
+//
+template<int BITS>
+void classify_image_packed(const t_color_model &model, cv::Mat img, t_class_map &classes)
+{
+    for(int y = 0; y < img.rows; ++y)
+    {
+        const cv::Vec3b *ptr = img.ptr<cv::Vec3b>(y);
+        uchar *ptrClass = classes.data + y * classes.step;
+
+        cv::Vec3b last = ptr[0];
+        int classid = classify_pixel(model, last);
+        for(int x = 0; x < img.cols; ++x)
+        {
+            if(ptr[x] != last)
+            {
+                last = ptr[x];
+                classid = classify_pixel(model, last);
+            }
+            set_packed_class<BITS>(ptrClass, x, classid);
+        }
+    }
+}
+
+
+t_class_map classify_image(const t_color_model &model, cv::Mat img)
+{
+    t_class_map classes = create_class_map(img.cols, img.rows, model.header->class_count);
+    if(img.empty())
+    {
+        return classes;
+    }
+
+    switch(classes.bits)
+    {
+        case 2:  classify_image_packed<2>(model, img, classes);  break;
+        case 4:  classify_image_packed<4>(model, img, classes);  break;
+        case 8:  classify_image_packed<8>(model, img, classes);  break;
+        default: classify_image_packed<16>(model, img, classes); break;
+    }
+    return classes;
+}
+
+
+cv::Mat remap_image(const t_color_model &model, cv::Mat img)
+{
+    cv::Mat ret = create_buffer_mat(img.rows, img.cols, CV_8UC3, cv::Scalar(0));
+    const std::vector<cv::Vec3b> colors = get_model_colors(model);
+
+    for(int y = 0; y < img.rows; ++y)
+    {
+        const cv::Vec3b *ptr = img.ptr<cv::Vec3b>(y);
+        cv::Vec3b *out = ret.ptr<cv::Vec3b>(y);
+
+        cv::Vec3b last = ptr[0];
+        cv::Vec3b color = colors[classify_pixel(model, last)];
+        for(int x = 0; x < img.cols; ++x)
+        {
+            if(ptr[x] != last)
+            {
+                last = ptr[x];
+                color = colors[classify_pixel(model, last)];
+            }
+            out[x] = color;
+        }
+    }
+    return ret;
+}
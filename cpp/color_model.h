@@ -0,0 +1,138 @@
+//
+// color_model.h
+//
+// A color tree saved as a flat, pointer free model that can be memory
+// mapped and used in place to classify and remap new images.
+//
+// A model file is one or more models back to back, each starting on an
+// 8 byte boundary:
+//
+//   t_model_header
+//   t_model_node    nodes[node_count]      root first
+//   t_model_class   classes[class_count]   indexed by class id
+//
+// Offsets are relative to the model's header and values are in the byte
+// order of the host that wrote them.  Opening a file maps it read only and
+// checks the bounds of every model; nothing is copied, so many workers can
+// share one library of models through the page cache.
+//
+
+#ifndef COLOR_MODEL_H
+#define COLOR_MODEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "dominant_colors.h"
+
+#define COLOR_MODEL_VERSION     1
+
+
+typedef struct t_model_header
+{
+    char        magic[4];           // "DCMF"
+    uint32_t    version;
+    uint64_t    size;               // bytes in this model, header included
+    char        name[64];           // NUL terminated
+    uint32_t    node_count;
+    uint32_t    class_count;
+    uint32_t    node_offset;
+    uint32_t    class_offset;
+} t_model_header;
+
+
+//
+// A pixel p goes right when normal . p > threshold, with p in 0-255.
+// Leaves have no children and the id of their class.
+//
+typedef struct t_model_node
+{
+    double      normal[3];
+    double      threshold;
+    int32_t     left;               // node index, -1 for a leaf
+    int32_t     right;
+    int32_t     classid;            // -1 for an inner node
+    int32_t     reserved;
+} t_model_node;
+
+
+typedef struct t_model_class
+{
+    uint8_t     bgr[3];
+    uint8_t     reserved;
+    float       weight;             // fraction of the training image in the class
+} t_model_class;
+
+
+//
+// A model in memory, usually a view into a mapped file
+//
+typedef struct t_color_model
+{
+    const t_model_header   *header;
+    const t_model_node     *nodes;
+    const t_model_class    *classes;
+} t_color_model;
+
+
+typedef struct t_model_file
+{
+    void                       *base;
+    size_t                      size;
+    std::vector<t_color_model>  models;
+} t_model_file;
+
+
+//
+// Flatten a tree from build_color_tree into one model
+//
+std::vector<uchar> serialize_color_model(t_color_node *root, const char *name);
+
+//
+// Write models made with serialize_color_model to one file
+//
+bool write_model_file(const char *path, const std::vector<std::vector<uchar> > &models);
+
+//
+// Map a model file.  Returns false if it can't be read or any model is
+// malformed.  Close with close_model_file.
+//
+bool open_model_file(const char *path, t_model_file &file);
+void close_model_file(t_model_file &file);
+
+//
+// The model with the given name, or NULL
+//
+const t_color_model* find_color_model(const t_model_file &file, const char *name);
+
+//
+// The class of one pixel
+//
+inline int classify_pixel(const t_color_model &model, cv::Vec3b pixel)
+{
+    const t_model_node *node = model.nodes;
+    while(node->classid < 0)
+    {
+        const double value = node->normal[0] * pixel[0] + node->normal[1] * pixel[1] + node->normal[2] * pixel[2];
+        node = &model.nodes[value > node->threshold ? node->right : node->left];
+    }
+    return node->classid;
+}
+
+//
+// Classify every pixel of an image into a class map, or replace every
+// pixel with the color of its class.  For the image a model was trained
+// on these reproduce build_color_tree exactly.
+//
+t_class_map classify_image(const t_color_model &model, cv::Mat img);
+cv::Mat remap_image(const t_color_model &model, cv::Mat img);
+
+//
+// The model's palette, indexed by class id
+//
+std::vector<cv::Vec3b> get_model_colors(const t_color_model &model);
+
+#endif
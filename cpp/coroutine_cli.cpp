@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mutex>
+#include <condition_variable>
+
+#include "async.h"
+
+#ifndef DC_HAVE_COROUTINES
+#error "coroutine_cli.cpp needs C++20 coroutines, build it with -std=c++20"
+#endif
+
+
+//
+// Find the dominant colors of every image on the cmd line from one
+// coroutine per image, each suspended on co_await find_dominant_colors_co
+// while its request runs on the library pool.
+//
+
+
+//
+// A coroutine that starts at once and frees itself when it returns
+//
+typedef struct t_detached_task
+{
+    struct promise_type
+    {
+        t_detached_task get_return_object()
+        {
+            return t_detached_task();
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return std::suspend_never();
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return std::suspend_never();
+        }
+
+        void return_void()
+        {
+        }
+
+        void unhandled_exception()
+        {
+            abort();
+        }
+    };
+} t_detached_task;
+
+
+//
+// The coroutines still running, and the lock that keeps their lines whole
+//
+typedef struct t_pending
+{
+    std::mutex                  mutex;
+    std::condition_variable     done;
+    size_t                      running;
+} t_pending;
+
+
+static const char* get_status_name(t_find_status status)
+{
+    switch(status)
+    {
+        case FIND_OK:               return "ok";
+        case FIND_CANCELLED:        return "cancelled";
+        case FIND_TIMED_OUT:        return "timed out";
+        case FIND_DECODE_FAILED:    return "decode failed";
+        default:                    return "failed";
+    }
+}
+
+
+//
+// Print '<path> #rrggbb ...' once the colors are found.  The coroutine
+// resumes on the pool thread that ran the request.
+//
+static t_detached_task find_colors(const char *path, int count, double timeout_seconds, t_pending &pending)
+{
+    t_find_request request;
+    request.path = path;
+    request.count = count;
+
+    t_find_result result = co_await find_dominant_colors_co(request, create_cancel_token(timeout_seconds));
+
+    std::lock_guard<std::mutex> lock(pending.mutex);
+    if(result.status == FIND_DECODE_FAILED || result.status == FIND_FAILED)
+    {
+        fprintf(stderr, "Unable to process the file: %s (%s)\n", path, get_status_name(result.status));
+    }
+    else
+    {
+        printf("%s", path);
+        for(size_t i = 0; i < result.colors.size(); ++i)
+        {
+            const cv::Vec3b &c = result.colors[i];
+            printf(" #%02x%02x%02x", c[2], c[1], c[0]);
+        }
+        if(result.status != FIND_OK)
+        {
+            printf(" (%s)", get_status_name(result.status));
+        }
+        printf("\n");
+    }
+
+    if(--pending.running == 0)
+    {
+        pending.done.notify_all();
+    }
+}
+
+
+void print_usage(const char *name)
+{
+    printf("Usage: %s [options] <image>... <count>\n", name);
+    printf("Options:\n");
+    printf("  --timeout-ms=<n>        stop splitting an image after n ms and keep the colors found so far\n");
+}
+
+
+int main(int argc, char* argv[])
+{
+    double timeout_seconds = 0;
+
+    std::vector<char*> args;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(strncmp(argv[i], "--timeout-ms=", 13) == 0)
+        {
+            timeout_seconds = atof(argv[i] + 13) / 1000.0;
+        }
+        else if(strncmp(argv[i], "--", 2) == 0)
+        {
+            printf("Unknown option: %s\n", argv[i]);
+            print_usage(argv[0]);
+            return 3;
+        }
+        else
+        {
+            args.push_back(argv[i]);
+        }
+    }
+
+    if(args.size() < 2)
+    {
+        print_usage(argv[0]);
+        return 3;
+    }
+
+    const int count = atoi(args.back());
+    if(count <= 0 || count > get_max_color_count(NULL))
+    {
+        fprintf(stderr, "The color count needs to be between 1-%d. You picked: %d\n", get_max_color_count(NULL), count);
+        return 2;
+    }
+
+    //
+    // every coroutine is started before any is waited on, so the
+    // requests run side by side on the pool
+    //
+    t_pending pending;
+    pending.running = args.size() - 1;
+    for(size_t i = 0; i + 1 < args.size(); ++i)
+    {
+        find_colors(args[i], count, timeout_seconds, pending);
+    }
+
+    std::unique_lock<std::mutex> lock(pending.mutex);
+    while(pending.running > 0)
+    {
+        pending.done.wait(lock);
+    }
+    return 0;
+}
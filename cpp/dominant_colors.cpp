@@ -0,0 +1,1949 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <opencv2/opencv.hpp>
+#include <queue>
+#include <algorithm>
+
+#include "dominant_colors.h"
+#include "buffer_allocator.h"
+#include "saliency.h"
+#include "trace.h"
+#include "perf_counters.h"
+#include "metrics.h"
+
+
+//
+// Pick the smallest packing that can hold 'count' class ids.
+// Class ids run from 0 to count-1.
+//
+int get_class_map_bits(int count)
+{
+    if(count <= 4)
+    {
+        return 2;
+    }
+    if(count <= 16)
+    {
+        return 4;
+    }
+    if(count <= 256)
+    {
+        return 8;
+    }
+    return 16;
+}
+
+
+//
+// The size in bytes of one row and of the whole packed class map
+//
+static size_t get_class_map_row_bytes(int width, int bits)
+{
+    return ((size_t)width * bits + 7) / 8;
+}
+
+
+size_t get_class_map_size(int width, int height, int count)
+{
+    return get_class_map_row_bytes(width, get_class_map_bits(count)) * height;
+}
+
+
+//
+// Create a class map for an image of the given size with every
+// pixel assigned to class 0.
+//
+t_class_map create_class_map(int width, int height, int count)
+{
+    t_class_map map;
+    map.bits = get_class_map_bits(count);
+    map.width = width;
+    map.height = height;
+
+    if(map.bits == 16)
+    {
+        map.storage = create_buffer_mat(height, width, CV_16UC1, cv::Scalar(0));
+    }
+    else
+    {
+        const int row_bytes = (int)get_class_map_row_bytes(width, map.bits);
+        map.storage = create_buffer_mat(height, row_bytes, CV_8UC1, cv::Scalar(0));
+    }
+
+    map.data = map.storage.data;
+    map.step = map.storage.step;
+    return map;
+}
+
+
+//
+// Lay a class map over a caller provided buffer of at least
+// get_class_map_size bytes and assign every pixel to class 0.
+//
+t_class_map wrap_class_map(uchar *buffer, int width, int height, int count)
+{
+    t_class_map map;
+    map.bits = get_class_map_bits(count);
+    map.width = width;
+    map.height = height;
+    map.data = buffer;
+    map.step = get_class_map_row_bytes(width, map.bits);
+    memset(buffer, 0, map.step * height);
+    return map;
+}
+
+
+//
+// Bump allocation from a caller provided arena.  Returns NULL
+// when the arena is exhausted.
+//
+void* arena_alloc(t_arena *arena, size_t size, size_t alignment)
+{
+    size_t start = (arena->used + alignment - 1) & ~(alignment - 1);
+    if(start + size > arena->size)
+    {
+        return NULL;
+    }
+
+    arena->used = start + size;
+    return arena->base + start;
+}
+
+
+t_split_config get_default_split_config()
+{
+    t_split_config config;
+    config.policy = SPLIT_MAX_EIGENVALUE;
+    config.optimal_threshold = false;
+    config.auto_count = AUTO_COUNT_NONE;
+    config.elbow = 0.005;
+    config.min_coverage = 0.01;
+    config.bic_samples = 100;
+    config.exclude = 0;
+    config.white_level = 240;
+    config.black_level = 16;
+    config.gray_chroma = 12;
+    config.border_tolerance = 24;
+    config.weighting = WEIGHT_NONE;
+    config.center_sigma = 0.5;
+    return config;
+}
+
+
+bool parse_split_policy(const char *name, t_split_policy &policy)
+{
+    static const struct { const char *name; t_split_policy policy; } names[] =
+    {
+        { "eigenvalue",       SPLIT_MAX_EIGENVALUE },
+        { "eigenvalue-count", SPLIT_EIGENVALUE_COUNT },
+        { "sse",              SPLIT_MAX_SSE_REDUCTION },
+        { "count",            SPLIT_MAX_COUNT }
+    };
+
+    for(size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+    {
+        if(strcmp(name, names[i].name) == 0)
+        {
+            policy = names[i].policy;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+bool parse_auto_count(const char *name, t_auto_count &auto_count)
+{
+    static const struct { const char *name; t_auto_count auto_count; } names[] =
+    {
+        { "elbow",    AUTO_COUNT_ELBOW },
+        { "bic",      AUTO_COUNT_BIC },
+        { "coverage", AUTO_COUNT_COVERAGE }
+    };
+
+    for(size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+    {
+        if(strcmp(name, names[i].name) == 0)
+        {
+            auto_count = names[i].auto_count;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+bool parse_pixel_weighting(const char *name, t_pixel_weighting &weighting)
+{
+    static const struct { const char *name; t_pixel_weighting weighting; } names[] =
+    {
+        { "none",     WEIGHT_NONE },
+        { "center",   WEIGHT_CENTER },
+        { "saliency", WEIGHT_SALIENCY }
+    };
+
+    for(size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+    {
+        if(strcmp(name, names[i].name) == 0)
+        {
+            weighting = names[i].weighting;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+bool parse_exclude_rules(const char *names, int &exclude)
+{
+    static const struct { const char *name; t_exclude_rule rule; } rules[] =
+    {
+        { "white",  EXCLUDE_WHITE },
+        { "black",  EXCLUDE_BLACK },
+        { "gray",   EXCLUDE_GRAY },
+        { "border", EXCLUDE_BORDER }
+    };
+
+    exclude = 0;
+    while(*names)
+    {
+        const size_t length = strcspn(names, ",");
+        bool found = false;
+        for(size_t i = 0; i < sizeof(rules) / sizeof(rules[0]); ++i)
+        {
+            if(strlen(rules[i].name) == length && strncmp(names, rules[i].name, length) == 0)
+            {
+                exclude |= rules[i].rule;
+                found = true;
+            }
+        }
+        if(!found)
+        {
+            return false;
+        }
+
+        names += length;
+        if(*names == ',')
+        {
+            names++;
+        }
+    }
+    return true;
+}
+
+
+//
+// The class ids a class map needs: one per class, and one
+// more for the excluded pixels if any rule is on
+//
+int get_class_map_count(int count, const t_split_config *config)
+{
+    return config && config->exclude ? count + 1 : count;
+}
+
+
+int get_max_color_count(const t_split_config *config)
+{
+    //
+    // a 16-bit class map holds 65536 ids
+    //
+    return 65536 - (get_class_map_count(1, config) - 1);
+}
+
+
+//
+// The per pixel exclusion rules of the first pass.  Excluded
+// pixels are moved to class 'classid', which no class uses.
+//
+typedef struct t_exclusion
+{
+    int     rules;
+    int     white_level;
+    int     black_level;
+    int     gray_chroma;
+    int     classid;
+} t_exclusion;
+
+
+static inline bool is_excluded_color(const t_exclusion *exclude, int c0, int c1, int c2)
+{
+    const int low = std::min(c0, std::min(c1, c2));
+    const int high = std::max(c0, std::max(c1, c2));
+    return ((exclude->rules & EXCLUDE_WHITE) && low >= exclude->white_level) ||
+           ((exclude->rules & EXCLUDE_BLACK) && high <= exclude->black_level) ||
+           ((exclude->rules & EXCLUDE_GRAY) && high - low <= exclude->gray_chroma);
+}
+
+
+//
+// A coarse color histogram gathered during the statistics pass of a class.
+// Each channel of the box [low, high] is cut into histogram_side bins.  A
+// class's box is the bounds of its parent's pixels, which hold all of its
+// own, so the bins narrow as the classes do.
+//
+static const int histogram_side = 32;
+static const int histogram_bins = histogram_side * histogram_side * histogram_side;
+
+static const int projection_bins = 256;
+
+typedef struct t_split_histogram
+{
+    uint64_t    *bins;          // pixel weight per bin
+    uchar       low[3];
+    uchar       high[3];
+    bool        optimal;        // choose the best cut, not the mean
+} t_split_histogram;
+
+
+static bool needs_split_histogram(const t_split_config &config)
+{
+    return config.policy == SPLIT_MAX_SSE_REDUCTION || config.optimal_threshold;
+}
+
+
+//
+// The threshold at the class mean, where a split is made by default
+//
+static double get_mean_threshold(const t_color_node *node)
+{
+    const double *eig = node->eigenvector;
+    return 255.0 * (eig[0] * node->mean[0] + eig[1] * node->mean[1] + eig[2] * node->mean[2]);
+}
+
+
+//
+// Storage of the border fill, carved out of the scratch arena: the
+// border histogram and a bounded stack of seeds, each the first pixel
+// of a run of backdrop pixels still to fill
+//
+typedef struct t_fill_seed
+{
+    int     x;
+    int     y;
+} t_fill_seed;
+
+typedef struct t_border_fill
+{
+    int         *counts;    // border_bins
+    int         *sums;      // border_bins * 3
+    t_fill_seed *seeds;     // border_seeds
+} t_border_fill;
+
+static const int border_bins = 4096;
+static const int border_seeds = 65536;
+
+
+static size_t get_border_fill_size()
+{
+    return border_bins * 4 * sizeof(int) + border_seeds * sizeof(t_fill_seed) + 3 * 16;
+}
+
+
+static bool alloc_border_fill(t_arena *arena, t_border_fill &fill)
+{
+    fill.counts = (int*)arena_alloc(arena, border_bins * sizeof(int), 16);
+    fill.sums = (int*)arena_alloc(arena, border_bins * 3 * sizeof(int), 16);
+    fill.seeds = (t_fill_seed*)arena_alloc(arena, border_seeds * sizeof(t_fill_seed), 16);
+    return fill.counts && fill.sums && fill.seeds;
+}
+
+
+//
+// The scratch needed by find_dominant_colors_into: the 2*count-1 tree
+// nodes, the table of count leaves, the histogram if the policy needs
+// one, the border fill if the border rule is on and room for their
+// alignment.
+//
+size_t get_scratch_size(int count, const t_split_config *config)
+{
+    size_t size = (2 * count - 1) * sizeof(t_color_node) + count * sizeof(t_color_node*) + 64;
+    if(config && needs_split_histogram(*config))
+    {
+        size += histogram_bins * sizeof(uint64_t) + 16;
+    }
+    if(config && (config->exclude & EXCLUDE_BORDER))
+    {
+        size += get_border_fill_size();
+    }
+    return size;
+}
+
+
+//
+// The pixel passes check for cancellation once per band of this many rows
+//
+static const int cancel_row_band = 64;
+
+
+//
+// Eigen decomposition of a symmetric 3x3 matrix with cyclic Jacobi
+// rotations.  Like cv::eigen the eigenvalues come back in descending
+// order and the eigenvectors are the rows of 'vectors'.  Unlike cv::eigen
+// nothing is allocated.
+//
+void get_symmetric_eigen(const double m[9], double values[3], double vectors[9])
+{
+    double a[9];
+    double v[9] = { 1, 0, 0,
+                    0, 1, 0,
+                    0, 0, 1 };
+    memcpy(a, m, sizeof(a));
+
+    for(int sweep = 0; sweep < 32; ++sweep)
+    {
+        const double off = a[1]*a[1] + a[2]*a[2] + a[5]*a[5];
+        const double diag = a[0]*a[0] + a[4]*a[4] + a[8]*a[8];
+        if(off <= 1e-30 * diag || off == 0)
+        {
+            break;
+        }
+
+        for(int p = 0; p < 2; ++p)
+        {
+            for(int q = p + 1; q < 3; ++q)
+            {
+                const double apq = a[p*3 + q];
+                if(apq == 0)
+                {
+                    continue;
+                }
+
+                //
+                // rotate rows and columns p and q to zero a[p][q]
+                //
+                const double theta = (a[q*3 + q] - a[p*3 + p]) / (2 * apq);
+                const double t = (theta >= 0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta*theta + 1));
+                const double c = 1 / sqrt(t*t + 1);
+                const double s = t * c;
+
+                for(int k = 0; k < 3; ++k)
+                {
+                    const double akp = a[k*3 + p];
+                    const double akq = a[k*3 + q];
+                    a[k*3 + p] = c*akp - s*akq;
+                    a[k*3 + q] = s*akp + c*akq;
+                }
+                for(int k = 0; k < 3; ++k)
+                {
+                    const double apk = a[p*3 + k];
+                    const double aqk = a[q*3 + k];
+                    a[p*3 + k] = c*apk - s*aqk;
+                    a[q*3 + k] = s*apk + c*aqk;
+                }
+                for(int k = 0; k < 3; ++k)
+                {
+                    const double vkp = v[k*3 + p];
+                    const double vkq = v[k*3 + q];
+                    v[k*3 + p] = c*vkp - s*vkq;
+                    v[k*3 + q] = s*vkp + c*vkq;
+                }
+            }
+        }
+    }
+
+    //
+    // The eigenvalues are on the diagonal and the eigenvectors are the
+    // columns of v.  Sort them into descending order.
+    //
+    int order[3] = { 0, 1, 2 };
+    for(int i = 1; i < 3; ++i)
+    {
+        for(int j = i; j > 0 && a[order[j]*4] > a[order[j - 1]*4]; --j)
+        {
+            const int tmp = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = tmp;
+        }
+    }
+
+    for(int i = 0; i < 3; ++i)
+    {
+        values[i] = a[order[i]*4];
+        for(int k = 0; k < 3; ++k)
+        {
+            vectors[i*3 + k] = v[k*3 + order[i]];
+        }
+    }
+}
+
+
+//
+// Choose the threshold of a class from its color histogram and cache the
+// drop in squared error, in the units of the covariance, that it gives.
+// The bins, each standing in for its pixels at its center, are projected
+// onto the principal axis into a 1D histogram that keeps the count and
+// color sums of each projection bin.  A cut between projection bins is
+// scored by the between class scatter of its two sides,
+//   |sum_left|^2 / n_left + |sum_right|^2 / n_right - |sum|^2 / n
+// With 'optimal' the best scoring cut is taken, as in Otsu's method,
+// otherwise the cut nearest the mean where the class splits by default.
+//
+static void set_histogram_split(const t_split_histogram *hist, t_color_node *node)
+{
+    const double *eig = node->eigenvector;
+
+    //
+    // the bin centers of each channel and their share of the projection
+    //
+    double center[3][histogram_side];
+    double projection[3][histogram_side];
+    for(int k = 0; k < 3; ++k)
+    {
+        const double width = (hist->high[k] - hist->low[k] + 1) / (double)histogram_side;
+        for(int b = 0; b < histogram_side; ++b)
+        {
+            center[k][b] = hist->low[k] + (b + 0.5) * width;
+            projection[k][b] = eig[k] * center[k][b];
+        }
+    }
+
+    //
+    // the range of the occupied bins along the axis
+    //
+    double pmin = INFINITY;
+    double pmax = -INFINITY;
+    const uint64_t *bin = hist->bins;
+    for(int b2 = 0; b2 < histogram_side; ++b2)
+    {
+        for(int b1 = 0; b1 < histogram_side; ++b1)
+        {
+            for(int b0 = 0; b0 < histogram_side; ++b0, ++bin)
+            {
+                if(*bin)
+                {
+                    const double p = projection[0][b0] + projection[1][b1] + projection[2][b2];
+                    pmin = std::min(pmin, p);
+                    pmax = std::max(pmax, p);
+                }
+            }
+        }
+    }
+
+    node->threshold = get_mean_threshold(node);
+    node->split_gain = 0;
+    if(!(pmax > pmin))
+    {
+        return;
+    }
+
+    double count[projection_bins];
+    double sum[projection_bins][3];
+    memset(count, 0, sizeof(count));
+    memset(sum, 0, sizeof(sum));
+    const double scale = (projection_bins - 1) / (pmax - pmin);
+    bin = hist->bins;
+    for(int b2 = 0; b2 < histogram_side; ++b2)
+    {
+        for(int b1 = 0; b1 < histogram_side; ++b1)
+        {
+            for(int b0 = 0; b0 < histogram_side; ++b0, ++bin)
+            {
+                if(*bin == 0)
+                {
+                    continue;
+                }
+
+                const double n = *bin;
+                const double p = projection[0][b0] + projection[1][b1] + projection[2][b2];
+                const int i = (int)((p - pmin) * scale + 0.5);
+                count[i] += n;
+                sum[i][0] += n * center[0][b0];
+                sum[i][1] += n * center[1][b1];
+                sum[i][2] += n * center[2][b2];
+            }
+        }
+    }
+
+    double total = 0;
+    double total_sum[3] = { 0, 0, 0 };
+    for(int i = 0; i < projection_bins; ++i)
+    {
+        total += count[i];
+        for(int k = 0; k < 3; ++k)
+        {
+            total_sum[k] += sum[i][k];
+        }
+    }
+    const double base = (total_sum[0] * total_sum[0] + total_sum[1] * total_sum[1] +
+                         total_sum[2] * total_sum[2]) / total;
+
+    //
+    // Sweep the cuts.  Cut i puts projection bins below i on the left.
+    // The default cut is the first one past the mean.
+    //
+    const int mean_cut = std::min(std::max((int)floor((node->threshold - pmin) * scale) + 1, 1), projection_bins - 1);
+    double left = 0;
+    double left_sum[3] = { 0, 0, 0 };
+    int last_left = -1;
+    double best_gain = 0;
+    int best_cut = -1;
+    int best_last_left = -1;
+    for(int i = 1; i < projection_bins; ++i)
+    {
+        if(count[i - 1] > 0)
+        {
+            left += count[i - 1];
+            for(int k = 0; k < 3; ++k)
+            {
+                left_sum[k] += sum[i - 1][k];
+            }
+            last_left = i - 1;
+        }
+
+        if(count[i] == 0 && i != mean_cut)
+        {
+            continue;
+        }
+
+        const double right = total - left;
+        if(left == 0 || right == 0)
+        {
+            continue;
+        }
+
+        double gain = -base;
+        for(int k = 0; k < 3; ++k)
+        {
+            const double right_sum = total_sum[k] - left_sum[k];
+            gain += left_sum[k] * left_sum[k] / left + right_sum * right_sum / right;
+        }
+
+        if(hist->optimal ? gain > best_gain : i == mean_cut)
+        {
+            best_gain = gain;
+            best_cut = i;
+            best_last_left = last_left;
+        }
+    }
+
+    //
+    // weighted bins count in units of pixel weight, so the gain is
+    // brought back to the node's pixel count
+    //
+    node->split_gain = std::max(best_gain, 0.0) / (255.0 * 255.0) * (node->pixel_count / total);
+    if(hist->optimal && best_cut > 0)
+    {
+        //
+        // cut half way between the occupied projection bins either side
+        //
+        int first_right = best_cut;
+        while(first_right < projection_bins - 1 && count[first_right] == 0)
+        {
+            first_right++;
+        }
+        node->threshold = pmin + 0.5 * (best_last_left + first_right) / scale;
+    }
+}
+
+
+//
+// This method calculates the mean and covariance for the pixel of the given class.
+// The largest eigenvalue of the covariance and its eigenvector are cached in the
+// node so that choosing and splitting the next class doesn't recompute them.
+// PASS selects the extra work of the pass:
+//   STATS_HISTOGRAM  bin the pixels into 'hist' and cache the class's
+//                    bounds, threshold and split gain
+//   STATS_EXCLUDE    move pixels matching the exclusion rules out of the
+//                    class as they are met
+//   STATS_WEIGHT     weigh each pixel by 'weights', sampled at its
+//                    relative position
+// Returns false, leaving the node untouched, if cancelled.
+//
+enum
+{
+    STATS_HISTOGRAM = 1,
+    STATS_EXCLUDE   = 2,
+    STATS_WEIGHT    = 4
+};
+
+template<int BITS, int PASS>
+bool get_class_mean_cov_packed(cv::Mat img, const t_class_map &classes, t_color_node *node,
+                               t_split_histogram *hist, const t_exclusion *exclude,
+                               const cv::Mat *weights, const t_cancel_token *cancel) {
+    const bool HIST = (PASS & STATS_HISTOGRAM) != 0;
+    const bool EXCLUDE = (PASS & STATS_EXCLUDE) != 0;
+    const bool WEIGHT = (PASS & STATS_WEIGHT) != 0;
+    const int width = img.cols;
+    const int height = img.rows;
+    const int classid = node->classid;
+
+    //
+    // the weight map column of pixel x is (x * weight_step) >> 32, the
+    // step rounded up so column boundaries land where x * cols / width does
+    //
+    const uint64_t weight_step = WEIGHT ? (((uint64_t)weights->cols << 32) + width - 1) / width : 0;
+
+    //
+    // the histogram bin of each channel value, already scaled
+    // by the channel's stride in the bin array
+    //
+    uint16_t lut[3][256];
+    uchar low[3] = { 255, 255, 255 };
+    uchar high[3] = { 0, 0, 0 };
+    if(HIST)
+    {
+        memset(hist->bins, 0, histogram_bins * sizeof(uint64_t));
+        const int stride[3] = { 1, histogram_side, histogram_side * histogram_side };
+        for(int k = 0; k < 3; ++k)
+        {
+            const int span = hist->high[k] - hist->low[k] + 1;
+            for(int v = 0; v < 256; ++v)
+            {
+                const int bin = std::min(std::max((v - hist->low[k]) * histogram_side / span, 0), histogram_side - 1);
+                lut[k][v] = (uint16_t)(bin * stride[k]);
+            }
+        }
+    }
+
+    //
+    // Sums of the channels and of their products.  The pixel values,
+    // and weights, are integers so we accumulate exactly and only
+    // normalize the colors to between 0 and 1 at the end.
+    //
+    uint64_t sum[3] = { 0, 0, 0 };
+    uint64_t sq[6] = { 0, 0, 0, 0, 0, 0 };
+    uint64_t pixcount = 0;
+
+    //
+    // Loop through all pixels.
+    //
+    for(int y = 0; y < height; ++y)
+    {
+        if(y % cancel_row_band == 0 && is_cancelled(cancel))
+        {
+            return false;
+        }
+
+        const cv::Vec3b *ptr = img.ptr<cv::Vec3b>(y);
+        uchar* ptrClass = classes.data + y * classes.step;
+        const uchar *ptrWeight = WEIGHT ? weights->ptr<uchar>((int)((int64_t)y * weights->rows / height)) : NULL;
+        for(int x = 0; x < width; ++x)
+        {
+            //
+            // we ignore pixels that aren't a member of the
+            // current class
+            //
+            if(get_packed_class<BITS>(ptrClass, x) != classid)
+            {
+                continue;
+            }
+
+            const unsigned int c0 = ptr[x][0];
+            const unsigned int c1 = ptr[x][1];
+            const unsigned int c2 = ptr[x][2];
+
+            if(EXCLUDE && is_excluded_color(exclude, c0, c1, c2))
+            {
+                set_packed_class<BITS>(ptrClass, x, exclude->classid);
+                continue;
+            }
+
+            if(WEIGHT)
+            {
+                const unsigned int w = ptrWeight[(x * weight_step) >> 32];
+                sum[0] += w * c0;
+                sum[1] += w * c1;
+                sum[2] += w * c2;
+                sq[0] += w * c0 * c0;
+                sq[1] += w * c0 * c1;
+                sq[2] += w * c0 * c2;
+                sq[3] += w * c1 * c1;
+                sq[4] += w * c1 * c2;
+                sq[5] += w * c2 * c2;
+                pixcount += w;
+                if(HIST)
+                {
+                    hist->bins[lut[0][c0] + lut[1][c1] + lut[2][c2]] += w;
+                }
+            }
+            else
+            {
+                sum[0] += c0;
+                sum[1] += c1;
+                sum[2] += c2;
+                sq[0] += c0 * c0;
+                sq[1] += c0 * c1;
+                sq[2] += c0 * c2;
+                sq[3] += c1 * c1;
+                sq[4] += c1 * c2;
+                sq[5] += c2 * c2;
+                pixcount++;
+                if(HIST)
+                {
+                    hist->bins[lut[0][c0] + lut[1][c1] + lut[2][c2]]++;
+                }
+            }
+
+            if(HIST)
+            {
+                low[0] = std::min(low[0], (uchar)c0);
+                low[1] = std::min(low[1], (uchar)c1);
+                low[2] = std::min(low[2], (uchar)c2);
+                high[0] = std::max(high[0], (uchar)c0);
+                high[1] = std::max(high[1], (uchar)c1);
+                high[2] = std::max(high[2], (uchar)c2);
+            }
+        }
+    }
+
+    //
+    // weighted counts are in units of a pixel of full weight
+    //
+    const double weight_unit = WEIGHT ? 255.0 : 1.0;
+    node->pixel_count = pixcount / weight_unit;
+    node->split_gain = 0;
+    if(pixcount == 0)
+    {
+        memset(node->mean, 0, sizeof(node->mean));
+        memset(node->covariance, 0, sizeof(node->covariance));
+        memset(node->eigenvector, 0, sizeof(node->eigenvector));
+        node->eigenvalue = 0;
+        node->threshold = 0;
+        return true;
+    }
+
+    //
+    // complete the covariance.  As before it is the scatter of the
+    // class, the sum of the squared deviations from the mean.
+    //
+    const double scale = 1.0 / (255.0 * 255.0 * weight_unit);
+    const double n = (double)pixcount;
+    const int index[9] = { 0, 1, 2,
+                           1, 3, 4,
+                           2, 4, 5 };
+    for(int i = 0; i < 3; ++i)
+    {
+        for(int j = 0; j < 3; ++j)
+        {
+            node->covariance[i*3 + j] = (sq[index[i*3 + j]] - (double)sum[i] * (double)sum[j] / n) * scale;
+        }
+    }
+
+    //
+    // dividing the sums by the pixel count makes them a mean
+    //
+    for(int i = 0; i < 3; ++i)
+    {
+        node->mean[i] = sum[i] / (n * 255.0);
+    }
+
+    //
+    // cache the principal axis of the class
+    //
+    double values[3], vectors[9];
+    get_symmetric_eigen(node->covariance, values, vectors);
+    node->eigenvalue = values[0];
+    node->eigenvector[0] = vectors[0];
+    node->eigenvector[1] = vectors[1];
+    node->eigenvector[2] = vectors[2];
+    node->threshold = get_mean_threshold(node);
+
+    if(HIST)
+    {
+        memcpy(node->low, low, sizeof(low));
+        memcpy(node->high, high, sizeof(high));
+        set_histogram_split(hist, node);
+    }
+    return true;
+}
+
+
+//
+// The statistics pass, gathering the split histogram when 'hist' is given,
+// applying the exclusion rules when 'exclude' is and weighing the pixels
+// when 'weights' is
+//
+template<int BITS>
+static bool get_class_stats_packed(cv::Mat img, const t_class_map &classes, t_color_node *node,
+                                   t_split_histogram *hist, const t_exclusion *exclude,
+                                   const cv::Mat *weights, const t_cancel_token *cancel)
+{
+    const int pass = (hist ? STATS_HISTOGRAM : 0) | (exclude ? STATS_EXCLUDE : 0) | (weights ? STATS_WEIGHT : 0);
+    switch(pass)
+    {
+        case 0: return get_class_mean_cov_packed<BITS, 0>(img, classes, node, hist, exclude, weights, cancel);
+        case 1: return get_class_mean_cov_packed<BITS, 1>(img, classes, node, hist, exclude, weights, cancel);
+        case 2: return get_class_mean_cov_packed<BITS, 2>(img, classes, node, hist, exclude, weights, cancel);
+        case 3: return get_class_mean_cov_packed<BITS, 3>(img, classes, node, hist, exclude, weights, cancel);
+        case 4: return get_class_mean_cov_packed<BITS, 4>(img, classes, node, hist, exclude, weights, cancel);
+        case 5: return get_class_mean_cov_packed<BITS, 5>(img, classes, node, hist, exclude, weights, cancel);
+        case 6: return get_class_mean_cov_packed<BITS, 6>(img, classes, node, hist, exclude, weights, cancel);
+        default: return get_class_mean_cov_packed<BITS, 7>(img, classes, node, hist, exclude, weights, cancel);
+    }
+}
+
+
+static bool get_class_stats(cv::Mat img, const t_class_map &classes, t_color_node *node,
+                            t_split_histogram *hist, const t_exclusion *exclude,
+                            const cv::Mat *weights, const t_cancel_token *cancel)
+{
+    switch(classes.bits)
+    {
+        case 2:  return get_class_stats_packed<2>(img, classes, node, hist, exclude, weights, cancel);
+        case 4:  return get_class_stats_packed<4>(img, classes, node, hist, exclude, weights, cancel);
+        case 8:  return get_class_stats_packed<8>(img, classes, node, hist, exclude, weights, cancel);
+        default: return get_class_stats_packed<16>(img, classes, node, hist, exclude, weights, cancel);
+    }
+}
+
+
+bool get_class_mean_cov(cv::Mat img, const t_class_map &classes, t_color_node *node,
+                        const t_cancel_token *cancel)
+{
+    return get_class_stats(img, classes, node, NULL, NULL, NULL, cancel);
+}
+
+
+static inline bool is_near_color(const cv::Vec3b &c, const int color[3], int tolerance)
+{
+    return abs(c[0] - color[0]) <= tolerance && abs(c[1] - color[1]) <= tolerance &&
+           abs(c[2] - color[2]) <= tolerance;
+}
+
+
+//
+// A pixel of the backdrop not yet moved to the excluded class
+//
+template<int BITS>
+static inline bool is_backdrop_pixel(const cv::Vec3b *ptr, const uchar *ptrClass, int x,
+                                     const int background[3], int tolerance)
+{
+    return get_packed_class<BITS>(ptrClass, x) == 0 && is_near_color(ptr[x], background, tolerance);
+}
+
+
+//
+// Fill the backdrop from the seeds on the stack.  Each seed's pixel is
+// widened to its run of backdrop pixels on the row, the run is moved to
+// class 'excluded' and the first pixel of each backdrop run touching it
+// on the rows above and below is pushed.  Returns false if the stack was
+// full and a seed was dropped, leaving part of the backdrop unfilled.
+//
+template<int BITS>
+static bool fill_backdrop_runs(cv::Mat img, const t_class_map &classes, const int background[3], int tolerance,
+                               int excluded, const t_border_fill &fill, int &size)
+{
+    const int width = img.cols;
+    const int height = img.rows;
+    bool complete = true;
+    while(size > 0)
+    {
+        const t_fill_seed seed = fill.seeds[--size];
+        const cv::Vec3b *ptr = img.ptr<cv::Vec3b>(seed.y);
+        uchar *ptrClass = classes.data + seed.y * classes.step;
+        if(!is_backdrop_pixel<BITS>(ptr, ptrClass, seed.x, background, tolerance))
+        {
+            continue;
+        }
+
+        int left = seed.x;
+        while(left > 0 && is_backdrop_pixel<BITS>(ptr, ptrClass, left - 1, background, tolerance))
+        {
+            left--;
+        }
+        int right = seed.x;
+        while(right < width - 1 && is_backdrop_pixel<BITS>(ptr, ptrClass, right + 1, background, tolerance))
+        {
+            right++;
+        }
+        for(int x = left; x <= right; ++x)
+        {
+            set_packed_class<BITS>(ptrClass, x, excluded);
+        }
+
+        for(int y = seed.y - 1; y <= seed.y + 1; y += 2)
+        {
+            if(y < 0 || y >= height)
+            {
+                continue;
+            }
+            const cv::Vec3b *ptrNext = img.ptr<cv::Vec3b>(y);
+            const uchar *ptrNextClass = classes.data + y * classes.step;
+            bool in_run = false;
+            for(int x = left; x <= right; ++x)
+            {
+                const bool backdrop = is_backdrop_pixel<BITS>(ptrNext, ptrNextClass, x, background, tolerance);
+                if(backdrop && !in_run)
+                {
+                    if(size < border_seeds)
+                    {
+                        fill.seeds[size].x = x;
+                        fill.seeds[size].y = y;
+                        size++;
+                    }
+                    else
+                    {
+                        complete = false;
+                    }
+                }
+                in_run = backdrop;
+            }
+        }
+    }
+    return complete;
+}
+
+
+//
+// Fill the backdrop from one pixel, with an empty stack
+//
+template<int BITS>
+static bool fill_backdrop_from(cv::Mat img, const t_class_map &classes, const int background[3], int tolerance,
+                               int excluded, const t_border_fill &fill, int x, int y)
+{
+    fill.seeds[0].x = x;
+    fill.seeds[0].y = y;
+    int size = 1;
+    return fill_backdrop_runs<BITS>(img, classes, background, tolerance, excluded, fill, size);
+}
+
+
+//
+// Exclude the backdrop: find the prevailing color of the image border and
+// flood fill, 4-connected, from the border pixels near it to every pixel
+// near it that they reach, moving those pixels to class 'excluded'.  A
+// border without one color on at least half of it has no backdrop.
+//
+template<int BITS>
+static void exclude_border_background_packed(cv::Mat img, const t_class_map &classes, int tolerance, int excluded,
+                                             const t_border_fill &fill)
+{
+    const int width = img.cols;
+    const int height = img.rows;
+
+    //
+    // The prevailing color is the mean of the most common bin of a
+    // 16 level per channel histogram of the border pixels.  Inner
+    // rows only have their first and last pixel on the border.
+    //
+    memset(fill.counts, 0, border_bins * sizeof(int));
+    memset(fill.sums, 0, border_bins * 3 * sizeof(int));
+    int border_count = 0;
+    for(int y = 0; y < height; ++y)
+    {
+        const int step = y == 0 || y == height - 1 ? 1 : std::max(width - 1, 1);
+        const cv::Vec3b *ptr = img.ptr<cv::Vec3b>(y);
+        for(int x = 0; x < width; x += step)
+        {
+            const cv::Vec3b c = ptr[x];
+            const int bin = (c[0] >> 4) << 8 | (c[1] >> 4) << 4 | c[2] >> 4;
+            fill.counts[bin]++;
+            fill.sums[bin * 3] += c[0];
+            fill.sums[bin * 3 + 1] += c[1];
+            fill.sums[bin * 3 + 2] += c[2];
+            border_count++;
+        }
+    }
+
+    const int top = (int)(std::max_element(fill.counts, fill.counts + border_bins) - fill.counts);
+    if(fill.counts[top] * 2 < border_count)
+    {
+        return;
+    }
+
+    int background[3];
+    for(int k = 0; k < 3; ++k)
+    {
+        background[k] = (fill.sums[top * 3 + k] + fill.counts[top] / 2) / fill.counts[top];
+    }
+
+    //
+    // Scanline fill from each border pixel of the backdrop.  The seed
+    // stack is bounded, so a backdrop with more pending runs than it
+    // holds drops some; then whole image passes resume the fill from
+    // every backdrop pixel next to a filled one until a pass finds none.
+    //
+    bool complete = true;
+    for(int y = 0; y < height; ++y)
+    {
+        const int step = y == 0 || y == height - 1 ? 1 : std::max(width - 1, 1);
+        const cv::Vec3b *ptr = img.ptr<cv::Vec3b>(y);
+        const uchar *ptrClass = classes.data + y * classes.step;
+        for(int x = 0; x < width; x += step)
+        {
+            if(is_backdrop_pixel<BITS>(ptr, ptrClass, x, background, tolerance))
+            {
+                complete &= fill_backdrop_from<BITS>(img, classes, background, tolerance, excluded, fill, x, y);
+            }
+        }
+    }
+
+    bool found = !complete;
+    while(found)
+    {
+        found = false;
+        for(int y = 0; y < height; ++y)
+        {
+            const cv::Vec3b *ptr = img.ptr<cv::Vec3b>(y);
+            const uchar *ptrClass = classes.data + y * classes.step;
+            const uchar *ptrAbove = y > 0 ? ptrClass - classes.step : NULL;
+            const uchar *ptrBelow = y < height - 1 ? ptrClass + classes.step : NULL;
+            for(int x = 0; x < width; ++x)
+            {
+                if(!is_backdrop_pixel<BITS>(ptr, ptrClass, x, background, tolerance))
+                {
+                    continue;
+                }
+                if((x > 0 && get_packed_class<BITS>(ptrClass, x - 1) == excluded) ||
+                   (x < width - 1 && get_packed_class<BITS>(ptrClass, x + 1) == excluded) ||
+                   (ptrAbove && get_packed_class<BITS>(ptrAbove, x) == excluded) ||
+                   (ptrBelow && get_packed_class<BITS>(ptrBelow, x) == excluded))
+                {
+                    fill_backdrop_from<BITS>(img, classes, background, tolerance, excluded, fill, x, y);
+                    found = true;
+                }
+            }
+        }
+    }
+}
+
+
+static void exclude_border_background(cv::Mat img, const t_class_map &classes, int tolerance, int excluded,
+                                      const t_border_fill &fill)
+{
+    switch(classes.bits)
+    {
+        case 2:  exclude_border_background_packed<2>(img, classes, tolerance, excluded, fill);  break;
+        case 4:  exclude_border_background_packed<4>(img, classes, tolerance, excluded, fill);  break;
+        case 8:  exclude_border_background_packed<8>(img, classes, tolerance, excluded, fill);  break;
+        default: exclude_border_background_packed<16>(img, classes, tolerance, excluded, fill); break;
+    }
+}
+
+
+//
+// Return the leaf with the highest covariance eigenvalue.
+// The eigenvalues were cached when the leaf statistics were computed.
+//
+t_color_node* get_max_eigenvalue_node(t_color_node **leaves, int leaf_count) {
+    double max_eigen = -1;
+    t_color_node *ret = leaves[0];
+
+    for(int i = 0; i < leaf_count; ++i)
+    {
+        if(leaves[i]->eigenvalue > max_eigen)
+        {
+            max_eigen = leaves[i]->eigenvalue;
+            ret = leaves[i];
+        }
+    }
+
+    return ret;
+}
+
+
+//
+// How urgently a leaf wants splitting under 'policy'.  Everything
+// comes from the statistics cached by the last pixel pass.
+//
+double get_split_priority(const t_color_node *node, t_split_policy policy)
+{
+    switch(policy)
+    {
+        case SPLIT_EIGENVALUE_COUNT:  return node->eigenvalue * node->pixel_count;
+        case SPLIT_MAX_SSE_REDUCTION: return node->split_gain;
+        case SPLIT_MAX_COUNT:         return node->pixel_count;
+        default:                      return node->eigenvalue;
+    }
+}
+
+
+//
+// Return the leaf to split next under 'policy', or NULL when
+// every leaf is a single color and there is nothing left to split.
+//
+t_color_node* get_split_node(t_color_node **leaves, int leaf_count, t_split_policy policy)
+{
+    double max_priority = -1;
+    t_color_node *ret = NULL;
+
+    for(int i = 0; i < leaf_count; ++i)
+    {
+        if(leaves[i]->eigenvalue <= 0)
+        {
+            continue;
+        }
+
+        const double priority = get_split_priority(leaves[i], policy);
+        if(priority > max_priority)
+        {
+            max_priority = priority;
+            ret = leaves[i];
+        }
+    }
+
+    return ret;
+}
+
+
+//
+// This method walks the tree and returns a vector of
+// the leaf nodes. Each leaf node represents a dominant
+// color in the image.
+//
+std::vector<t_color_node*> get_leaves(t_color_node *root)
+{
+    //
+    // our return vector of leaf nodes
+    //
+    std::vector<t_color_node*> leaf_nodes;
+
+    //
+    // maintain a queue of nodes.  We will
+    // walk the tree and only add nodes
+    // if they don't have children.
+    //
+    std::queue<t_color_node*> queue;
+    queue.push(root);
+
+    while(queue.size() > 0)
+    {
+        t_color_node *current = queue.front();
+        queue.pop();
+
+        if(current->left && current->right)
+        {
+            queue.push(current->left);
+            queue.push(current->right);
+            continue;
+        }
+
+        //
+        // No Children.  push onto our return list.
+        //
+        leaf_nodes.push_back(current);
+    }
+
+    return leaf_nodes;
+}
+
+
+//
+// The color of a class, its mean scaled back to 0-255
+//
+cv::Vec3b get_node_color(const t_color_node *node)
+{
+    return cv::Vec3b((uchar)(node->mean[0] * 255.0f),
+                     (uchar)(node->mean[1] * 255.0f),
+                     (uchar)(node->mean[2] * 255.0f));
+}
+
+
+//
+// The colors of the leaves.  A tree cancelled before its first
+// pass has an empty root and so no colors.
+//
+std::vector<cv::Vec3b> get_dominant_colors(t_color_node *root)
+{
+    std::vector<t_color_node*> leaves = get_leaves(root);
+    std::vector<cv::Vec3b> ret;
+
+    for(size_t i = 0; i < leaves.size(); ++i)
+    {
+        if(leaves[i]->pixel_count > 0)
+        {
+            ret.push_back(get_node_color(leaves[i]));
+        }
+    }
+
+    return ret;
+}
+
+
+template<int BITS>
+cv::Mat get_quantized_image_packed(const t_class_map &classes, t_color_node *root)
+{
+    std::vector<t_color_node*> leaves = get_leaves(root);
+
+    //
+    // the color of each class id.  Ids with no class, such as
+    // excluded pixels, are black.
+    //
+    std::vector<cv::Vec3b> lut(std::max(leaves.size(), (size_t)1 << BITS));
+    for(size_t i = 0; i < leaves.size(); ++i)
+    {
+        lut[leaves[i]->classid] = get_node_color(leaves[i]);
+    }
+
+    const int height = classes.height;
+    const int width = classes.width;
+    cv::Mat ret = create_buffer_mat(height, width, CV_8UC3, cv::Scalar(0));
+
+    for(int y=0; y<height; ++y)
+    {
+        const uchar *ptrClass = classes.data + y * classes.step;
+
+        cv::Vec3b *ptr = ret.ptr<cv::Vec3b>(y);
+
+        for(int x=0; x < width; ++x)
+        {
+            ptr[x] = lut[get_packed_class<BITS>(ptrClass, x)];
+        }
+    }
+
+    return ret;
+}
+
+
+cv::Mat get_quantized_image(const t_class_map &classes, t_color_node *root)
+{
+    t_trace_span span("render");
+    t_perf_scope counters(PERF_RENDER);
+    switch(classes.bits)
+    {
+        case 2:  return get_quantized_image_packed<2>(classes, root);
+        case 4:  return get_quantized_image_packed<4>(classes, root);
+        case 8:  return get_quantized_image_packed<8>(classes, root);
+        default: return get_quantized_image_packed<16>(classes, root);
+    }
+}
+
+
+template<int BITS>
+cv::Mat get_viewable_image_packed(const t_class_map &classes, int excluded) {
+    const int height = classes.height;
+    const int width = classes.width;
+
+    const int max_color_count = 18;
+    cv::Vec3b *palette = new cv::Vec3b[max_color_count];
+    palette[0]  = cv::Vec3b(  0,   0,   0);
+    palette[1]  = cv::Vec3b(255,   0,   0);
+    palette[2]  = cv::Vec3b(  0, 255,   0);
+    palette[3]  = cv::Vec3b(  0,   0, 255);
+    palette[4]  = cv::Vec3b(255, 255,   0);
+    palette[5]  = cv::Vec3b(  0, 255, 255);
+    palette[6]  = cv::Vec3b(255,   0, 255);
+    palette[7]  = cv::Vec3b(128, 128, 128);
+    palette[8]  = cv::Vec3b(128, 255, 128);
+    palette[9]  = cv::Vec3b( 32,  32,  32);
+    palette[10] = cv::Vec3b(255, 128, 128);
+    palette[11] = cv::Vec3b(128, 128, 255);
+    palette[12] = cv::Vec3b(255, 255, 255);
+    palette[13] = cv::Vec3b( 32, 128, 128);
+    palette[14] = cv::Vec3b(128,  32, 128);
+    palette[15] = cv::Vec3b(128, 128,  32);
+    palette[16] = cv::Vec3b(128,  32,  32);
+    palette[17] = cv::Vec3b( 32, 128,  32);
+
+    cv::Mat ret = create_buffer_mat(height, width, CV_8UC3, cv::Scalar(0, 0, 0));
+
+    //
+    // black is the background: class ids start at 0, so class i is
+    // drawn in palette[i + 1].  Pixels of later classes, and excluded
+    // pixels, stay black.
+    //
+    bool warned = false;
+    for(int y = 0; y < height; ++y)
+    {
+        cv::Vec3b *ptr = ret.ptr<cv::Vec3b>(y);
+        const uchar *ptrClass = classes.data + y * classes.step;
+        for(int x = 0; x < width; ++x)
+        {
+            int color = get_packed_class<BITS>(ptrClass, x);
+            if(color == excluded)
+            {
+                continue;
+            }
+            if(color + 1 >= max_color_count)
+            {
+                if(!warned)
+                {
+                    fprintf(stderr, "You should increase the number of predefined colors!\n");
+                    warned = true;
+                }
+                continue;
+            }
+
+            ptr[x] = palette[color + 1];
+        }
+    }
+
+    delete [] palette;
+    return ret;
+}
+
+
+cv::Mat get_viewable_image(const t_class_map &classes, int excluded)
+{
+    t_trace_span span("render");
+    t_perf_scope counters(PERF_RENDER);
+    switch(classes.bits)
+    {
+        case 2:  return get_viewable_image_packed<2>(classes, excluded);
+        case 4:  return get_viewable_image_packed<4>(classes, excluded);
+        case 8:  return get_viewable_image_packed<8>(classes, excluded);
+        default: return get_viewable_image_packed<16>(classes, excluded);
+    }
+}
+
+
+
+cv::Mat get_dominant_palette(std::vector<cv::Vec3b> colors)
+{
+    const int tile_size = 64;
+    cv::Mat ret = cv::Mat(tile_size, tile_size*colors.size(), CV_8UC3, cv::Scalar(0));
+    for(int i = 0; i < colors.size(); ++i)
+    {
+        cv::Rect rect(i*tile_size, 0, tile_size, tile_size);
+        cv::rectangle(ret, rect, cv::Scalar(colors[i][0], colors[i][1], colors[i][2]), CV_FILLED);
+    }
+
+    return ret;
+}
+
+
+//
+// Move every pixel of class 'from' in the first 'rows' rows to class 'to'
+//
+template<int BITS>
+void relabel_class_packed(const t_class_map &classes, int from, int to, int rows)
+{
+    for(int y = 0; y < rows; ++y)
+    {
+        uchar *ptrClass = classes.data + y * classes.step;
+        for(int x = 0; x < classes.width; ++x)
+        {
+            if(get_packed_class<BITS>(ptrClass, x) == from)
+            {
+                set_packed_class<BITS>(ptrClass, x, to);
+            }
+        }
+    }
+}
+
+
+//
+// this method takes a class represented in the class map and splits it into two.
+// The left child keeps the id of the class being split and the right child
+// takes 'nextid', so the ids in use always run from 0 to the leaf count - 1
+// and fit in the packing chosen for the class map.  The children are the
+// caller provided nodes 'left' and 'right'.  If cancelled part way the pixels
+// already moved are put back, so the class map matches the unsplit tree, and
+// false is returned.
+//
+template<int BITS>
+bool partition_class_packed(cv::Mat img, const t_class_map &classes, int nextid, t_color_node *node,
+                            t_color_node *left, t_color_node *right, const t_cancel_token *cancel)
+{
+    const int width = img.cols;
+    const int height = img.rows;
+    const int classid = node->classid;
+
+    //
+    // the new ids for each new node.
+    //
+    const int newidleft = classid;
+    const int newidright = nextid;
+
+    //
+    // we use the class's principal axis and the threshold
+    // chosen with its statistics, by default the projection
+    // of its mean, as the comparison_value for splitting.
+    // Pixels are compared in 0-255 units.
+    //
+    const double *eig = node->eigenvector;
+    const double comparison_value = node->threshold;
+
+    //
+    // Setup our new class nodes
+    //
+    memset(left, 0, sizeof(t_color_node));
+    memset(right, 0, sizeof(t_color_node));
+    node->left = left;
+    node->right = right;
+    node->left->classid = newidleft;
+    node->right->classid = newidright;
+
+    //
+    // Loop through all pixels in the class
+    // and split on the comparison value
+    //
+    for(int y = 0; y < height; ++y)
+    {
+        if(y % cancel_row_band == 0 && is_cancelled(cancel))
+        {
+            relabel_class_packed<BITS>(classes, newidright, classid, y);
+            node->left = NULL;
+            node->right = NULL;
+            return false;
+        }
+
+        const cv::Vec3b *ptr = img.ptr<cv::Vec3b>(y);
+        uchar *ptrClass = classes.data + y * classes.step;
+        for(int x = 0; x < width; ++x)
+        {
+            //
+            // disregard pixels that do not belong to class
+            // we are splitting
+            //
+            if(get_packed_class<BITS>(ptrClass, x) != classid)
+            {
+                continue;
+            }
+
+            const double this_value = eig[0] * ptr[x][0] + eig[1] * ptr[x][1] + eig[2] * ptr[x][2];
+            if(this_value > comparison_value)
+            {
+                set_packed_class<BITS>(ptrClass, x, newidright);
+            }
+        }
+    }
+    return true;
+}
+
+
+bool partition_class(cv::Mat img, const t_class_map &classes, int nextid, t_color_node *node,
+                     t_color_node *left, t_color_node *right, const t_cancel_token *cancel)
+{
+    switch(classes.bits)
+    {
+        case 2:  return partition_class_packed<2>(img, classes, nextid, node, left, right, cancel);
+        case 4:  return partition_class_packed<4>(img, classes, nextid, node, left, right, cancel);
+        case 8:  return partition_class_packed<8>(img, classes, nextid, node, left, right, cancel);
+        default: return partition_class_packed<16>(img, classes, nextid, node, left, right, cancel);
+    }
+}
+
+
+//
+// Undo a completed partition_class: the right child's pixels
+// go back to the parent's id and the children are dropped.
+//
+void unpartition_class(const t_class_map &classes, t_color_node *node)
+{
+    switch(classes.bits)
+    {
+        case 2:  relabel_class_packed<2>(classes, node->right->classid, node->classid, classes.height);  break;
+        case 4:  relabel_class_packed<4>(classes, node->right->classid, node->classid, classes.height);  break;
+        case 8:  relabel_class_packed<8>(classes, node->right->classid, node->classid, classes.height);  break;
+        default: relabel_class_packed<16>(classes, node->right->classid, node->classid, classes.height); break;
+    }
+
+    node->left = NULL;
+    node->right = NULL;
+}
+
+
+//
+// The squared error of a class about its mean, the trace of its scatter
+//
+static double get_class_sse(const t_color_node *node)
+{
+    return node->covariance[0] + node->covariance[4] + node->covariance[8];
+}
+
+
+//
+// The BIC of 'count' classes with total squared error 'sse' over 'n'
+// samples, lower is better.  Each class is a spherical Gaussian with a
+// shared variance and has a mean and a weight as parameters.  Errors are
+// taken in 0-255 units plus the 1/12 variance of 8 bit quantization, so
+// a perfect fit doesn't take the log of zero.
+//
+static double get_bic(double sse, double n, int count)
+{
+    const int d = 3;
+    const double variance = sse * 255.0 * 255.0 / (n * d) + 1.0 / 12;
+    return n * d * log(variance) + count * (d + 1) * log(n);
+}
+
+
+//
+// Whether an automatic count keeps the split of 'node' into 'left' and
+// 'right', 'count' being the classes before it and 'sse' their total
+// squared error.  Judged only from the moments cached in the nodes.
+//
+static bool keep_auto_split(const t_split_config &config, const t_color_node *root, const t_color_node *node,
+                            const t_color_node *left, const t_color_node *right, int count, double sse)
+{
+    const double drop = get_class_sse(node) - get_class_sse(left) - get_class_sse(right);
+    switch(config.auto_count)
+    {
+        case AUTO_COUNT_ELBOW:
+            return drop >= config.elbow * get_class_sse(root);
+        case AUTO_COUNT_BIC:
+        {
+            const double n = std::min(root->pixel_count, config.bic_samples);
+            return get_bic(sse - drop, n, count + 1) < get_bic(sse, n, count);
+        }
+        case AUTO_COUNT_COVERAGE:
+            return std::min(left->pixel_count, right->pixel_count) >= config.min_coverage * root->pixel_count;
+        default:
+            return true;
+    }
+}
+
+
+//
+// Why a split stopped: an explicit cancel or the token's deadline
+//
+static t_split_status get_cancel_status(const t_cancel_token *cancel)
+{
+    return cancel->cancelled.load() ? SPLIT_CANCELLED : SPLIT_TIMED_OUT;
+}
+
+
+static thread_local t_split_boundary_hook g_split_boundary_hook = NULL;
+static thread_local void *g_split_boundary_context = NULL;
+
+
+void set_split_boundary_hook(t_split_boundary_hook hook, void *context)
+{
+    g_split_boundary_hook = hook;
+    g_split_boundary_context = context;
+}
+
+
+//
+// The splitting loop shared by every entry point.  All storage is
+// provided by the caller: 'nodes' holds 2*count-1 nodes and 'leaves'
+// count pointers.  On return leaves[i] is the leaf with class id i.
+// Returns the number of leaves, which is less than 'count' when the
+// image runs out of colors to split or the split is cancelled.  The
+// cancel token is checked between splits and once per band of rows in
+// every pixel pass; a split interrupted part way is rolled back so the
+// leaves and the class map always agree.  'hist' is the histogram
+// storage when the policy needs one, otherwise NULL.  'weights' is the
+// pixel weight map, or NULL to count every pixel once.  'fill' is the
+// border fill's storage with the border rule, otherwise NULL.  The
+// thread's split boundary hook runs before each split.
+//
+static int split_classes(cv::Mat img, int count, const t_class_map &classes,
+                         t_color_node *nodes, t_color_node **leaves,
+                         const t_cancel_token *cancel, t_split_status *status,
+                         const t_split_config &config, t_split_histogram *hist,
+                         const cv::Mat *weights, const t_border_fill *fill)
+{
+    t_split_status result = SPLIT_COMPLETE;
+
+    //
+    // We will maintain a tree of classes.  Every pixel in the
+    // image will be eventually mapped to one of the classes.
+    // Here we create the inital tree - a tree of one node
+    // with a class id of 0
+    //
+    t_color_node *root = &nodes[0];
+    memset(root, 0, sizeof(t_color_node));
+    root->classid = 0;
+    int node_count = 1;
+
+    leaves[0] = root;
+    int leaf_count = 1;
+
+    //
+    // Calculate the initial mean and covariance.  The root's
+    // histogram covers the whole color cube.
+    //
+    if(hist)
+    {
+        memset(hist->low, 0, sizeof(hist->low));
+        memset(hist->high, 255, sizeof(hist->high));
+    }
+
+    //
+    // Excluded pixels go to the id after the last class.  The backdrop
+    // is filled first; the per pixel rules are applied by the first pass.
+    //
+    t_exclusion exclusion;
+    exclusion.rules = config.exclude;
+    exclusion.white_level = config.white_level;
+    exclusion.black_level = config.black_level;
+    exclusion.gray_chroma = config.gray_chroma;
+    exclusion.classid = count;
+    if((config.exclude & EXCLUDE_BORDER) && fill)
+    {
+        t_trace_span span("exclude border");
+        exclude_border_background(img, classes, config.border_tolerance, count, *fill);
+    }
+
+    const bool exclude_pixels = (config.exclude & (EXCLUDE_WHITE | EXCLUDE_BLACK | EXCLUDE_GRAY)) != 0;
+    bool root_ok;
+    {
+        t_trace_span span("root stats");
+        t_perf_scope counters(PERF_ROOT_STATS);
+        t_stage_timer timer(STAGE_ROOT_STATS);
+        root_ok = get_class_stats(img, classes, root, hist, exclude_pixels ? &exclusion : NULL, weights, cancel);
+    }
+    if(!root_ok)
+    {
+        if(status)
+        {
+            *status = get_cancel_status(cancel);
+        }
+        return 0;
+    }
+
+    //
+    // Keep splitting until we get to 'count' number of classes.  The
+    // total squared error of the leaves is kept for automatic counts.
+    //
+    double sse = get_class_sse(root);
+    while(leaf_count < count)
+    {
+        if(g_split_boundary_hook)
+        {
+            g_split_boundary_hook(g_split_boundary_context);
+        }
+        if(is_cancelled(cancel))
+        {
+            result = get_cancel_status(cancel);
+            break;
+        }
+
+        t_trace_span span("split", "classes", leaf_count);
+        t_perf_scope counters(PERF_SPLIT);
+        t_stage_timer timer(STAGE_SPLIT);
+
+        //
+        // find the leaf node the policy ranks highest.
+        // When every class is a single color there is nothing left to split.
+        //
+        t_color_node *next = get_split_node(leaves, leaf_count, config.policy);
+        if(!next)
+        {
+            break;
+        }
+
+        //
+        // partition on that node.
+        //
+        t_color_node *left = &nodes[node_count];
+        t_color_node *right = &nodes[node_count + 1];
+        if(!partition_class(img, classes, leaf_count, next, left, right, cancel))
+        {
+            result = get_cancel_status(cancel);
+            break;
+        }
+
+        //
+        // now recalculate the mean and covariance for the new classes
+        // in each side of the tree.  Both lie within the parent's bounds.
+        //
+        if(hist)
+        {
+            memcpy(hist->low, next->low, sizeof(hist->low));
+            memcpy(hist->high, next->high, sizeof(hist->high));
+        }
+        if(!get_class_stats(img, classes, left, hist, NULL, weights, cancel) ||
+           !get_class_stats(img, classes, right, hist, NULL, weights, cancel))
+        {
+            unpartition_class(classes, next);
+            result = get_cancel_status(cancel);
+            break;
+        }
+
+        //
+        // A cut chosen from the histogram sees the pixels only to within
+        // a bin, so can miss them all.  Split such a class at its mean.
+        //
+        if((left->pixel_count == 0 || right->pixel_count == 0) && next->threshold != get_mean_threshold(next))
+        {
+            unpartition_class(classes, next);
+            next->threshold = get_mean_threshold(next);
+            continue;
+        }
+
+        //
+        // an automatic count stops at the first split not worth keeping
+        //
+        if(!keep_auto_split(config, root, next, left, right, leaf_count, sse))
+        {
+            unpartition_class(classes, next);
+            break;
+        }
+
+        sse += get_class_sse(left) + get_class_sse(right) - get_class_sse(next);
+        node_count += 2;
+        leaves[left->classid] = left;
+        leaves[right->classid] = right;
+        leaf_count++;
+    }
+
+    if(status)
+    {
+        *status = result;
+    }
+    return leaf_count;
+}
+
+
+//
+// The pixel weight map of the image, empty for unweighted splits
+//
+static cv::Mat get_weight_map(cv::Mat img, const t_split_config &config)
+{
+    switch(config.weighting)
+    {
+        case WEIGHT_CENTER:
+            return get_center_weights(config.center_sigma);
+        case WEIGHT_SALIENCY:
+        {
+            t_trace_span span("saliency");
+            return get_spectral_residual_saliency(img);
+        }
+        case WEIGHT_MAP:
+            if(!config.weight_map.empty() && config.weight_map.type() == CV_8UC1)
+            {
+                return config.weight_map;
+            }
+            return cv::Mat();
+        default:
+            return cv::Mat();
+    }
+}
+
+
+//
+// This method splits the image into 'count' color classes.  On return
+// 'classes' holds the class of every pixel and the returned tree holds
+// the mean and covariance of every class.
+//
+t_color_node* build_color_tree(cv::Mat img, int count, t_class_map &classes,
+                               const t_cancel_token *cancel, t_split_status *status,
+                               const t_split_config *config)
+{
+    const t_split_config split_config = config ? *config : get_default_split_config();
+    if(count > get_max_color_count(&split_config))
+    {
+        count = get_max_color_count(&split_config);
+    }
+
+    //
+    // we will be bucketing each pixel into one of 'count' Classes.
+    // we create a packed class map to represent the class of each pixel.
+    // each pixel starts out with a class of 0
+    //
+    classes = create_class_map(img.cols, img.rows, get_class_map_count(count, &split_config));
+
+    //
+    // the nodes of the tree live in one block, root first
+    //
+    t_color_node *nodes = new t_color_node[2 * count - 1];
+    std::vector<t_color_node*> leaves(count);
+
+    std::vector<uint64_t> bins;
+    t_split_histogram hist;
+    if(needs_split_histogram(split_config))
+    {
+        bins.resize(histogram_bins);
+        hist.bins = &bins[0];
+        hist.optimal = split_config.optimal_threshold;
+    }
+
+    std::vector<uchar> fill_memory;
+    t_border_fill fill;
+    if(split_config.exclude & EXCLUDE_BORDER)
+    {
+        fill_memory.resize(get_border_fill_size());
+        t_arena arena;
+        arena.base = &fill_memory[0];
+        arena.size = fill_memory.size();
+        arena.used = 0;
+        alloc_border_fill(&arena, fill);
+    }
+
+    cv::Mat weights = get_weight_map(img, split_config);
+    split_classes(img, count, classes, nodes, &leaves[0], cancel, status, split_config,
+                  bins.empty() ? NULL : &hist, weights.empty() ? NULL : &weights,
+                  fill_memory.empty() ? NULL : &fill);
+
+    return nodes;
+}
+
+
+//
+// Release a tree returned by build_color_tree
+//
+void free_color_tree(t_color_node *root)
+{
+    delete [] root;
+}
+
+
+//
+// This method determines the dominant colors in the given image.
+// Returns a vector of the 'count' dominant colors
+//
+std::vector<cv::Vec3b> find_dominant_colors(cv::Mat img, int count)
+{
+    t_class_map classes;
+    t_color_node *root = build_color_tree(img, count, classes);
+
+    std::vector<cv::Vec3b> colors = get_dominant_colors(root);
+
+    free_color_tree(root);
+    return colors;
+}
+
+
+//
+// The allocation free variant of find_dominant_colors.  See dominant_colors.h.
+//
+int find_dominant_colors_into(cv::Mat img, int count,
+                              cv::Vec3b *colors, double *weights,
+                              uchar *class_map, size_t class_map_size,
+                              t_arena *scratch, const t_cancel_token *cancel,
+                              t_split_status *status, const t_split_config *config)
+{
+    const t_split_config split_config = config ? *config : get_default_split_config();
+
+    if(img.type() != CV_8UC3 || count <= 0 || count > get_max_color_count(&split_config) ||
+       !colors || !class_map || !scratch)
+    {
+        return -1;
+    }
+
+    const int map_count = get_class_map_count(count, &split_config);
+    if(class_map_size < get_class_map_size(img.cols, img.rows, map_count))
+    {
+        return -1;
+    }
+
+    //
+    // carve the tree out of the scratch arena
+    //
+    const size_t mark = scratch->used;
+    t_color_node *nodes = (t_color_node*)arena_alloc(scratch, (2 * count - 1) * sizeof(t_color_node), 16);
+    t_color_node **leaves = (t_color_node**)arena_alloc(scratch, count * sizeof(t_color_node*), 16);
+    t_split_histogram hist;
+    hist.bins = NULL;
+    hist.optimal = split_config.optimal_threshold;
+    if(needs_split_histogram(split_config))
+    {
+        hist.bins = (uint64_t*)arena_alloc(scratch, histogram_bins * sizeof(uint64_t), 16);
+    }
+    t_border_fill fill;
+    const bool border = (split_config.exclude & EXCLUDE_BORDER) != 0;
+    if(!nodes || !leaves || (needs_split_histogram(split_config) && !hist.bins) ||
+       (border && !alloc_border_fill(scratch, fill)))
+    {
+        scratch->used = mark;
+        return -1;
+    }
+
+    t_class_map classes = wrap_class_map(class_map, img.cols, img.rows, map_count);
+    cv::Mat pixel_weights = get_weight_map(img, split_config);
+    const int leaf_count = split_classes(img, count, classes, nodes, leaves, cancel, status, split_config,
+                                         hist.bins ? &hist : NULL, pixel_weights.empty() ? NULL : &pixel_weights,
+                                         border ? &fill : NULL);
+
+    //
+    // the palette is indexed by class id, the values in the class map.
+    // Weights are shares of the pixels in the tree, which are all of
+    // them unless some were excluded, counted by their pixel weight.
+    //
+    const double total = leaf_count > 0 ? nodes[0].pixel_count : 0;
+    for(int i = 0; i < leaf_count; ++i)
+    {
+        colors[i] = get_node_color(leaves[i]);
+        if(weights)
+        {
+            weights[i] = total > 0 ? leaves[i]->pixel_count / total : 0;
+        }
+    }
+
+    scratch->used = mark;
+    return leaf_count;
+}
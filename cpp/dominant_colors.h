@@ -0,0 +1,441 @@
+//
+// dominant_colors.h
+//
+// The dominant color engine.  An image is split into a tree of color
+// classes by repeatedly partitioning a class along its principal axis,
+// by default the class with the largest covariance eigenvalue (see
+// t_split_policy).  Each leaf of the tree is one dominant color.
+//
+
+#ifndef DOMINANT_COLORS_H
+#define DOMINANT_COLORS_H
+
+#include <stddef.h>
+#include <vector>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <opencv2/opencv.hpp>
+
+
+//
+// We define a node for the tree that holds the information
+// of each color "class".
+// The node holds an ID, the mean and covariance of each class
+// and the pointers to the left and right nodes.  The covariance
+// is kept row major.  The largest eigenvalue of the covariance and
+// its eigenvector are cached alongside it, with the threshold along the
+// eigenvector at which the class would split.  When the split config needs
+// it the expected drop in squared error from splitting the class, and
+// the bounds of its pixels, are cached too.
+//
+typedef struct t_color_node
+{
+    double      mean[3];
+    double      covariance[9];
+    double      eigenvalue;
+    double      eigenvector[3];
+    double      pixel_count;
+    double      threshold;      // pixels p with eigenvector . p > threshold, p in 0-255, go right
+    double      split_gain;
+    uchar       low[3];
+    uchar       high[3];
+    int         classid;
+
+    t_color_node *left;
+    t_color_node *right;
+} t_color_node;
+
+
+//
+// The class map records the class of every pixel in the image.
+// Rather than spending a whole byte on every pixel, class ids are
+// packed as tightly as the requested color count allows:
+//   2 bits for up to 4 colors, 4 bits for up to 16 colors,
+//   8 bits for up to 256 colors and 16 bits beyond that.
+// Rows of the packed map start at 'data', 'step' bytes apart. For the 2 and 4 bit
+// layouts the first pixel of a byte lives in the low order bits.
+//
+typedef struct t_class_map
+{
+    uchar       *data;      // the first row of the packed map
+    size_t      step;       // bytes from one row to the next
+    int         bits;
+    int         width;
+    int         height;
+    cv::Mat     storage;    // owns 'data' unless the map wraps a caller buffer
+} t_class_map;
+
+
+//
+// A bump allocator over caller provided memory.  Allocations are
+// released all at once by resetting 'used'.
+//
+typedef struct t_arena
+{
+    uchar       *base;
+    size_t      size;
+    size_t      used;
+} t_arena;
+
+
+//
+// Cooperative cancellation.  A token is shared between the caller and a
+// running split; setting 'cancelled', or passing the deadline, stops the
+// split at the next check, which happens between splits and once per
+// band of rows in every pixel pass.  The classes split so far are kept.
+//
+typedef struct t_cancel_token
+{
+    std::atomic<bool>   cancelled;
+    int64_t             deadline;       // steady clock nanoseconds, 0 for none
+} t_cancel_token;
+
+
+inline int64_t get_steady_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+//
+// Reset a token.  With timeout_seconds > 0 it expires that long from now.
+//
+inline void init_cancel_token(t_cancel_token *token, double timeout_seconds)
+{
+    token->cancelled.store(false);
+    token->deadline = timeout_seconds > 0 ? get_steady_ns() + (int64_t)(timeout_seconds * 1e9) : 0;
+}
+
+
+inline bool is_cancelled(const t_cancel_token *token)
+{
+    return token && (token->cancelled.load(std::memory_order_relaxed) ||
+                     (token->deadline && get_steady_ns() >= token->deadline));
+}
+
+
+//
+// A function the splitting thread calls between splits, where the tree
+// is consistent and no pixel pass is running.  A worker pool uses it to
+// run more urgent work on the thread before the split goes on.  The hook
+// is per thread; NULL, the default, for none.
+//
+typedef void (*t_split_boundary_hook)(void *context);
+
+void set_split_boundary_hook(t_split_boundary_hook hook, void *context);
+
+
+typedef enum t_split_status
+{
+    SPLIT_COMPLETE,     // 'count' classes, or the image ran out of colors
+    SPLIT_CANCELLED,    // stopped early by the cancel token
+    SPLIT_TIMED_OUT     // stopped early by the token's deadline
+} t_split_status;
+
+
+//
+// How the next class to split is chosen.  Each policy is evaluated from
+// the statistics cached in the leaves, so choosing costs no pixel pass.
+//   SPLIT_MAX_EIGENVALUE     the largest eigenvalue of the class scatter,
+//                            its spread along the principal axis times its
+//                            size.  The default.
+//   SPLIT_EIGENVALUE_COUNT   the eigenvalue times the pixel count, which
+//                            favors large classes more strongly
+//   SPLIT_MAX_SSE_REDUCTION  the largest drop in squared error the split
+//                            would give, estimated from a coarse color
+//                            histogram gathered in the statistics pass
+//   SPLIT_MAX_COUNT          the class with the most pixels
+// Classes of a single color are never split.
+//
+typedef enum t_split_policy
+{
+    SPLIT_MAX_EIGENVALUE,
+    SPLIT_EIGENVALUE_COUNT,
+    SPLIT_MAX_SSE_REDUCTION,
+    SPLIT_MAX_COUNT
+} t_split_policy;
+
+
+//
+// Automatic color counts.  The requested count becomes the most colors
+// and splitting stops early once a criterion, judged from the moments of
+// the leaves after each split, says the last split wasn't worth keeping:
+//   AUTO_COUNT_ELBOW     the split cut the total squared error by less
+//                        than 'elbow' of the image's total
+//   AUTO_COUNT_BIC       the Bayesian information criterion of the
+//                        classes, as spherical Gaussians with one shared
+//                        variance, got worse.  Neighboring pixels are far
+//                        from independent, and counted one by one any
+//                        split pays for itself, so the criterion treats
+//                        the image as 'bic_samples' independent samples.
+//                        Fewer samples favor fewer colors.
+//   AUTO_COUNT_COVERAGE  the split left a class with less than
+//                        'min_coverage' of the pixels
+// The criterion needs the children's moments, so the last split is
+// made in full and then undone: its partition and statistics passes and
+// one more pass over the class map to relabel its pixels, three pixel
+// passes in all beyond the kept splits.
+//
+typedef enum t_auto_count
+{
+    AUTO_COUNT_NONE,
+    AUTO_COUNT_ELBOW,
+    AUTO_COUNT_BIC,
+    AUTO_COUNT_COVERAGE
+} t_auto_count;
+
+
+//
+// Pixels to leave out of the tree, such as a studio backdrop, so the
+// requested colors go to the subject.  Rules are combined as flags:
+//   EXCLUDE_WHITE    every channel at least 'white_level'
+//   EXCLUDE_BLACK    every channel at most 'black_level'
+//   EXCLUDE_GRAY     channels within 'gray_chroma' of each other
+//   EXCLUDE_BORDER   the region of the image's prevailing border color,
+//                    within 'border_tolerance' per channel, connected to
+//                    the border.  It is found with a scanline fill before
+//                    the first pass, whose histogram and bounded seed stack
+//                    come from the scratch arena.  A backdrop with more
+//                    open runs than the stack holds costs extra passes.
+// The other rules are applied in the first pass.  Excluded pixels are
+// given the class id 'count' and never enter a class, so the class map
+// must hold count + 1 ids; see get_class_map_count.  Weights are then
+// fractions of the pixels kept.
+//
+typedef enum t_exclude_rule
+{
+    EXCLUDE_WHITE   = 1,
+    EXCLUDE_BLACK   = 2,
+    EXCLUDE_GRAY    = 4,
+    EXCLUDE_BORDER  = 8
+} t_exclude_rule;
+
+
+//
+// Per pixel weights, so the palette reflects the subject rather than the
+// whole frame.  Weights of 0-255 are folded into the sums of the
+// statistics pass; pixel counts, and so color weights, become sums of
+// weight over 255.  Pixels of weight 0 still get a class but don't move
+// its statistics.
+//   WEIGHT_CENTER    a Gaussian around the center of the frame, 'center_sigma'
+//                    in units of half the frame
+//   WEIGHT_SALIENCY  spectral residual saliency of a small thumbnail
+//   WEIGHT_MAP       the caller's CV_8UC1 'weight_map'.  It may be smaller
+//                    than the image and is sampled at each pixel's relative
+//                    position.
+// The center and saliency maps are made per image with a small heap
+// allocation.
+//
+typedef enum t_pixel_weighting
+{
+    WEIGHT_NONE,
+    WEIGHT_CENTER,
+    WEIGHT_SALIENCY,
+    WEIGHT_MAP
+} t_pixel_weighting;
+
+
+//
+// With 'optimal_threshold' a class is split where the drop in squared
+// error is largest rather than at its mean.  The cut is chosen from a
+// histogram of the class's projections onto its principal axis, built
+// from the statistics pass's color histogram with no extra pixel pass.
+// A cut that misses every pixel of the class, as a bin wide cut can, is
+// undone and redone at the mean: a relabel pass over the class map and
+// a second partition and statistics pass.
+//
+typedef struct t_split_config
+{
+    t_split_policy  policy;
+    bool            optimal_threshold;
+    t_auto_count    auto_count;
+    double          elbow;          // fraction of the total squared error
+    double          min_coverage;   // fraction of the pixels
+    double          bic_samples;
+    int             exclude;        // t_exclude_rule flags, 0 for none
+    int             white_level;
+    int             black_level;
+    int             gray_chroma;
+    int             border_tolerance;
+    t_pixel_weighting weighting;
+    double          center_sigma;
+    cv::Mat         weight_map;
+} t_split_config;
+
+
+t_split_config get_default_split_config();
+
+//
+// Parse a policy name: eigenvalue, eigenvalue-count, sse or count.
+// Returns false for an unknown name.
+//
+bool parse_split_policy(const char *name, t_split_policy &policy);
+
+//
+// Parse an automatic count criterion: elbow, bic or coverage
+//
+bool parse_auto_count(const char *name, t_auto_count &auto_count);
+
+//
+// Parse a comma separated list of exclusion rules: white, black, gray
+// and border.  Returns false for an unknown rule.
+//
+bool parse_exclude_rules(const char *names, int &exclude);
+
+//
+// Parse a weighting name: none, center or saliency
+//
+bool parse_pixel_weighting(const char *name, t_pixel_weighting &weighting);
+
+
+//
+// Accessors for a single row of a packed class map.  These are
+// templated on the number of bits per pixel so the shifts and
+// masks are resolved at compile time inside the pixel loops.
+//
+template<int BITS>
+inline int get_packed_class(const uchar *row, int x)
+{
+    if(BITS == 16)
+    {
+        return ((const ushort*)row)[x];
+    }
+    if(BITS == 8)
+    {
+        return row[x];
+    }
+
+    const int per_byte = 8 / BITS;
+    const int shift = (x % per_byte) * BITS;
+    return (row[x / per_byte] >> shift) & ((1 << BITS) - 1);
+}
+
+
+template<int BITS>
+inline void set_packed_class(uchar *row, int x, int classid)
+{
+    if(BITS == 16)
+    {
+        ((ushort*)row)[x] = (ushort)classid;
+        return;
+    }
+    if(BITS == 8)
+    {
+        row[x] = (uchar)classid;
+        return;
+    }
+
+    const int per_byte = 8 / BITS;
+    const int shift = (x % per_byte) * BITS;
+    const int mask = ((1 << BITS) - 1) << shift;
+    uchar *byte = &row[x / per_byte];
+    *byte = (uchar)((*byte & ~mask) | ((classid << shift) & mask));
+}
+
+
+//
+// Class map helpers
+//
+int get_class_map_bits(int count);
+int get_class_map_count(int count, const t_split_config *config);
+
+//
+// The largest color count the config allows: 65536, or 65535 when an
+// exclusion rule takes an id of its own in the class map
+//
+int get_max_color_count(const t_split_config *config);
+size_t get_class_map_size(int width, int height, int count);
+t_class_map create_class_map(int width, int height, int count);
+t_class_map wrap_class_map(uchar *buffer, int width, int height, int count);
+
+
+//
+// Scratch arena helpers
+//
+void* arena_alloc(t_arena *arena, size_t size, size_t alignment);
+//
+// With the border rule the scratch also holds the border fill, about
+// 576 KB whatever the image size
+//
+size_t get_scratch_size(int count, const t_split_config *config = NULL);
+
+
+//
+// Tree construction and queries
+//
+void get_symmetric_eigen(const double m[9], double values[3], double vectors[9]);
+bool get_class_mean_cov(cv::Mat img, const t_class_map &classes, t_color_node *node,
+                        const t_cancel_token *cancel = NULL);
+t_color_node* get_max_eigenvalue_node(t_color_node **leaves, int leaf_count);
+double get_split_priority(const t_color_node *node, t_split_policy policy);
+t_color_node* get_split_node(t_color_node **leaves, int leaf_count, t_split_policy policy);
+bool partition_class(cv::Mat img, const t_class_map &classes, int nextid, t_color_node *node,
+                     t_color_node *left, t_color_node *right, const t_cancel_token *cancel = NULL);
+void unpartition_class(const t_class_map &classes, t_color_node *node);
+std::vector<t_color_node*> get_leaves(t_color_node *root);
+cv::Vec3b get_node_color(const t_color_node *node);
+std::vector<cv::Vec3b> get_dominant_colors(t_color_node *root);
+
+
+//
+// Split the image into 'count' classes.  The class of every pixel is
+// written to 'classes' and the root of the resulting tree is returned.
+// The tree is released with free_color_tree.  If the cancel token fires
+// the tree holds the classes split so far and 'status' says why.
+// A NULL config uses get_default_split_config().  With an automatic
+// count 'count' is the most classes and the tree may have fewer.
+// 'count' is capped at get_max_color_count(config).
+//
+t_color_node* build_color_tree(cv::Mat img, int count, t_class_map &classes,
+                               const t_cancel_token *cancel = NULL,
+                               t_split_status *status = NULL,
+                               const t_split_config *config = NULL);
+void free_color_tree(t_color_node *root);
+
+
+//
+// Rendering
+//
+cv::Mat get_quantized_image(const t_class_map &classes, t_color_node *root);
+//
+// The class map in predefined colors.  Pixels of class 'excluded', the
+// id an exclusion rule gives them (the color count), stay black.
+//
+cv::Mat get_viewable_image(const t_class_map &classes, int excluded = -1);
+cv::Mat get_dominant_palette(std::vector<cv::Vec3b> colors);
+
+
+//
+// Returns the 'count' dominant colors of the image.
+//
+std::vector<cv::Vec3b> find_dominant_colors(cv::Mat img, int count);
+
+
+//
+// The allocation free variant of find_dominant_colors for latency
+// sensitive callers.  Every output lives in caller provided memory:
+//   colors, weights  - 'count' entries each, indexed by class id.  The
+//                      weight of a color is the fraction of the pixels
+//                      in its class.  weights may be NULL.
+//   class_map        - at least get_class_map_size(cols, rows,
+//                      get_class_map_count(count, config)) bytes;
+//                      receives the packed class of every pixel.
+//   scratch          - an arena with at least get_scratch_size(count, config)
+//                      bytes free.  Its 'used' mark is restored on return.
+// The image must be CV_8UC3.  Returns the number of colors found, which
+// is less than 'count' if the image has fewer distinct colors or the
+// cancel token fired (see 'status'), or -1 if the arguments or buffers
+// are invalid or 'count' is above get_max_color_count(config).  No heap
+// allocation is made beyond the small weight map of the center and
+// saliency weightings.
+//
+int find_dominant_colors_into(cv::Mat img, int count,
+                              cv::Vec3b *colors, double *weights,
+                              uchar *class_map, size_t class_map_size,
+                              t_arena *scratch, const t_cancel_token *cancel = NULL,
+                              t_split_status *status = NULL,
+                              const t_split_config *config = NULL);
+
+#endif
@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+#include "dominant_colors_c.h"
+#include "dominant_colors.h"
+#include "worker_pool.h"
+
+
+//
+// Wrap a caller's image in a Mat header.  No pixels are copied.
+//
+static bool get_image_mat(const dc_image *image, cv::Mat &mat)
+{
+    if(!image || !image->pixels || image->width <= 0 || image->height <= 0 ||
+       image->stride < (size_t)image->width * 3)
+    {
+        return false;
+    }
+
+    mat = cv::Mat(image->height, image->width, CV_8UC3, (void*)image->pixels, image->stride);
+    return true;
+}
+
+
+int dc_abi_version(void)
+{
+    return DC_ABI_VERSION;
+}
+
+
+size_t dc_class_map_size(int width, int height, int count)
+{
+    if(width <= 0 || height <= 0 || count <= 0)
+    {
+        return 0;
+    }
+    return get_class_map_size(width, height, count);
+}
+
+
+size_t dc_scratch_size(int count)
+{
+    if(count <= 0)
+    {
+        return 0;
+    }
+    return get_scratch_size(count);
+}
+
+
+int dc_find_dominant_colors(const dc_image *image, int count,
+                            unsigned char *colors, double *weights,
+                            unsigned char *class_map, size_t class_map_size,
+                            void *scratch, size_t scratch_size)
+{
+    cv::Mat img;
+    if(!get_image_mat(image, img) || count <= 0 || count > get_max_color_count(NULL) || !colors)
+    {
+        return DC_ERROR_ARGUMENT;
+    }
+
+    if(!class_map || class_map_size < get_class_map_size(image->width, image->height, count) ||
+       !scratch || scratch_size < get_scratch_size(count))
+    {
+        return DC_ERROR_BUFFER;
+    }
+
+    t_arena arena;
+    arena.base = (uchar*)scratch;
+    arena.size = scratch_size;
+    arena.used = 0;
+
+    try
+    {
+        int found = find_dominant_colors_into(img, count, (cv::Vec3b*)colors, weights,
+                                              class_map, class_map_size, &arena);
+        return found > 0 ? found : DC_ERROR_INTERNAL;
+    }
+    catch(...)
+    {
+        return DC_ERROR_INTERNAL;
+    }
+}
+
+
+//
+// Per worker buffers for the batch call.  They grow to the largest
+// image a worker sees and are reused for the rest of its images.
+//
+typedef struct t_batch_buffers
+{
+    std::vector<unsigned char>  class_map;
+    std::vector<unsigned char>  scratch;
+} t_batch_buffers;
+
+
+int dc_find_dominant_colors_batch(const dc_image *images, size_t image_count, int count,
+                                  int threads, unsigned char *colors, double *weights,
+                                  int *found)
+{
+    if((image_count > 0 && !images) || count <= 0 || count > get_max_color_count(NULL) || !colors || !found)
+    {
+        return DC_ERROR_ARGUMENT;
+    }
+
+    try
+    {
+        t_worker_pool pool(threads, true);
+
+        for(size_t i = 0; i < image_count; ++i)
+        {
+            pool.submit([&, i](int)
+            {
+                //
+                // the pool's threads end with the batch, taking
+                // their buffers with them
+                //
+                static thread_local t_batch_buffers buffers;
+                t_batch_buffers *b = &buffers;
+
+                const dc_image *image = &images[i];
+                if(image->width > 0 && image->height > 0)
+                {
+                    try
+                    {
+                        size_t class_map_size = get_class_map_size(image->width, image->height, count);
+                        if(b->class_map.size() < class_map_size)
+                        {
+                            b->class_map.resize(class_map_size);
+                        }
+                        if(b->scratch.size() < get_scratch_size(count))
+                        {
+                            b->scratch.resize(get_scratch_size(count));
+                        }
+                    }
+                    catch(...)
+                    {
+                        found[i] = DC_ERROR_INTERNAL;
+                        return;
+                    }
+                }
+
+                found[i] = dc_find_dominant_colors(image, count,
+                                                   colors + i * count * 3,
+                                                   weights ? weights + i * count : NULL,
+                                                   b->class_map.empty() ? NULL : &b->class_map[0],
+                                                   b->class_map.size(),
+                                                   b->scratch.empty() ? NULL : &b->scratch[0],
+                                                   b->scratch.size());
+            });
+        }
+
+        pool.wait_idle();
+    }
+    catch(...)
+    {
+        return DC_ERROR_INTERNAL;
+    }
+
+    return 0;
+}
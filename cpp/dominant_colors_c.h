@@ -0,0 +1,89 @@
+/*
+ * dominant_colors_c.h
+ *
+ * A stable C ABI over the dominant color engine.  Images are passed as
+ * 8-bit, 3 channel, interleaved pixel buffers and are never copied.  The
+ * engine treats the channels symmetrically, so colors are returned in
+ * the channel order of the input (BGR in, BGR out; RGB in, RGB out).
+ *
+ * Only plain C types cross this interface.  New functionality is added
+ * as new functions; existing signatures don't change within an ABI
+ * version.
+ */
+
+#ifndef DOMINANT_COLORS_C_H
+#define DOMINANT_COLORS_C_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DC_ABI_VERSION          1
+
+/*
+ * Error codes.  Functions that find colors return the number of colors
+ * found (>= 1) on success.
+ */
+#define DC_ERROR_ARGUMENT       -1  /* bad image geometry or count */
+#define DC_ERROR_BUFFER         -2  /* an output or scratch buffer is too small */
+#define DC_ERROR_INTERNAL       -3  /* the engine failed, e.g. out of memory */
+
+
+/*
+ * A view of an image owned by the caller.  'stride' is the number of
+ * bytes from the start of one row to the start of the next; pixels
+ * within a row are 3 bytes apart.
+ */
+typedef struct dc_image
+{
+    const unsigned char    *pixels;
+    int                     width;
+    int                     height;
+    size_t                  stride;
+} dc_image;
+
+
+/*
+ * The ABI version the library was built with.  Compare with DC_ABI_VERSION.
+ */
+int dc_abi_version(void);
+
+/*
+ * Sizes of the caller provided buffers for dc_find_dominant_colors
+ */
+size_t dc_class_map_size(int width, int height, int count);
+size_t dc_scratch_size(int count);
+
+/*
+ * Find up to 'count' dominant colors of one image without allocating.
+ *   colors     - count * 3 bytes, indexed by class id
+ *   weights    - count doubles, the fraction of pixels of each color; may be NULL
+ *   class_map  - dc_class_map_size bytes; receives the packed class of every pixel
+ *   scratch    - dc_scratch_size bytes
+ * Returns the number of colors found or a DC_ERROR code.
+ */
+int dc_find_dominant_colors(const dc_image *image, int count,
+                            unsigned char *colors, double *weights,
+                            unsigned char *class_map, size_t class_map_size,
+                            void *scratch, size_t scratch_size);
+
+/*
+ * Find up to 'count' dominant colors of each of 'image_count' images on
+ * 'threads' worker threads (0 for one per cpu).  Working buffers are
+ * managed internally.  For image i:
+ *   colors[i * count * 3 ...]  the colors
+ *   weights[i * count ...]     their weights; may be NULL
+ *   found[i]                   the number of colors found or a DC_ERROR code
+ * Returns 0, or DC_ERROR_ARGUMENT if the arguments themselves are invalid.
+ */
+int dc_find_dominant_colors_batch(const dc_image *images, size_t image_count, int count,
+                                  int threads, unsigned char *colors, double *weights,
+                                  int *found);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,542 +1,640 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <opencv2/opencv.hpp>
-#include <queue>
+
+#include "dominant_colors.h"
+#include "buffer_allocator.h"
+#include "batch.h"
+#include "async.h"
+#include "color_model.h"
+#include "trace.h"
+#include "perf_counters.h"
+#include "server.h"
 
 using namespace std;
 
 
-//
-// We define a node for the tree that holds the information
-// of each color "class".
-// The node holds an ID, the mean and covariance of each class
-// and the pointers to the left and right nodes.
-//
-typedef struct t_color_node
+void print_usage(const char *name)
 {
-    cv::Mat     mean;
-    cv::Mat     covariance;
-    uchar       classid;
-
-    t_color_node *left;
-    t_color_node *right;
-} t_color_node;
+    printf("Usage: %s [options] <image> <count>\n", name);
+    printf("       %s --batch [options] <image>... <count>\n", name);
+    printf("       %s --model=<file> [--model-name=<name>] <image>\n", name);
+    printf("       %s --serve[=<port>] [--timeout-ms=<n>]\n", name);
+    printf("Options:\n");
+    printf("  --batch                 print the dominant colors of every image, one line per image\n");
+    printf("  --threads=<n>           batch worker threads (default one per cpu)\n");
+    printf("  --no-numa               don't group and pin batch workers per NUMA node\n");
+    printf("  --weights               print the weight of each color as #rrggbb:<weight>\n");
+    printf("  --memory-budget-mb=<n>  in batch and serve mode start an image only once its estimated footprint\n");
+    printf("                          fits n MB next to the images in flight\n");
+    printf("  --no-downsample         with a budget run a JPEG too large for it alone instead of decoding it\n");
+    printf("                          at 1/2, 1/4 or 1/8 scale\n");
+    printf("  --timeout-ms=<n>        stop splitting an image after n ms and keep the colors found so far\n");
+    printf("  --policy=<name>         which class to split next: eigenvalue (default), eigenvalue-count,\n");
+    printf("                          sse or count\n");
+    printf("  --optimal-threshold     split each class where the squared error drops most, not at its mean\n");
+    printf("  --auto=<criterion>      choose the color count, up to <count>: elbow, bic or coverage\n");
+    printf("  --elbow=<f>             with --auto=elbow stop once a split saves less than f of the error (default 0.005)\n");
+    printf("  --bic-samples=<n>       with --auto=bic the independent samples the image counts as (default 100)\n");
+    printf("  --min-coverage=<f>      with --auto=coverage stop before a color covers less than f (default 0.01)\n");
+    printf("  --exclude=<rules>       leave pixels out of the palette, a comma separated list of white, black,\n");
+    printf("                          gray and border (the backdrop connected to the image border)\n");
+    printf("  --weighting=<name>      weigh the pixels toward the subject: center or saliency\n");
+    printf("  --center-sigma=<f>      with --weighting=center the width of the center in half frames (default 0.5)\n");
+    printf("  --weight-map=<image>    weigh the pixels by a grayscale image, scaled to the image\n");
+    printf("  --save-model=<file>     save the color tree as a model for --model, named after the image\n");
+    printf("  --model=<file>          classify the image with a saved model instead of building a tree\n");
+    printf("  --model-name=<name>     the model to use from the file (default the first)\n");
+    printf("  --quantized=<file>      write the image in its dominant colors as a png, - for stdout\n");
+    printf("  --palette=<file>        write the palette as a png, - for stdout\n");
+    printf("  --classification=<file> write the class map as a png, - for stdout\n");
+    printf("                          Without any of these all three go to ./quantized.png, ./palette.png and\n");
+    printf("                          ./classification.png.  The colors are printed to stdout, or to stderr\n");
+    printf("                          when an image goes to stdout.\n");
+    printf("                          An <image> of - is read from stdin.\n");
+    printf("  --serve[=<port>]        serve POST /colors?count=<n> and GET /metrics over HTTP on localhost\n");
+    printf("                          (default port 8077) until SIGINT or SIGTERM\n");
+    printf("  --interactive-weight=<n> in serve mode start n interactive requests per batch request while\n");
+    printf("                          both are queued (default 4)\n");
+    printf("  --trace=<file>          write a Chrome JSON trace of the run, for chrome://tracing or Perfetto\n");
+    printf("  --perf-counters         print cycles, instructions, cache and branch misses per stage to stderr\n");
+    printf("  --no-hugepages          don't advise large buffers for transparent huge pages\n");
+    printf("  --large-buffer-mb=<n>   size in MB from which a buffer counts as large (default 4)\n");
+}
 
 
 //
-// this method searches the tree for the highest classID
-// and returns the max + 1
+// Print the colors as hex RGB, each followed by its weight if
+// 'weights' is given.  Colors are stored in OpenCV's BGR order.
 //
-int get_next_classid(t_color_node *root)
+void print_colors(FILE *out, const std::vector<cv::Vec3b> &colors, const std::vector<double> *weights)
 {
-    int maxid = 0;
-    std::queue<t_color_node*> queue;
-    queue.push(root);
-
-    while(queue.size() > 0)
+    for(size_t i = 0; i < colors.size(); ++i)
     {
-        t_color_node *current = queue.front();
-        queue.pop();
-
-        if(current->classid > maxid)
+        fprintf(out, " #%02x%02x%02x", colors[i][2], colors[i][1], colors[i][0]);
+        if(weights && i < weights->size())
         {
-            maxid = current->classid;
-        }
-
-        if(current->left)
-        {
-            queue.push(current->left);
-        }
-
-        if(current->right)
-        {
-            queue.push(current->right);
+            fprintf(out, ":%.4f", (*weights)[i]);
         }
     }
-
-    return maxid + 1;
 }
 
 
 //
-// This method calculates the mean and covariance for the pixel of the given class
+// Where a single image run writes its pngs.  NULL for an image that
+// isn't wanted, "-" for stdout.
 //
-void get_class_mean_cov(cv::Mat img, cv::Mat classes, t_color_node *node) {
-    const int width = img.cols;
-    const int height = img.rows;
-    const uchar classid = node->classid;
-
-    //
-    // Create a couple of matrices to hold the mean and covariance.
-    //
-    cv::Mat mean = cv::Mat(3, 1, CV_64FC1, cv::Scalar(0));
-    cv::Mat cov  = cv::Mat(3, 3, CV_64FC1, cv::Scalar(0));
+typedef struct t_output_paths
+{
+    const char      *quantized;
+    const char      *palette;
+    const char      *classification;
+} t_output_paths;
 
-    //
-    // Loop through all pixels.
-    //
-    double pixcount = 0;
-    for(int y = 0; y < height; ++y)
-    {
-        cv::Vec3b *ptr = img.ptr<cv::Vec3b>(y);
-        uchar* ptrClass = classes.ptr<uchar>(y);
-        for(int x = 0; x < width; ++x)
-        {
-            //
-            // we ignore pixels that aren't a member of the
-            // current class
-            //
-            if(ptrClass[x] != classid)
-            {
-                continue;
-            }
-            cv::Vec3b color = ptr[x];
-
-            //
-            // create a 3x1 matrix to hold the color.  We normalize
-            // the color values to between 0 and 1 to avoid overflows
-            // as we sum all the color values for calculating mean.
-            //
-            cv::Mat scaled = cv::Mat(3, 1, CV_64FC1, cv::Scalar(0));
-            scaled.at<double>(0) = color[0]/255.0f;
-            scaled.at<double>(1) = color[1]/255.0f;
-            scaled.at<double>(2) = color[2]/255.0f;
-
-            mean = mean + scaled;
-            cov  = cov + (scaled * scaled.t());
-            pixcount++;
-        }
-    }
 
-    //
-    // complete the covariance
-    //
-    cov = cov - (mean * mean.t()) / pixcount;
+//
+// The fixed names in the current directory, used when no output is named
+//
+t_output_paths get_default_output_paths()
+{
+    t_output_paths paths;
+    paths.quantized = "./quantized.png";
+    paths.palette = "./palette.png";
+    paths.classification = "./classification.png";
+    return paths;
+}
 
-    //
-    // up until now mean has actually been a summation
-    // dividing by the pixel count makes it a mean
-    //
-    mean = mean / pixcount;
 
-    //
-    // assign the values to the node
-    //
-    node->mean = mean.clone();
-    node->covariance = cov.clone();
-    return;
+bool is_stdout(const char *path)
+{
+    return path && strcmp(path, "-") == 0;
 }
 
 
 //
-// Walk the tree and return the node with
-// the highest covariance eigenvalue
+// Where the colors and messages go: stdout, unless an image is
+// streamed there
 //
-t_color_node* get_max_eigenvalue_node(t_color_node *current) {
-    double max_eigen = -1;
+FILE* get_text_stream(const t_output_paths &outputs)
+{
+    return is_stdout(outputs.quantized) || is_stdout(outputs.palette) ||
+           is_stdout(outputs.classification) ? stderr : stdout;
+}
 
-    //
-    // a couple of matrices to hold the max eigen
-    //
-    cv::Mat eigenvalues, eigenvectors;
 
-    //
-    // Handle the case where the given node is the
-    // whole tree. (a tree with 1 node)
-    //
-    t_color_node *ret = current;
-    if(!current->left && !current->right)
+//
+// Decode a file, or the encoded image on stdin for "-"
+//
+cv::Mat read_input_image(const char *filename)
+{
+    t_trace_span span("decode");
+    t_perf_scope counters(PERF_DECODE);
+    if(strcmp(filename, "-") != 0)
     {
-        return current;
+        return cv::imread(filename);
     }
 
-    //
-    // push the node to start the search
-    //
-    std::queue<t_color_node*> queue;
-    queue.push(current);
-
-    while(queue.size() > 0)
+    std::vector<uchar> encoded;
+    uchar buffer[65536];
+    size_t n;
+    while((n = fread(buffer, 1, sizeof(buffer), stdin)) > 0)
     {
-        //
-        // Pop a node off the queue
-        //
-        t_color_node *node = queue.front();
-        queue.pop();
-
-        //
-        // if it has children push those on and continue.
-        // we are only concerned with the leaf nodes.
-        //
-        if(node->left && node->right)
-        {
-            queue.push(node->left);
-            queue.push(node->right);
-            continue;
-        }
-
-        //
-        // otherwise, we must be a leaf node.  Note that partitioning always
-        // creates both left and right children.  We don't have the case where
-        // a node has only 1 child.  Now calculate the eigenvalues of the covariance
-        // matrix and pick the max.  cv::eigen will return eigenvalues in
-        // descending order. To pick the highest value we choose the value at index 0.
-        //
-        cv::eigen(node->covariance, eigenvalues, eigenvectors);
-        double val = eigenvalues.at<double>(0);
-        if(val > max_eigen)
-        {
-            max_eigen = val;
-            ret = node;
-        }
+        encoded.insert(encoded.end(), buffer, buffer + n);
     }
-
-    return ret;
+    return encoded.empty() ? cv::Mat() : cv::imdecode(encoded, cv::IMREAD_COLOR);
 }
 
 
-//
-// This method walks the tree and returns a vector of
-// the leaf nodes. Each leaf node represents a dominant
-// color in the image.
-//
-std::vector<t_color_node*> get_leaves(t_color_node *root)
+bool write_output_image(const char *path, const cv::Mat &image)
 {
-    //
-    // our return vector of leaf nodes
-    //
-    std::vector<t_color_node*> leaf_nodes;
-
-    //
-    // maintain a queue of nodes.  We will
-    // walk the tree and only add nodes
-    // if they don't have children.
-    //
-    std::queue<t_color_node*> queue;
-    queue.push(root);
-
-    while(queue.size() > 0)
+    if(!path)
     {
-        t_color_node *current = queue.front();
-        queue.pop();
-
-        if(current->left && current->right)
-        {
-            queue.push(current->left);
-            queue.push(current->right);
-            continue;
-        }
-
-        //
-        // No Children.  push onto our return list.
-        //
-        leaf_nodes.push_back(current);
+        return true;
+    }
+    if(!is_stdout(path))
+    {
+        return cv::imwrite(path, image);
     }
 
-    return leaf_nodes;
+    std::vector<uchar> encoded;
+    if(!cv::imencode(".png", image, encoded))
+    {
+        return false;
+    }
+    return fwrite(&encoded[0], 1, encoded.size(), stdout) == encoded.size() && fflush(stdout) == 0;
 }
 
 
-std::vector<cv::Vec3b> get_dominant_colors(t_color_node *root)
+//
+// Encode the wanted images.  Returns false if one can't be written.
+//
+bool write_output_images(const t_output_paths &outputs, const cv::Mat &quantized,
+                         const cv::Mat &dom, const cv::Mat &viewable)
 {
-    std::vector<t_color_node*> leaves = get_leaves(root);
-    std::vector<cv::Vec3b> ret;
-
-    for(int i = 0; i < leaves.size(); ++i)
+    t_trace_span span("encode");
+    t_perf_scope counters(PERF_ENCODE);
+    const char *paths[3] = { outputs.quantized, outputs.palette, outputs.classification };
+    const cv::Mat *images[3] = { &quantized, &dom, &viewable };
+    bool ok = true;
+    for(int i = 0; i < 3; ++i)
     {
-        cv::Mat mean = leaves[i]->mean;
-        ret.push_back(cv::Vec3b(mean.at<double>(0) * 255.0f,
-                                mean.at<double>(1) * 255.0f,
-                                mean.at<double>(2) * 255.0f));
+        if(!write_output_image(paths[i], *images[i]))
+        {
+            fprintf(stderr, "Unable to write the image: %s\n", is_stdout(paths[i]) ? "stdout" : paths[i]);
+            ok = false;
+        }
     }
-
-    return ret;
+    return ok;
 }
 
 
-cv::Mat get_quantized_image(cv::Mat classes, t_color_node *root)
+//
+// Find the dominant colors of every image on the cmd line.  One line per
+// image goes to stdout as each image completes, the per NUMA node
+// throughput report goes to stderr at the end.
+//
+int run_batch_command(const std::vector<char*> &args, int count, t_batch_config config, bool weights)
 {
-    std::vector<t_color_node*> leaves = get_leaves(root);
-
-    const int height = classes.rows;
-    const int width = classes.cols;
-    cv::Mat ret(height, width, CV_8UC3, cv::Scalar(0));
+    std::vector<std::string> paths(args.begin(), args.end() - 1);
+    config.count = count;
 
-    for(int y=0; y<height; ++y)
-    {
-        uchar *ptrClass = classes.ptr<uchar>(y);
-
-        cv::Vec3b *ptr = ret.ptr<cv::Vec3b>(y);
-
-        for(int x=0; x < width; ++x)
+    int failures = 0;
+    double wall_seconds = 0;
+    std::vector<t_batch_node_report> report = run_batch(paths, config,
+        [&](const t_batch_result &result)
         {
-            uchar pixel_class = ptrClass[x];
-            for(int i=0; i < leaves.size(); ++i)
+            if(!result.ok)
             {
-                if(leaves[i]->classid == pixel_class)
-                {
-                    ptr[x] = cv::Vec3b(leaves[i]->mean.at<double>(0)*255,
-                                       leaves[i]->mean.at<double>(1)*255,
-                                       leaves[i]->mean.at<double>(2)*255);
-                }
+                fprintf(stderr, "Unable to open the file: %s\n", result.path.c_str());
+                failures++;
+                return;
             }
-        }
-    }
-
-    return ret;
-}
 
-
-cv::Mat get_viewable_image(cv::Mat classes) {
-    const int height = classes.rows;
-    const int width = classes.cols;
-
-    const int max_color_count = 18;
-    cv::Vec3b *palette = new cv::Vec3b[max_color_count];
-    palette[0]  = cv::Vec3b(  0,   0,   0);
-    palette[1]  = cv::Vec3b(255,   0,   0);
-    palette[2]  = cv::Vec3b(  0, 255,   0);
-    palette[3]  = cv::Vec3b(  0,   0, 255);
-    palette[4]  = cv::Vec3b(255, 255,   0);
-    palette[5]  = cv::Vec3b(  0, 255, 255);
-    palette[6]  = cv::Vec3b(255,   0, 255);
-    palette[7]  = cv::Vec3b(128, 128, 128);
-    palette[8]  = cv::Vec3b(128, 255, 128);
-    palette[9]  = cv::Vec3b( 32,  32,  32);
-    palette[10] = cv::Vec3b(255, 128, 128);
-    palette[11] = cv::Vec3b(128, 128, 255);
-    palette[12] = cv::Vec3b(255, 255, 255);
-    palette[13] = cv::Vec3b( 32, 128, 128);
-    palette[14] = cv::Vec3b(128,  32, 128);
-    palette[15] = cv::Vec3b(128, 128,  32);
-    palette[16] = cv::Vec3b(128,  32,  32);
-    palette[17] = cv::Vec3b( 32, 128,  32);
-
-    cv::Mat ret = cv::Mat(height, width, CV_8UC3, cv::Scalar(0, 0, 0));
-
-    for(int y = 0; y < height; ++y)
-    {
-        cv::Vec3b *ptr = ret.ptr<cv::Vec3b>(y);
-        uchar *ptrClass = classes.ptr<uchar>(y);
-        for(int x = 0; x < width; ++x)
-        {
-            int color = ptrClass[x];
-            if(color >= max_color_count)
+            if(result.status == SPLIT_TIMED_OUT)
+            {
+                fprintf(stderr, "Timed out with %zu colors: %s\n", result.colors.size(), result.path.c_str());
+            }
+            if(result.scale > 1)
             {
-                printf("You should increase the number of predefined colors!\n");
-                continue;
+                fprintf(stderr, "Decoded at 1/%d to fit the memory budget: %s\n", result.scale, result.path.c_str());
             }
 
-            ptr[x] = palette[color];
-        }
-    }
+            printf("%s", result.path.c_str());
+            print_colors(stdout, result.colors, weights ? &result.weights : NULL);
+            printf("\n");
+        },
+        &wall_seconds);
 
-    return ret;
+    print_batch_report(stderr, report, wall_seconds);
+    return failures > 0 ? 1 : 0;
 }
 
 
-
-cv::Mat get_dominant_palette(std::vector<cv::Vec3b> colors)
+//
+// Classify an image with a saved model and write the same outputs as a
+// normal run.  The model's tree is used as is; nothing is split.
+//
+int run_model_command(const char *filename, const char *model_path, const char *model_name,
+                      const t_output_paths &outputs)
 {
-    const int tile_size = 64;
-    cv::Mat ret = cv::Mat(tile_size, tile_size*colors.size(), CV_8UC3, cv::Scalar(0));
-    for(int i = 0; i < colors.size(); ++i)
+    FILE *text = get_text_stream(outputs);
+    t_model_file file;
+    if(!open_model_file(model_path, file))
     {
-        cv::Rect rect(i*tile_size, 0, tile_size, tile_size);
-        cv::rectangle(ret, rect, cv::Scalar(colors[i][0], colors[i][1], colors[i][2]), CV_FILLED);
+        fprintf(text, "Unable to open the model file: %s\n", model_path);
+        return 1;
     }
 
-    return ret;
+    const t_color_model *model = model_name ? find_color_model(file, model_name) : &file.models[0];
+    if(!model)
+    {
+        fprintf(text, "No model named %s in %s\n", model_name, model_path);
+        close_model_file(file);
+        return 1;
+    }
+
+    cv::Mat matImage = read_input_image(filename);
+    if(!matImage.data)
+    {
+        fprintf(text, "Unable to open the file: %s\n", filename);
+        close_model_file(file);
+        return 1;
+    }
+
+    std::vector<cv::Vec3b> colors = get_model_colors(*model);
+    t_class_map classes = classify_image(*model, matImage);
+    cv::Mat quantized = outputs.quantized ? remap_image(*model, matImage) : cv::Mat();
+    cv::Mat viewable = outputs.classification ? get_viewable_image(classes) : cv::Mat();
+    cv::Mat dom = outputs.palette ? get_dominant_palette(colors) : cv::Mat();
+
+    const bool written = write_output_images(outputs, quantized, dom, viewable);
+    print_colors(text, colors, NULL);
+    fprintf(text, "\n");
+
+    close_model_file(file);
+    return written ? 0 : 1;
 }
 
 
 //
-// this method takes a class represented by a cv::Mat and splits it into two
+// Split the image on the cmd line, or every image in batch mode.  The
+// color count is always the last arg.
 //
-void partition_class(cv::Mat img, cv::Mat classes, uchar nextid, t_color_node *node)
+int run_split_command(const std::vector<char*> &args, const t_batch_config &batch_config, bool weights,
+                      bool batch, const char *save_model, const t_output_paths &outputs)
 {
-    const int width = img.cols;
-    const int height = img.rows;
-    const int classid = node->classid;
-
     //
-    // the new ids for each new node.
+    // get the number of colors from the cmd line.  Messages go to
+    // stderr when an image is streamed to stdout.
     //
-    const uchar newidleft = nextid;
-    const uchar newidright = nextid + 1;
+    FILE *text = get_text_stream(outputs);
+    int count = atoi(args.back());
+    const int max_count = get_max_color_count(&batch_config.split);
+    if(count <=0 || count >max_count)
+    {
+        fprintf(text, "The color count needs to be between 1-%d. You picked: %d\n", max_count, count);
+        return 2;
+    }
 
-    //
-    // we use the class's mean and covariance
-    // come up with a comparison_value for splitting.
-    //
-    cv::Mat mean = node->mean;
-    cv::Mat cov = node->covariance;
-    cv::Mat eigenvalues, eigenvectors;
-    cv::eigen(cov, eigenvalues, eigenvectors);
-    cv::Mat eig = eigenvectors.row(0);
-    cv::Mat comparison_value = eig * mean;
+    if(batch)
+    {
+        return run_batch_command(args, count, batch_config, weights);
+    }
 
     //
-    // Setup our new class nodes
+    // the timeout starts before the image is read, as in batch mode
     //
-    node->left = new t_color_node();
-    node->right = new t_color_node();
-    node->left->classid = newidleft;
-    node->right->classid = newidright;
+    t_cancel_token token;
+    init_cancel_token(&token, batch_config.timeout);
 
     //
-    // Loop through all pixels in the class
-    // and split on the comparison value
+    // read the file, or stdin, into an opencv matrix
     //
-    for(int y = 0; y < height; ++y)
-    {
-        cv::Vec3b *ptr = img.ptr<cv::Vec3b>(y);
-        uchar *ptrClass = classes.ptr<uchar>(y);
-        for(int x = 0; x < width; ++x)
-        {
-            //
-            // disregard pixels that do not belong to class
-            // we are splitting
-            //
-            if(ptrClass[x] != classid)
-            {
-                continue;
-            }
-
-            cv::Vec3b color = ptr[x];
-            cv::Mat scaled = cv::Mat(3, 1, CV_64FC1, cv::Scalar(0));
-            scaled.at<double>(0) = color[0]/255.0f;
-            scaled.at<double>(1) = color[1]/255.0f;
-            scaled.at<double>(2) = color[2]/255.0f;
+    char* filename = args[0];
+    cv::Mat matImage = read_input_image(filename);
 
-            cv::Mat this_value = eig*scaled;
-            if(this_value.at<double>(0, 0) <= comparison_value.at<double>(0, 0))
-            {
-                ptrClass[x] = newidleft;
-            }
-            else
-            {
-                ptrClass[x] = newidright;
-            }
-        }
+    if(!matImage.data)
+    {
+        fprintf(text, "Unable to open the file: %s\n", filename);
+        return 1;
     }
-    return;
-}
-
-
-
-//
-// This method determines the dominant colors in the given image.
-// Returns an array of UIColors representing the 'count' dominant colors
-//
-std::vector<cv::Vec3b> find_dominant_colors(cv::Mat img, int count)
-{
-    //
-    // we will be bucketing each pixel into one of 'count' Classes.
-    // we create a Mat to represent the class of each pixel.
-    // each pixel starts out with a class of 1
-    const int width  = img.cols;
-    const int height = img.rows;
-    cv::Mat classes = cv::Mat(height, width, CV_8UC1, cv::Scalar(1));
 
     //
-    // We will maintain a tree of classes.  Every pixel in the
-    // image will be eventually mapped to one of the classes.
-    // Here we create the inital tree - a tree of one node
-    // with a class id of 1
+    // find the dominant colors in the image.
     //
-    t_color_node *root = new t_color_node();
-    root->classid = 1;
-    root->left = NULL;
-    root->right = NULL;
+    t_class_map classes;
+    t_split_status status;
+    t_color_node *root = build_color_tree(matImage, count, classes, &token, &status, &batch_config.split);
+    std::vector<cv::Vec3b> colors = get_dominant_colors(root);
 
-    //
-    // Initialize our working pointer to the root node.
-    //
-    t_color_node *next = root;
+    if(status == SPLIT_TIMED_OUT)
+    {
+        fprintf(text, "Timed out with %zu colors\n", colors.size());
+    }
 
     //
-    // Calculate the initial mean and covariance
+    // output the classification, the quantized image and the color palette
+    // as pngs.  Only the wanted ones are rendered.
     //
-    get_class_mean_cov(img, classes, root);
+    cv::Mat quantized = outputs.quantized ? get_quantized_image(classes, root) : cv::Mat();
+    const int excluded = batch_config.split.exclude ? count : -1;
+    cv::Mat viewable = outputs.classification ? get_viewable_image(classes, excluded) : cv::Mat();
+    cv::Mat dom = outputs.palette ? get_dominant_palette(colors) : cv::Mat();
 
+    const bool written = write_output_images(outputs, quantized, dom, viewable);
 
-    //
-    // Keep splitting until we get to 'count' number of classes
-    //
-    for(int i = 0; i < count-1; ++i)
+    std::vector<t_color_node*> leaves = get_leaves(root);
+    std::vector<double> color_weights;
+    for(size_t i = 0; i < leaves.size(); ++i)
     {
-        //
-        // find the leaf node with the largest eigenvalue
-        //
-        next = get_max_eigenvalue_node(root);
-
-        //
-        // partition on that node.
-        //
-        partition_class(img, classes, get_next_classid(root), next);
-
-        //
-        // now recalculate the mean and covariance for the new classes
-        // in each side of the tree
-        //
-        get_class_mean_cov(img, classes, next->left);
-        get_class_mean_cov(img, classes, next->right);
+        if(leaves[i]->pixel_count > 0)
+        {
+            color_weights.push_back(leaves[i]->pixel_count / root->pixel_count);
+        }
     }
+    print_colors(text, colors, weights ? &color_weights : NULL);
+    fprintf(text, "\n");
 
-    std::vector<cv::Vec3b> colors = get_dominant_colors(root);
-
-    cv::Mat quantized = get_quantized_image(classes, root);
-    cv::Mat viewable = get_viewable_image(classes);
-    cv::Mat dom = get_dominant_palette(colors);
-
-    cv::imwrite("./classification.png", viewable);
-    cv::imwrite("./quantized.png", quantized);
-    cv::imwrite("./palette.png", dom);
+    if(save_model)
+    {
+        std::vector<std::vector<uchar> > models(1, serialize_color_model(root, strcmp(filename, "-") == 0 ? "stdin" : filename));
+        if(!write_model_file(save_model, models))
+        {
+            fprintf(text, "Unable to write the model file: %s\n", save_model);
+        }
+    }
 
-    return colors;
+    free_color_tree(root);
+    return written ? 0 : 1;
 }
 
 
-
 int main(int argc, char* argv[])
 {
     //
-    // Check cmd line args
-    //
-    if(argc<3)
+    // Split the cmd line into options and positional args
+    //
+    t_buffer_config buffer_config = get_default_buffer_config();
+    t_batch_config batch_config;
+    batch_config.threads = 0;
+    batch_config.numa = true;
+    batch_config.timeout = 0;
+    batch_config.memory_budget = 0;
+    batch_config.downsample = true;
+    batch_config.split = get_default_split_config();
+    bool batch = false;
+    bool weights = false;
+    const char *save_model = NULL;
+    const char *model = NULL;
+    const char *model_name = NULL;
+    const char *trace = NULL;
+    bool perf_counters = false;
+    bool serve = false;
+    t_server_config server_config = get_default_server_config();
+    int interactive_weight = 4;
+    t_output_paths outputs;
+    memset(&outputs, 0, sizeof(outputs));
+
+    std::vector<char*> args;
+    for(int i = 1; i < argc; ++i)
     {
-        printf("Usage: %s <image> <count>\n", argv[0]);
-        return 0;
+        if(strcmp(argv[i], "--batch") == 0)
+        {
+            batch = true;
+        }
+        else if(strncmp(argv[i], "--threads=", 10) == 0)
+        {
+            batch_config.threads = atoi(argv[i] + 10);
+        }
+        else if(strcmp(argv[i], "--no-numa") == 0)
+        {
+            batch_config.numa = false;
+        }
+        else if(strcmp(argv[i], "--weights") == 0)
+        {
+            weights = true;
+        }
+        else if(strncmp(argv[i], "--timeout-ms=", 13) == 0)
+        {
+            batch_config.timeout = atoi(argv[i] + 13) / 1000.0;
+        }
+        else if(strncmp(argv[i], "--memory-budget-mb=", 19) == 0)
+        {
+            batch_config.memory_budget = (size_t)atoi(argv[i] + 19) * 1024 * 1024;
+        }
+        else if(strcmp(argv[i], "--no-downsample") == 0)
+        {
+            batch_config.downsample = false;
+        }
+        else if(strncmp(argv[i], "--policy=", 9) == 0)
+        {
+            if(!parse_split_policy(argv[i] + 9, batch_config.split.policy))
+            {
+                printf("Unknown split policy: %s\n", argv[i] + 9);
+                print_usage(argv[0]);
+                return 3;
+            }
+        }
+        else if(strcmp(argv[i], "--optimal-threshold") == 0)
+        {
+            batch_config.split.optimal_threshold = true;
+        }
+        else if(strncmp(argv[i], "--auto=", 7) == 0)
+        {
+            if(!parse_auto_count(argv[i] + 7, batch_config.split.auto_count))
+            {
+                printf("Unknown automatic count: %s\n", argv[i] + 7);
+                print_usage(argv[0]);
+                return 3;
+            }
+        }
+        else if(strncmp(argv[i], "--elbow=", 8) == 0)
+        {
+            batch_config.split.elbow = atof(argv[i] + 8);
+        }
+        else if(strncmp(argv[i], "--bic-samples=", 14) == 0)
+        {
+            batch_config.split.bic_samples = atof(argv[i] + 14);
+        }
+        else if(strncmp(argv[i], "--min-coverage=", 15) == 0)
+        {
+            batch_config.split.min_coverage = atof(argv[i] + 15);
+        }
+        else if(strncmp(argv[i], "--exclude=", 10) == 0)
+        {
+            if(!parse_exclude_rules(argv[i] + 10, batch_config.split.exclude))
+            {
+                printf("Unknown exclusion rule in: %s\n", argv[i] + 10);
+                print_usage(argv[0]);
+                return 3;
+            }
+        }
+        else if(strncmp(argv[i], "--weighting=", 12) == 0)
+        {
+            if(!parse_pixel_weighting(argv[i] + 12, batch_config.split.weighting))
+            {
+                printf("Unknown weighting: %s\n", argv[i] + 12);
+                print_usage(argv[0]);
+                return 3;
+            }
+        }
+        else if(strncmp(argv[i], "--center-sigma=", 15) == 0)
+        {
+            batch_config.split.center_sigma = atof(argv[i] + 15);
+        }
+        else if(strncmp(argv[i], "--weight-map=", 13) == 0)
+        {
+            batch_config.split.weight_map = cv::imread(argv[i] + 13, cv::IMREAD_GRAYSCALE);
+            if(batch_config.split.weight_map.empty())
+            {
+                printf("Unable to open the weight map: %s\n", argv[i] + 13);
+                return 1;
+            }
+            batch_config.split.weighting = WEIGHT_MAP;
+        }
+        else if(strncmp(argv[i], "--save-model=", 13) == 0)
+        {
+            save_model = argv[i] + 13;
+        }
+        else if(strncmp(argv[i], "--model=", 8) == 0)
+        {
+            model = argv[i] + 8;
+        }
+        else if(strncmp(argv[i], "--model-name=", 13) == 0)
+        {
+            model_name = argv[i] + 13;
+        }
+        else if(strcmp(argv[i], "--serve") == 0)
+        {
+            serve = true;
+        }
+        else if(strncmp(argv[i], "--serve=", 8) == 0)
+        {
+            serve = true;
+            server_config.port = atoi(argv[i] + 8);
+        }
+        else if(strncmp(argv[i], "--quantized=", 12) == 0)
+        {
+            outputs.quantized = argv[i] + 12;
+        }
+        else if(strncmp(argv[i], "--palette=", 10) == 0)
+        {
+            outputs.palette = argv[i] + 10;
+        }
+        else if(strncmp(argv[i], "--classification=", 17) == 0)
+        {
+            outputs.classification = argv[i] + 17;
+        }
+        else if(strncmp(argv[i], "--interactive-weight=", 21) == 0)
+        {
+            interactive_weight = atoi(argv[i] + 21);
+        }
+        else if(strncmp(argv[i], "--trace=", 8) == 0)
+        {
+            trace = argv[i] + 8;
+        }
+        else if(strcmp(argv[i], "--perf-counters") == 0)
+        {
+            perf_counters = true;
+        }
+        else if(strcmp(argv[i], "--no-hugepages") == 0)
+        {
+            buffer_config.huge_pages = false;
+        }
+        else if(strncmp(argv[i], "--large-buffer-mb=", 18) == 0)
+        {
+            buffer_config.large_threshold = (size_t)atoi(argv[i] + 18) * 1024 * 1024;
+        }
+        else if(strncmp(argv[i], "--", 2) == 0)
+        {
+            printf("Unknown option: %s\n", argv[i]);
+            print_usage(argv[0]);
+            return 3;
+        }
+        else
+        {
+            args.push_back(argv[i]);
+        }
     }
 
     //
-    // read the file into an opencv matrix
+    // Check cmd line args.  A model brings its own colors, so needs no count.
     //
-    char* filename = argv[1];
-    cv::Mat matImage = cv::imread(filename);
-
-    if(!matImage.data)
+    if(!serve && args.size() < (model ? 1u : 2u))
     {
-        printf("Unable to open the file: %s\n", filename);
-        return 1;
+        print_usage(argv[0]);
+        return 0;
     }
 
     //
-    // get the number of colors from the cmd line
+    // Without a named output the pngs go to their fixed names.  Only
+    // one of them can be streamed to stdout.
     //
-    int count = atoi(argv[2]);
-    if(count <=0 || count >255)
+    if(!outputs.quantized && !outputs.palette && !outputs.classification)
     {
-        printf("The color count needs to be between 1-255. You picked: %d\n", count);
-        return 2;
+        outputs = get_default_output_paths();
+    }
+    if(is_stdout(outputs.quantized) + is_stdout(outputs.palette) + is_stdout(outputs.classification) > 1)
+    {
+        fprintf(stderr, "Only one image can be written to stdout\n");
+        return 3;
     }
 
     //
-    // find the dominant colors in the image.  This will output
-    // the quantized image and color palette as pngs
+    // Large buffers, including the decoded image, come from
+    // the aligned, huge page advised buffer allocator.
     //
-    find_dominant_colors(matImage, count);
+    set_buffer_config(buffer_config);
+    install_buffer_allocator();
+
+    if(trace)
+    {
+        start_trace();
+    }
+
+    const char *reason = NULL;
+    if(perf_counters && !start_perf_counters(&reason))
+    {
+        fprintf(stderr, "Hardware counters unavailable: %s\n", reason);
+        perf_counters = false;
+    }
 
-    return 0;
+    int ret;
+    if(serve)
+    {
+        server_config.timeout = batch_config.timeout;
+        set_library_memory_budget(batch_config.memory_budget, batch_config.downsample);
+        get_library_pool().set_priority_weight(PRIORITY_INTERACTIVE, interactive_weight);
+        fprintf(stderr, "Serving on http://127.0.0.1:%d\n", server_config.port);
+        ret = run_server(server_config) ? 0 : 1;
+        if(ret)
+        {
+            fprintf(stderr, "Unable to listen on port %d\n", server_config.port);
+        }
+    }
+    else if(model)
+    {
+        ret = run_model_command(args[0], model, model_name, outputs);
+    }
+    else
+    {
+        ret = run_split_command(args, batch_config, weights, batch, save_model, outputs);
+    }
 
+    if(perf_counters)
+    {
+        stop_perf_counters();
+        print_perf_report(stderr);
+    }
+
+    if(trace)
+    {
+        stop_trace();
+        if(!write_trace(trace))
+        {
+            fprintf(stderr, "Unable to write the trace: %s\n", trace);
+        }
+    }
+    return ret;
 }
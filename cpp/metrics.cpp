@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <mutex>
+#include <vector>
+
+#include "metrics.h"
+
+
+std::atomic<bool> g_collecting_metrics(false);
+
+//
+// Upper bounds of the latency buckets in seconds, from a small
+// image's split to a 100MP image's whole request.  A last bucket
+// past the end counts the rest (+Inf).
+//
+static const double bucket_bounds[] =
+{
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+    0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30
+};
+static const int bucket_count = sizeof(bucket_bounds) / sizeof(bucket_bounds[0]) + 1;
+
+static const char *stage_names[STAGE_COUNT] =
+{
+    "queue_wait", "admission", "decode", "root_stats", "split", "request"
+};
+
+
+typedef struct t_metrics_slot
+{
+    std::atomic<uint64_t>   counters[METRIC_COUNTER_COUNT];
+    std::atomic<uint64_t>   buckets[STAGE_COUNT][bucket_count];
+    std::atomic<uint64_t>   sum_ns[STAGE_COUNT];
+} t_metrics_slot;
+
+
+//
+// Every slot ever handed out, and those whose thread has exited
+//
+static std::mutex g_slots_mutex;
+static std::vector<t_metrics_slot*> g_slots;
+static std::vector<t_metrics_slot*> g_free_slots;
+
+
+//
+// The calling thread's slot, taken on its first update and
+// given back for reuse when the thread exits
+//
+typedef struct t_slot_owner
+{
+    t_metrics_slot      *slot;
+
+    t_slot_owner() : slot(NULL)
+    {
+    }
+
+    ~t_slot_owner()
+    {
+        if(slot)
+        {
+            std::lock_guard<std::mutex> lock(g_slots_mutex);
+            g_free_slots.push_back(slot);
+        }
+    }
+} t_slot_owner;
+
+static thread_local t_slot_owner g_slot_owner;
+
+
+static t_metrics_slot& get_thread_slot()
+{
+    if(!g_slot_owner.slot)
+    {
+        std::lock_guard<std::mutex> lock(g_slots_mutex);
+        if(g_free_slots.size() > 0)
+        {
+            g_slot_owner.slot = g_free_slots.back();
+            g_free_slots.pop_back();
+        }
+        else
+        {
+            //
+            // value initialized, so every count starts at 0
+            //
+            g_slot_owner.slot = new t_metrics_slot();
+            g_slots.push_back(g_slot_owner.slot);
+        }
+    }
+    return *g_slot_owner.slot;
+}
+
+
+//
+// Only the owning thread writes a slot, so a load and a
+// store are enough; a scrape may read the old or new value.
+//
+static inline void add_to_slot(std::atomic<uint64_t> &value, uint64_t n)
+{
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+
+void start_metrics()
+{
+    g_collecting_metrics.store(true);
+}
+
+
+void count_metric(t_metric_counter counter, uint64_t n)
+{
+    if(is_collecting_metrics())
+    {
+        add_to_slot(get_thread_slot().counters[counter], n);
+    }
+}
+
+
+void observe_stage(t_metric_stage stage, double seconds)
+{
+    if(!is_collecting_metrics())
+    {
+        return;
+    }
+
+    int bucket = 0;
+    while(bucket < bucket_count - 1 && seconds > bucket_bounds[bucket])
+    {
+        bucket++;
+    }
+
+    t_metrics_slot &slot = get_thread_slot();
+    add_to_slot(slot.buckets[stage][bucket], 1);
+    add_to_slot(slot.sum_ns[stage], seconds > 0 ? (uint64_t)(seconds * 1e9) : 0);
+}
+
+
+//
+// Read a 'kB' field of /proc/self/status in bytes, or a plain
+// count such as Threads.  Returns -1 if it isn't there.
+//
+static double read_process_status(const char *field)
+{
+    FILE *f = fopen("/proc/self/status", "r");
+    if(!f)
+    {
+        return -1;
+    }
+
+    double value = -1;
+    char line[256];
+    const size_t length = strlen(field);
+    while(fgets(line, sizeof(line), f))
+    {
+        if(strncmp(line, field, length) == 0 && line[length] == ':')
+        {
+            value = atof(line + length + 1);
+            if(strstr(line, "kB"))
+            {
+                value *= 1024;
+            }
+            break;
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+
+void append_metric(std::string &out, const char *format, ...)
+{
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    out += line;
+}
+
+
+void append_metric_gauge(std::string &out, const char *name, const char *help, double value)
+{
+    if(value < 0)
+    {
+        return;
+    }
+    append_metric(out, "# HELP %s %s\n# TYPE %s gauge\n%s %.17g\n", name, help, name, name, value);
+}
+
+
+void write_metrics(std::string &out, t_metrics_writer writer)
+{
+    //
+    // sum the slots.  A slot may be mid update, which at worst
+    // leaves one observation out of this scrape.
+    //
+    uint64_t counters[METRIC_COUNTER_COUNT] = {0};
+    uint64_t buckets[STAGE_COUNT][bucket_count] = {{0}};
+    uint64_t sum_ns[STAGE_COUNT] = {0};
+    {
+        std::lock_guard<std::mutex> lock(g_slots_mutex);
+        for(size_t i = 0; i < g_slots.size(); ++i)
+        {
+            const t_metrics_slot &slot = *g_slots[i];
+            for(int c = 0; c < METRIC_COUNTER_COUNT; ++c)
+            {
+                counters[c] += slot.counters[c].load(std::memory_order_relaxed);
+            }
+            for(int s = 0; s < STAGE_COUNT; ++s)
+            {
+                for(int b = 0; b < bucket_count; ++b)
+                {
+                    buckets[s][b] += slot.buckets[s][b].load(std::memory_order_relaxed);
+                }
+                sum_ns[s] += slot.sum_ns[s].load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    static const char *request_statuses[] = { "ok", "cancelled", "timed_out", "decode_failed", "failed" };
+    out += "# HELP dc_requests_total Dominant color requests by outcome.\n";
+    out += "# TYPE dc_requests_total counter\n";
+    for(int i = 0; i <= METRIC_REQUESTS_FAILED; ++i)
+    {
+        append_metric(out, "dc_requests_total{status=\"%s\"} %llu\n", request_statuses[i],
+                      (unsigned long long)counters[METRIC_REQUESTS_OK + i]);
+    }
+
+    out += "# HELP dc_stage_seconds Latency of each pipeline stage; split is observed once per split.\n";
+    out += "# TYPE dc_stage_seconds histogram\n";
+    for(int s = 0; s < STAGE_COUNT; ++s)
+    {
+        uint64_t cumulative = 0;
+        for(int b = 0; b < bucket_count; ++b)
+        {
+            cumulative += buckets[s][b];
+            if(b < bucket_count - 1)
+            {
+                append_metric(out, "dc_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n", stage_names[s],
+                              bucket_bounds[b], (unsigned long long)cumulative);
+            }
+            else
+            {
+                append_metric(out, "dc_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", stage_names[s],
+                              (unsigned long long)cumulative);
+            }
+        }
+        append_metric(out, "dc_stage_seconds_sum{stage=\"%s\"} %.9f\n", stage_names[s], sum_ns[s] / 1e9);
+        append_metric(out, "dc_stage_seconds_count{stage=\"%s\"} %llu\n", stage_names[s],
+                      (unsigned long long)cumulative);
+    }
+
+    out += "# HELP dc_buffer_reuse_total Requests whose worker buffers already fit (hit) or had to grow (miss).\n";
+    out += "# TYPE dc_buffer_reuse_total counter\n";
+    append_metric(out, "dc_buffer_reuse_total{result=\"hit\"} %llu\n",
+                  (unsigned long long)counters[METRIC_BUFFER_HITS]);
+    append_metric(out, "dc_buffer_reuse_total{result=\"miss\"} %llu\n",
+                  (unsigned long long)counters[METRIC_BUFFER_MISSES]);
+
+    out += "# HELP dc_coalesced_requests_total Requests answered by an identical request already in flight.\n";
+    out += "# TYPE dc_coalesced_requests_total counter\n";
+    append_metric(out, "dc_coalesced_requests_total %llu\n", (unsigned long long)counters[METRIC_COALESCED]);
+
+    out += "# HELP dc_admission_waits_total Requests that waited for the memory budget.\n";
+    out += "# TYPE dc_admission_waits_total counter\n";
+    append_metric(out, "dc_admission_waits_total %llu\n", (unsigned long long)counters[METRIC_ADMISSION_WAITS]);
+    out += "# HELP dc_downsampled_total Requests decoded at a reduced scale to fit the memory budget.\n";
+    out += "# TYPE dc_downsampled_total counter\n";
+    append_metric(out, "dc_downsampled_total %llu\n", (unsigned long long)counters[METRIC_DOWNSAMPLED]);
+
+    if(writer)
+    {
+        writer(out);
+    }
+
+    append_metric_gauge(out, "dc_process_threads", "Threads of the process.", read_process_status("Threads"));
+    append_metric_gauge(out, "dc_resident_memory_bytes", "Resident set size of the process.",
+                        read_process_status("VmRSS"));
+    append_metric_gauge(out, "dc_peak_resident_memory_bytes", "Peak resident set size of the process.",
+                        read_process_status("VmHWM"));
+}
@@ -0,0 +1,120 @@
+//
+// metrics.h
+//
+// Operational metrics of the service in the Prometheus text format:
+// requests by outcome, latency histograms per stage, the library pool's
+// queue depth per lane, preemptions and busy workers (added by the
+// server, see t_metrics_writer), buffer reuse, coalesced requests, the
+// memory budget's admissions and the process's memory.
+//
+// Every thread updates its own slot of counters with relaxed atomic
+// stores, so recording takes no lock and never contends with another
+// thread; a scrape sums the slots.  A thread's slot is handed to the next
+// new thread when it exits, so the counts stay monotonic and the slots
+// stay bounded by the peak thread count.  Metrics are off until
+// start_metrics; until then a timer costs one relaxed atomic load.
+//
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <string>
+#include <atomic>
+#include <chrono>
+
+
+typedef enum t_metric_stage
+{
+    STAGE_QUEUE_WAIT,
+    STAGE_ADMISSION,        // waiting for the memory budget
+    STAGE_DECODE,
+    STAGE_ROOT_STATS,
+    STAGE_SPLIT,
+    STAGE_REQUEST,          // from the request being queued to its result
+    STAGE_COUNT
+} t_metric_stage;
+
+
+typedef enum t_metric_counter
+{
+    METRIC_REQUESTS_OK,
+    METRIC_REQUESTS_CANCELLED,
+    METRIC_REQUESTS_TIMED_OUT,
+    METRIC_REQUESTS_DECODE_FAILED,
+    METRIC_REQUESTS_FAILED,
+    METRIC_BUFFER_HITS,     // a worker's buffers already fit the request
+    METRIC_BUFFER_MISSES,   // they had to grow
+    METRIC_ADMISSION_WAITS, // requests that waited for the memory budget
+    METRIC_DOWNSAMPLED,     // requests decoded smaller to fit the budget
+    METRIC_COALESCED,       // requests that joined an identical one in flight
+    METRIC_COUNTER_COUNT
+} t_metric_counter;
+
+
+extern std::atomic<bool> g_collecting_metrics;
+
+inline bool is_collecting_metrics()
+{
+    return g_collecting_metrics.load(std::memory_order_relaxed);
+}
+
+//
+// Start recording.  The counts are cumulative and never reset.
+//
+void start_metrics();
+
+void count_metric(t_metric_counter counter, uint64_t n = 1);
+void observe_stage(t_metric_stage stage, double seconds);
+
+//
+// Appends the caller's own metrics, such as gauges of state this layer
+// doesn't know about, to a scrape
+//
+typedef void (*t_metrics_writer)(std::string &out);
+
+//
+// Append every metric to 'out' in the Prometheus text exposition format,
+// with the writer's before the process's memory and threads
+//
+void write_metrics(std::string &out, t_metrics_writer writer = NULL);
+
+//
+// Append one line formatted like printf, or a gauge with its HELP and
+// TYPE lines; a negative gauge is left out
+//
+void append_metric(std::string &out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void append_metric_gauge(std::string &out, const char *name, const char *help, double value);
+
+
+//
+// Observes the lifetime of the object as one run of a stage
+//
+class t_stage_timer
+{
+public:
+    t_stage_timer(t_metric_stage stage)
+        : stage(stage), active(is_collecting_metrics())
+    {
+        if(active)
+        {
+            start = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~t_stage_timer()
+    {
+        if(active)
+        {
+            std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+            observe_stage(stage, d.count());
+        }
+    }
+
+private:
+    t_metric_stage                          stage;
+    bool                                    active;
+    std::chrono::steady_clock::time_point   start;
+};
+
+#endif
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "numa.h"
+
+
+#if defined(__linux__)
+
+//
+// Parse a sysfs cpu list such as "0-7,16-23"
+//
+static std::vector<int> parse_cpu_list(const char *list)
+{
+    std::vector<int> cpus;
+    const char *p = list;
+    while(*p)
+    {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if(end == p)
+        {
+            break;
+        }
+
+        long last = first;
+        p = end;
+        if(*p == '-')
+        {
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+
+        for(long cpu = first; cpu <= last; ++cpu)
+        {
+            cpus.push_back((int)cpu);
+        }
+
+        if(*p == ',')
+        {
+            ++p;
+        }
+        else
+        {
+            break;
+        }
+    }
+    return cpus;
+}
+
+
+//
+// The cpus this process is allowed to run on
+//
+static std::vector<int> get_allowed_cpus()
+{
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if(CPU_ISSET(cpu, &set))
+            {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    return cpus;
+}
+
+
+std::vector<t_numa_node> get_numa_nodes()
+{
+    std::vector<t_numa_node> nodes;
+    std::vector<int> allowed = get_allowed_cpus();
+
+    DIR *dir = opendir("/sys/devices/system/node");
+    if(dir)
+    {
+        struct dirent *entry;
+        while((entry = readdir(dir)) != NULL)
+        {
+            int id;
+            if(sscanf(entry->d_name, "node%d", &id) != 1)
+            {
+                continue;
+            }
+
+            char path[256];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", id);
+            FILE *f = fopen(path, "r");
+            if(!f)
+            {
+                continue;
+            }
+
+            char list[4096] = "";
+            if(!fgets(list, sizeof(list), f))
+            {
+                list[0] = 0;
+            }
+            fclose(f);
+
+            //
+            // only keep the cpus we are allowed to use.  Memory-only
+            // nodes and nodes outside our cpuset drop out here.
+            //
+            t_numa_node node;
+            node.id = id;
+            std::vector<int> cpus = parse_cpu_list(list);
+            for(size_t i = 0; i < cpus.size(); ++i)
+            {
+                for(size_t j = 0; j < allowed.size(); ++j)
+                {
+                    if(cpus[i] == allowed[j])
+                    {
+                        node.cpus.push_back(cpus[i]);
+                        break;
+                    }
+                }
+            }
+
+            if(node.cpus.size() > 0)
+            {
+                nodes.push_back(node);
+            }
+        }
+        closedir(dir);
+    }
+
+    //
+    // No NUMA information: the whole machine is one node
+    //
+    if(nodes.size() == 0)
+    {
+        t_numa_node node;
+        node.id = 0;
+        node.cpus = allowed;
+        nodes.push_back(node);
+    }
+
+    //
+    // keep the nodes in id order
+    //
+    for(size_t i = 1; i < nodes.size(); ++i)
+    {
+        for(size_t j = i; j > 0 && nodes[j].id < nodes[j - 1].id; --j)
+        {
+            std::swap(nodes[j], nodes[j - 1]);
+        }
+    }
+
+    return nodes;
+}
+
+
+bool pin_thread_to_cpus(const std::vector<int> &cpus)
+{
+    if(cpus.size() == 0)
+    {
+        return false;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(size_t i = 0; i < cpus.size(); ++i)
+    {
+        CPU_SET(cpus[i], &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+#else
+
+std::vector<t_numa_node> get_numa_nodes()
+{
+    t_numa_node node;
+    node.id = 0;
+    unsigned int n = std::thread::hardware_concurrency();
+    for(unsigned int cpu = 0; cpu < (n ? n : 1); ++cpu)
+    {
+        node.cpus.push_back((int)cpu);
+    }
+    return std::vector<t_numa_node>(1, node);
+}
+
+
+bool pin_thread_to_cpus(const std::vector<int> &cpus)
+{
+    return false;
+}
+
+#endif
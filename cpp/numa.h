@@ -0,0 +1,34 @@
+//
+// numa.h
+//
+// Discovery of the NUMA topology of the host and pinning of threads to
+// the cpus of a node.  On hosts without NUMA information (or outside
+// Linux) the whole machine is reported as a single node.
+//
+
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <vector>
+
+
+typedef struct t_numa_node
+{
+    int                 id;
+    std::vector<int>    cpus;
+} t_numa_node;
+
+
+//
+// Returns the NUMA nodes that have cpus this process may run on.
+// Always returns at least one node.
+//
+std::vector<t_numa_node> get_numa_nodes();
+
+//
+// Restrict the calling thread to the given cpus.  Returns false
+// if the platform doesn't support it or the call failed.
+//
+bool pin_thread_to_cpus(const std::vector<int> &cpus);
+
+#endif
@@ -0,0 +1,291 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#include "palette.h"
+
+
+//
+// The sRGB transfer curve undone for every 8-bit value
+//
+static bool init_linear_table(float table[256])
+{
+    for(int i = 0; i < 256; ++i)
+    {
+        const double c = i / 255.0;
+        table[i] = (float)(c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4));
+    }
+    return true;
+}
+
+
+static const float* get_linear_table()
+{
+    static float table[256];
+    static const bool ready = init_linear_table(table);
+    (void)ready;
+    return table;
+}
+
+
+static float lab_f(float t)
+{
+    return t > 0.008856f ? cbrtf(t) : 7.787f * t + 16.0f / 116.0f;
+}
+
+
+void bgr_to_lab(cv::Vec3b bgr, float lab[3])
+{
+    const float *linear = get_linear_table();
+    const float r = linear[bgr[2]];
+    const float g = linear[bgr[1]];
+    const float b = linear[bgr[0]];
+
+    //
+    // linear sRGB to XYZ, relative to the D65 white point
+    //
+    const float x = (0.4124564f * r + 0.3575761f * g + 0.1804375f * b) / 0.95047f;
+    const float y = (0.2126729f * r + 0.7151522f * g + 0.0721750f * b);
+    const float z = (0.0193339f * r + 0.1191920f * g + 0.9503041f * b) / 1.08883f;
+
+    const float fx = lab_f(x);
+    const float fy = lab_f(y);
+    const float fz = lab_f(z);
+    lab[0] = 116.0f * fy - 16.0f;
+    lab[1] = 500.0f * (fx - fy);
+    lab[2] = 200.0f * (fy - fz);
+}
+
+
+t_palette make_palette(const std::vector<cv::Vec3b> &colors, const std::vector<double> &weights)
+{
+    t_palette palette;
+    palette.colors.resize(colors.size());
+
+    double total = 0;
+    for(size_t i = 0; i < colors.size(); ++i)
+    {
+        total += i < weights.size() ? weights[i] : 1.0;
+    }
+
+    for(size_t i = 0; i < colors.size(); ++i)
+    {
+        t_palette_color &c = palette.colors[i];
+        bgr_to_lab(colors[i], c.lab);
+        const double w = i < weights.size() ? weights[i] : 1.0;
+        c.weight = total > 0 ? (float)(w / total) : 0;
+    }
+
+    return palette;
+}
+
+
+static inline float get_lab_distance2(const float a[3], const float b[3])
+{
+    const float d0 = a[0] - b[0];
+    const float d1 = a[1] - b[1];
+    const float d2 = a[2] - b[2];
+    return d0*d0 + d1*d1 + d2*d2;
+}
+
+
+float get_palette_distance(const t_palette_color *a, int a_count,
+                           const t_palette_color *b, int b_count)
+{
+    if(a_count == 0 || b_count == 0)
+    {
+        return a_count == b_count ? 0 : INFINITY;
+    }
+
+    //
+    // One pass over the pairs finds the nearest color in 'b' for every
+    // color of 'a' and, for small 'b', the nearest in 'a' for every
+    // color of 'b' as well.
+    //
+    const int max_fused = 64;
+    float b_nearest[max_fused];
+    const bool fused = b_count <= max_fused;
+    float a_sum = 0;
+    if(fused)
+    {
+        for(int j = 0; j < b_count; ++j)
+        {
+            b_nearest[j] = INFINITY;
+        }
+
+        for(int i = 0; i < a_count; ++i)
+        {
+            float nearest = INFINITY;
+            for(int j = 0; j < b_count; ++j)
+            {
+                const float d = get_lab_distance2(a[i].lab, b[j].lab);
+                nearest = std::min(nearest, d);
+                b_nearest[j] = std::min(b_nearest[j], d);
+            }
+            a_sum += a[i].weight * sqrtf(nearest);
+        }
+    }
+    else
+    {
+        for(int i = 0; i < a_count; ++i)
+        {
+            float nearest = INFINITY;
+            for(int j = 0; j < b_count; ++j)
+            {
+                nearest = std::min(nearest, get_lab_distance2(a[i].lab, b[j].lab));
+            }
+            a_sum += a[i].weight * sqrtf(nearest);
+        }
+    }
+
+    float b_sum = 0;
+    for(int j = 0; j < b_count; ++j)
+    {
+        float nearest = INFINITY;
+        if(fused)
+        {
+            nearest = b_nearest[j];
+        }
+        else
+        {
+            for(int i = 0; i < a_count; ++i)
+            {
+                nearest = std::min(nearest, get_lab_distance2(a[i].lab, b[j].lab));
+            }
+        }
+        b_sum += b[j].weight * sqrtf(nearest);
+    }
+
+    return 0.5f * (a_sum + b_sum);
+}
+
+
+float get_palette_distance(const t_palette &a, const t_palette &b)
+{
+    return get_palette_distance(a.colors.empty() ? NULL : &a.colors[0], (int)a.colors.size(),
+                                b.colors.empty() ? NULL : &b.colors[0], (int)b.colors.size());
+}
+
+
+static int get_hex_digit(char c)
+{
+    if(c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if(c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if(c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+
+bool parse_palette_line(const char *line, std::string &name,
+                        std::vector<cv::Vec3b> &colors, std::vector<double> &weights)
+{
+    colors.clear();
+    weights.clear();
+
+    //
+    // the name runs to the first space
+    //
+    while(*line == ' ' || *line == '\t')
+    {
+        line++;
+    }
+    const char *end = line;
+    while(*end && *end != ' ' && *end != '\t' && *end != '\n' && *end != '\r')
+    {
+        end++;
+    }
+    if(end == line)
+    {
+        return false;
+    }
+    name.assign(line, end - line);
+
+    bool weighted = false;
+    const char *p = end;
+    for(;;)
+    {
+        while(*p == ' ' || *p == '\t')
+        {
+            p++;
+        }
+        if(*p == 0 || *p == '\n' || *p == '\r')
+        {
+            break;
+        }
+
+        if(p[0] != '#')
+        {
+            return false;
+        }
+
+        int rgb[6];
+        for(int i = 0; i < 6; ++i)
+        {
+            rgb[i] = get_hex_digit(p[1 + i]);
+            if(rgb[i] < 0)
+            {
+                return false;
+            }
+        }
+        colors.push_back(cv::Vec3b((uchar)(rgb[4] * 16 + rgb[5]),
+                                   (uchar)(rgb[2] * 16 + rgb[3]),
+                                   (uchar)(rgb[0] * 16 + rgb[1])));
+        p += 7;
+
+        double weight = 1.0;
+        if(*p == ':')
+        {
+            char *after;
+            weight = strtod(p + 1, &after);
+            if(after == p + 1 || weight < 0)
+            {
+                return false;
+            }
+            p = after;
+            weighted = true;
+        }
+        weights.push_back(weight);
+    }
+
+    if(!weighted)
+    {
+        weights.clear();
+    }
+    return !colors.empty();
+}
+
+
+void read_palette_file(FILE *in, std::vector<std::string> &names, std::vector<t_palette> &palettes)
+{
+    std::string name;
+    std::vector<cv::Vec3b> colors;
+    std::vector<double> weights;
+
+    char *line = NULL;
+    size_t capacity = 0;
+    int line_number = 0;
+    while(getline(&line, &capacity, in) > 0)
+    {
+        line_number++;
+        if(parse_palette_line(line, name, colors, weights))
+        {
+            names.push_back(name);
+            palettes.push_back(make_palette(colors, weights));
+        }
+        else if(strspn(line, " \t\r\n") != strlen(line))
+        {
+            fprintf(stderr, "Skipping malformed palette on line %d\n", line_number);
+        }
+    }
+    free(line);
+}
@@ -0,0 +1,65 @@
+//
+// palette.h
+//
+// Palettes as compared by the search indexes: the colors found for an
+// image in CIE L*a*b*, where Euclidean distance is the delta E between
+// two colors, each with the fraction of the image it covers.
+//
+
+#ifndef PALETTE_H
+#define PALETTE_H
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+
+typedef struct t_palette_color
+{
+    float       lab[3];
+    float       weight;         // the weights of a palette sum to 1
+} t_palette_color;
+
+
+typedef struct t_palette
+{
+    std::vector<t_palette_color>    colors;
+} t_palette;
+
+
+//
+// sRGB (in OpenCV's BGR order) to L*a*b*, D65 white
+//
+void bgr_to_lab(cv::Vec3b bgr, float lab[3]);
+
+//
+// Build a palette from find_dominant_colors style output.  With no
+// weights the colors are weighted equally; weights are normalized.
+//
+t_palette make_palette(const std::vector<cv::Vec3b> &colors, const std::vector<double> &weights);
+
+//
+// The weighted nearest-color distance between two palettes: every color
+// of each palette is matched to the nearest color of the other and the
+// delta Es are averaged by weight, both ways.  0 for identical palettes.
+//
+float get_palette_distance(const t_palette_color *a, int a_count,
+                           const t_palette_color *b, int b_count);
+float get_palette_distance(const t_palette &a, const t_palette &b);
+
+//
+// Parse one line of palette text, as printed by getDominantColors --batch:
+//   <name> #rrggbb[:weight] #rrggbb[:weight] ...
+// Returns false for a blank line or a malformed color.
+//
+bool parse_palette_line(const char *line, std::string &name,
+                        std::vector<cv::Vec3b> &colors, std::vector<double> &weights);
+
+//
+// Read every palette in a file of palette lines.  Bad lines are
+// reported on stderr and skipped.
+//
+void read_palette_file(FILE *in, std::vector<std::string> &names, std::vector<t_palette> &palettes);
+
+#endif
@@ -0,0 +1,589 @@
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "palette_distance.h"
+#include "worker_pool.h"
+#include "async.h"
+
+
+//
+// Padding colors sit here, far from every real color, with no weight
+//
+static const float padding_lab = 1e6f;
+
+//
+// Sinkhorn stops when the plan's marginals are this close to the weights
+//
+static const float sinkhorn_tolerance = 1e-4f;
+
+//
+// A pair with a cost above this many epsilons has a kernel entry below
+// about 2e-35, near the end of the normal floats; further on it becomes
+// denormal and then 0, so the pair is solved in the log domain instead.
+// Across sRGB, up to about 259 delta E, that is epsilon below 3.2.
+//
+static const float max_kernel_exponent = 80;
+
+//
+// Pairs handed to a worker at a time
+//
+static const size_t pairs_per_task = 4096;
+
+
+t_distance_config get_default_distance_config()
+{
+    t_distance_config config;
+    config.metric = PALETTE_CHAMFER;
+    config.epsilon = 4;
+    config.iterations = 50;
+    config.threads = 0;
+    config.pool = NULL;
+    return config;
+}
+
+
+t_palette_batch make_palette_batch(const std::vector<t_palette> &palettes)
+{
+    t_palette_batch batch;
+    batch.count = palettes.size();
+
+    size_t largest = 1;
+    for(size_t i = 0; i < palettes.size(); ++i)
+    {
+        largest = std::max(largest, palettes[i].colors.size());
+    }
+    batch.stride = (int)((largest + 3) & ~(size_t)3);
+
+    const size_t total = batch.count * batch.stride;
+    batch.sizes.resize(batch.count);
+    batch.l.assign(total, padding_lab);
+    batch.a.assign(total, padding_lab);
+    batch.b.assign(total, padding_lab);
+    batch.w.assign(total, 0);
+
+    for(size_t i = 0; i < palettes.size(); ++i)
+    {
+        const std::vector<t_palette_color> &colors = palettes[i].colors;
+        batch.sizes[i] = (int)colors.size();
+        for(size_t c = 0; c < colors.size(); ++c)
+        {
+            const size_t k = i * batch.stride + c;
+            batch.l[k] = colors[c].lab[0];
+            batch.a[k] = colors[c].lab[1];
+            batch.b[k] = colors[c].lab[2];
+            batch.w[k] = colors[c].weight;
+        }
+    }
+
+    return batch;
+}
+
+
+//
+// One palette of a batch
+//
+typedef struct t_slot
+{
+    const float    *l;
+    const float    *a;
+    const float    *b;
+    const float    *w;
+    int             size;
+} t_slot;
+
+
+static t_slot get_slot(const t_palette_batch &batch, size_t i)
+{
+    const size_t offset = i * batch.stride;
+    t_slot slot;
+    slot.l = &batch.l[offset];
+    slot.a = &batch.a[offset];
+    slot.b = &batch.b[offset];
+    slot.w = &batch.w[offset];
+    slot.size = batch.sizes[i];
+    return slot;
+}
+
+
+#if defined(__SSE2__)
+
+static inline float get_min4(__m128 v)
+{
+    v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+    v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+    return _mm_cvtss_f32(v);
+}
+
+
+static inline float get_sum4(__m128 v)
+{
+    v = _mm_add_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+    v = _mm_add_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+    return _mm_cvtss_f32(v);
+}
+
+#endif
+
+
+//
+// The squared delta E from color i of 'x' to colors j .. j+3 of 'y'
+//
+#if defined(__SSE2__)
+static inline __m128 get_distance2_4(const t_slot &x, int i, const t_slot &y, int j)
+{
+    const __m128 dl = _mm_sub_ps(_mm_loadu_ps(y.l + j), _mm_set1_ps(x.l[i]));
+    const __m128 da = _mm_sub_ps(_mm_loadu_ps(y.a + j), _mm_set1_ps(x.a[i]));
+    const __m128 db = _mm_sub_ps(_mm_loadu_ps(y.b + j), _mm_set1_ps(x.b[i]));
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(dl, dl), _mm_mul_ps(da, da)), _mm_mul_ps(db, db));
+}
+#endif
+
+
+static inline float get_distance2(const t_slot &x, int i, const t_slot &y, int j)
+{
+    const float dl = y.l[j] - x.l[i];
+    const float da = y.a[j] - x.a[i];
+    const float db = y.b[j] - x.b[i];
+    return dl*dl + da*da + db*db;
+}
+
+
+//
+// The weighted nearest-color distance, as get_palette_distance.  The
+// nearest color of 'x' for every color of 'y' is kept as the pairs are
+// visited, so every pair is measured once.
+//
+static float get_chamfer_distance(const t_slot &x, const t_slot &y, int stride)
+{
+    if(x.size == 0 || y.size == 0)
+    {
+        return x.size == y.size ? 0 : INFINITY;
+    }
+
+    //
+    // small palettes keep the nearest distances on the stack
+    //
+    const int max_stack = 64;
+    float stack_nearest[max_stack];
+    static thread_local std::vector<float> heap_nearest;
+    float *y_nearest = stack_nearest;
+    if(stride > max_stack)
+    {
+        heap_nearest.resize(stride);
+        y_nearest = &heap_nearest[0];
+    }
+    std::fill(y_nearest, y_nearest + stride, INFINITY);
+
+    float x_sum = 0;
+    float y_sum = 0;
+
+#if defined(__SSE2__)
+    for(int i = 0; i < x.size; ++i)
+    {
+        __m128 nearest = _mm_set1_ps(INFINITY);
+        for(int j = 0; j < stride; j += 4)
+        {
+            const __m128 d2 = get_distance2_4(x, i, y, j);
+            nearest = _mm_min_ps(nearest, d2);
+            _mm_storeu_ps(&y_nearest[j], _mm_min_ps(_mm_loadu_ps(&y_nearest[j]), d2));
+        }
+        x_sum += x.w[i] * sqrtf(get_min4(nearest));
+    }
+
+    __m128 sum = _mm_setzero_ps();
+    for(int j = 0; j < stride; j += 4)
+    {
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_sqrt_ps(_mm_loadu_ps(&y_nearest[j])), _mm_loadu_ps(y.w + j)));
+    }
+    y_sum = get_sum4(sum);
+#else
+    for(int i = 0; i < x.size; ++i)
+    {
+        float nearest = INFINITY;
+        for(int j = 0; j < y.size; ++j)
+        {
+            const float d2 = get_distance2(x, i, y, j);
+            nearest = std::min(nearest, d2);
+            y_nearest[j] = std::min(y_nearest[j], d2);
+        }
+        x_sum += x.w[i] * sqrtf(nearest);
+    }
+
+    for(int j = 0; j < y.size; ++j)
+    {
+        y_sum += y.w[j] * sqrtf(y_nearest[j]);
+    }
+#endif
+
+    return 0.5f * (x_sum + y_sum);
+}
+
+
+//
+// sum over j of row[j] * v[j] for a padded row
+//
+static inline float get_dot(const float *row, const float *v, int stride)
+{
+#if defined(__SSE2__)
+    __m128 sum = _mm_setzero_ps();
+    for(int j = 0; j < stride; j += 4)
+    {
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(row + j), _mm_loadu_ps(v + j)));
+    }
+    return get_sum4(sum);
+#else
+    float sum = 0;
+    for(int j = 0; j < stride; ++j)
+    {
+        sum += row[j] * v[j];
+    }
+    return sum;
+#endif
+}
+
+
+//
+// out[j] += scale * row[j] for a padded row
+//
+static inline void add_scaled(float *out, const float *row, float scale, int stride)
+{
+#if defined(__SSE2__)
+    const __m128 s = _mm_set1_ps(scale);
+    for(int j = 0; j < stride; j += 4)
+    {
+        _mm_storeu_ps(out + j, _mm_add_ps(_mm_loadu_ps(out + j), _mm_mul_ps(s, _mm_loadu_ps(row + j))));
+    }
+#else
+    for(int j = 0; j < stride; ++j)
+    {
+        out[j] += scale * row[j];
+    }
+#endif
+}
+
+
+//
+// log(sum(exp(values[k * step]))) over 'count' values, shifted by the
+// largest so no term overflows or underflows to nothing
+//
+static float get_log_sum_exp(const float *values, int count, int step)
+{
+    float largest = -INFINITY;
+    for(int k = 0; k < count; ++k)
+    {
+        largest = std::max(largest, values[k * step]);
+    }
+    if(largest == -INFINITY)
+    {
+        return largest;
+    }
+
+    float sum = 0;
+    for(int k = 0; k < count; ++k)
+    {
+        sum += expf(values[k * step] - largest);
+    }
+    return largest + logf(sum);
+}
+
+
+//
+// get_sinkhorn_distance in the log domain, for pairs whose kernel would
+// underflow.  The plan is exp((f[i] + g[j] - C[i][j]) / epsilon), with
+// the potentials f = epsilon * log(u) and g = epsilon * log(v).  Slower,
+// with an exp per entry per iteration, but it holds at any distance.
+//
+static float get_log_sinkhorn_distance(const t_slot &x, const t_slot &y, const std::vector<float> &cost,
+                                       int stride, float epsilon, int iterations)
+{
+    const int n = x.size;
+    const int m = y.size;
+
+    static thread_local std::vector<float> f;
+    static thread_local std::vector<float> g;
+    static thread_local std::vector<float> terms;
+    f.assign(n, 0);
+    g.assign(m, 0);
+    terms.assign((size_t)n * m, 0);
+
+    for(int iteration = 0; iteration < iterations; ++iteration)
+    {
+        float error = 0;
+        for(int i = 0; i < n; ++i)
+        {
+            for(int j = 0; j < m; ++j)
+            {
+                terms[(size_t)i * m + j] = (g[j] - cost[(size_t)i * stride + j]) / epsilon;
+            }
+            const float moved = get_log_sum_exp(&terms[(size_t)i * m], m, 1);
+            error += fabsf(expf(f[i] / epsilon + moved) - x.w[i]);
+            f[i] = epsilon * (logf(x.w[i]) - moved);
+        }
+        if(iteration > 0 && error < sinkhorn_tolerance)
+        {
+            break;
+        }
+
+        for(int i = 0; i < n; ++i)
+        {
+            for(int j = 0; j < m; ++j)
+            {
+                terms[(size_t)i * m + j] = (f[i] - cost[(size_t)i * stride + j]) / epsilon;
+            }
+        }
+        for(int j = 0; j < m; ++j)
+        {
+            g[j] = epsilon * (logf(y.w[j]) - get_log_sum_exp(&terms[j], n, m));
+        }
+    }
+
+    float total = 0;
+    for(int i = 0; i < n; ++i)
+    {
+        for(int j = 0; j < m; ++j)
+        {
+            const float c = cost[(size_t)i * stride + j];
+            total += expf((f[i] + g[j] - c) / epsilon) * c;
+        }
+    }
+    return total;
+}
+
+
+//
+// The entropy regularized transport cost from the weights of 'x' to the
+// weights of 'y'.  The plan is diag(u) K diag(v) with K = exp(-C / epsilon);
+// u and v are scaled in turn until the plan's marginals match the weights.
+// A pair with colors too far apart for the kernel in floats, as blue and
+// yellow are at epsilon 2, is solved in the log domain.
+//
+static float get_sinkhorn_distance(const t_slot &x, const t_slot &y, int stride, const t_distance_config &config)
+{
+    if(x.size == 0 || y.size == 0)
+    {
+        return x.size == y.size ? 0 : INFINITY;
+    }
+
+    const float epsilon = std::max(config.epsilon, 1e-3f);
+    const float tiny = 1e-30f;
+    const int n = x.size;
+
+    static thread_local std::vector<float> cost;
+    static thread_local std::vector<float> kernel;
+    static thread_local std::vector<float> u;
+    static thread_local std::vector<float> v;
+    static thread_local std::vector<float> kernel_u;
+    cost.assign((size_t)n * stride, 0);
+    kernel.assign((size_t)n * stride, 0);
+    u.assign(n, 0);
+    v.assign(stride, 0);
+    kernel_u.assign(stride, 0);
+
+    float max_cost = 0;
+    for(int i = 0; i < n; ++i)
+    {
+        for(int j = 0; j < y.size; ++j)
+        {
+            const float c = sqrtf(get_distance2(x, i, y, j));
+            cost[(size_t)i * stride + j] = c;
+            kernel[(size_t)i * stride + j] = expf(-c / epsilon);
+            max_cost = std::max(max_cost, c);
+        }
+    }
+    if(max_cost > max_kernel_exponent * epsilon)
+    {
+        return get_log_sinkhorn_distance(x, y, cost, stride, epsilon, config.iterations);
+    }
+    for(int j = 0; j < y.size; ++j)
+    {
+        v[j] = 1;
+    }
+
+    for(int iteration = 0; iteration < config.iterations; ++iteration)
+    {
+        //
+        // u[i] * (K v)[i] is the weight the current plan moves out of
+        // color i; stop once it matches the weights of 'x'
+        //
+        float error = 0;
+        for(int i = 0; i < n; ++i)
+        {
+            const float moved = get_dot(&kernel[(size_t)i * stride], &v[0], stride);
+            error += fabsf(u[i] * moved - x.w[i]);
+            u[i] = x.w[i] / std::max(moved, tiny);
+        }
+        if(iteration > 0 && error < sinkhorn_tolerance)
+        {
+            break;
+        }
+
+        std::fill(kernel_u.begin(), kernel_u.end(), 0.0f);
+        for(int i = 0; i < n; ++i)
+        {
+            add_scaled(&kernel_u[0], &kernel[(size_t)i * stride], u[i], stride);
+        }
+
+        //
+        // padding colors have no weight, so their v stays 0
+        //
+        for(int j = 0; j < stride; ++j)
+        {
+            v[j] = y.w[j] / std::max(kernel_u[j], tiny);
+        }
+    }
+
+    //
+    // total cost of the plan: sum of u[i] K[i][j] v[j] C[i][j]
+    //
+    float total = 0;
+    for(int i = 0; i < n; ++i)
+    {
+        float row = 0;
+        for(int j = 0; j < y.size; ++j)
+        {
+            row += kernel[(size_t)i * stride + j] * v[j] * cost[(size_t)i * stride + j];
+        }
+        total += u[i] * row;
+    }
+    return total;
+}
+
+
+static float get_distance(const t_slot &x, const t_slot &y, int stride, const t_distance_config &config)
+{
+    if(config.metric == PALETTE_SINKHORN)
+    {
+        return get_sinkhorn_distance(x, y, stride, config);
+    }
+    return get_chamfer_distance(x, y, stride);
+}
+
+
+//
+// The chunks of one run_chunks call.  It is shared with the pool tasks,
+// which may start after the call has returned and then find no chunk
+// left, so it outlives the call's stack.
+//
+typedef struct t_chunk_run
+{
+    const std::function<void(size_t, size_t)> *task;
+    size_t                      count;
+    std::atomic<size_t>         next;       // start of the next unclaimed chunk
+    size_t                      finished;   // pairs done, under the mutex
+    std::mutex                  mutex;
+    std::condition_variable     done;
+} t_chunk_run;
+
+
+//
+// Claim and run chunks until none is left
+//
+static void run_next_chunks(t_chunk_run &run)
+{
+    size_t finished = 0;
+    for(;;)
+    {
+        const size_t begin = run.next.fetch_add(pairs_per_task);
+        if(begin >= run.count)
+        {
+            break;
+        }
+        const size_t end = std::min(run.count, begin + pairs_per_task);
+        (*run.task)(begin, end);
+        finished += end - begin;
+    }
+
+    if(finished > 0)
+    {
+        std::lock_guard<std::mutex> lock(run.mutex);
+        run.finished += finished;
+        if(run.finished == run.count)
+        {
+            run.done.notify_all();
+        }
+    }
+}
+
+
+//
+// Run task(begin, end) over [0, count) in chunks, on the calling thread
+// and up to 'threads' - 1 workers of the config's pool, or on the
+// calling thread alone for a single thread or a small count.  The caller
+// claims chunks too, so the call finishes even if every worker is busy,
+// as when it is made from a task on the same pool.
+//
+static void run_chunks(size_t count, const t_distance_config &config,
+                       const std::function<void(size_t, size_t)> &task)
+{
+    if(config.threads == 1 || count <= pairs_per_task)
+    {
+        task(0, count);
+        return;
+    }
+
+    t_worker_pool &pool = config.pool ? *config.pool : get_library_pool();
+    const size_t chunks = (count + pairs_per_task - 1) / pairs_per_task;
+    const size_t workers = config.threads > 1 ? (size_t)config.threads - 1 : (size_t)pool.get_worker_count();
+    const size_t helpers = std::min(chunks - 1, workers);
+
+    std::shared_ptr<t_chunk_run> run(new t_chunk_run());
+    run->task = &task;
+    run->count = count;
+    run->next = 0;
+    run->finished = 0;
+    for(size_t h = 0; h < helpers; ++h)
+    {
+        pool.submit([run](int)
+        {
+            run_next_chunks(*run);
+        });
+    }
+
+    run_next_chunks(*run);
+
+    std::unique_lock<std::mutex> lock(run->mutex);
+    while(run->finished < run->count)
+    {
+        run->done.wait(lock);
+    }
+}
+
+
+void get_palette_distances(const t_palette &query, const t_palette_batch &targets,
+                           const t_distance_config &config, float *distances)
+{
+    const t_palette_batch queries = make_palette_batch(std::vector<t_palette>(1, query));
+    const t_slot x = get_slot(queries, 0);
+
+    run_chunks(targets.count, config, [&](size_t begin, size_t end)
+    {
+        for(size_t i = begin; i < end; ++i)
+        {
+            distances[i] = get_distance(x, get_slot(targets, i), targets.stride, config);
+        }
+    });
+}
+
+
+void get_palette_distance_matrix(const t_palette_batch &rows, const t_palette_batch &cols,
+                                 const t_distance_config &config, float *distances)
+{
+    run_chunks(rows.count * cols.count, config, [&](size_t begin, size_t end)
+    {
+        for(size_t p = begin; p < end; ++p)
+        {
+            const size_t r = p / cols.count;
+            const size_t c = p % cols.count;
+            distances[p] = get_distance(get_slot(rows, r), get_slot(cols, c), cols.stride, config);
+        }
+    });
+}
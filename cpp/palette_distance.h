@@ -0,0 +1,88 @@
+//
+// palette_distance.h
+//
+// Palette distances at scale: one palette against many, or every palette
+// of one set against every palette of another, on a worker pool.
+//
+// Large jobs are split into chunks that the calling thread runs along
+// with the workers of a long lived pool, by default the library pool of
+// async.h, so a call doesn't start threads of its own.
+//
+// Palettes are first packed into a t_palette_batch, structure of arrays
+// with every palette padded to the same number of colors, so the kernels
+// run over four colors at a time with SSE.  Padding colors have no weight
+// and sit far outside L*a*b* so they never win a nearest match.
+//
+// Two metrics are provided:
+//   PALETTE_CHAMFER   the weighted nearest-color distance of
+//                     get_palette_distance, matching it to float rounding
+//   PALETTE_SINKHORN  an entropy regularized earth mover's distance:
+//                     the cost in delta E of moving one palette's weights
+//                     onto the other's, found with Sinkhorn iterations.
+//                     Smaller 'epsilon' is closer to the exact EMD but
+//                     needs more iterations to converge, and below about
+//                     3 delta E pairs of distant colors take slower log
+//                     domain iterations.
+//
+
+#ifndef PALETTE_DISTANCE_H
+#define PALETTE_DISTANCE_H
+
+#include <stddef.h>
+#include <vector>
+
+#include "palette.h"
+
+class t_worker_pool;
+
+
+typedef enum t_palette_metric
+{
+    PALETTE_CHAMFER,
+    PALETTE_SINKHORN
+} t_palette_metric;
+
+
+typedef struct t_distance_config
+{
+    t_palette_metric    metric;
+    float               epsilon;        // Sinkhorn regularization in delta E
+    int                 iterations;     // most Sinkhorn iterations
+    int                 threads;        // most threads, 0 for every worker, 1 for the calling thread only
+    t_worker_pool       *pool;          // the pool large jobs run on, NULL for the library pool
+} t_distance_config;
+
+
+typedef struct t_palette_batch
+{
+    size_t              count;
+    int                 stride;         // colors per palette, a multiple of 4
+    std::vector<int>    sizes;          // real colors of each palette
+    std::vector<float>  l;              // count * stride of each channel
+    std::vector<float>  a;
+    std::vector<float>  b;
+    std::vector<float>  w;
+} t_palette_batch;
+
+
+t_distance_config get_default_distance_config();
+
+//
+// Pack palettes, e.g. made with make_palette from find_dominant_colors
+// output, for the batched kernels
+//
+t_palette_batch make_palette_batch(const std::vector<t_palette> &palettes);
+
+//
+// distances[i] = distance(query, targets[i]) for every target
+//
+void get_palette_distances(const t_palette &query, const t_palette_batch &targets,
+                           const t_distance_config &config, float *distances);
+
+//
+// distances[r * cols.count + c] = distance(rows[r], cols[c])
+//
+void get_palette_distance_matrix(const t_palette_batch &rows, const t_palette_batch &cols,
+                                 const t_distance_config &config, float *distances);
+
+#endif
@@ -0,0 +1,624 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <atomic>
+#include <queue>
+#include <algorithm>
+#include <functional>
+
+#include "palette_index.h"
+#include "worker_pool.h"
+
+
+static const char index_magic[4] = { 'D', 'C', 'P', 'I' };
+static const uint32_t index_version = 1;
+static const int max_index_level = 16;
+
+
+t_palette_index::t_palette_index(int m, int ef_construction)
+    : m(m < 2 ? 2 : m), ef_construction(ef_construction < 1 ? 1 : ef_construction),
+      entry(0), max_level(-1)
+{
+    level_scale = 1.0 / log((double)this->m);
+    offsets.push_back(0);
+}
+
+
+size_t t_palette_index::size() const
+{
+    return names.size();
+}
+
+
+const std::string& t_palette_index::get_name(uint32_t id) const
+{
+    return names[id];
+}
+
+
+float t_palette_index::get_distance(const t_palette &query, uint32_t id) const
+{
+    return get_palette_distance(query.colors.empty() ? NULL : &query.colors[0], (int)query.colors.size(),
+                                &colors[offsets[id]], (int)(offsets[id + 1] - offsets[id]));
+}
+
+
+float t_palette_index::get_distance(uint32_t a, uint32_t b) const
+{
+    return get_palette_distance(&colors[offsets[a]], (int)(offsets[a + 1] - offsets[a]),
+                                &colors[offsets[b]], (int)(offsets[b + 1] - offsets[b]));
+}
+
+
+int t_palette_index::get_max_links(int level) const
+{
+    return level == 0 ? 2 * m : m;
+}
+
+
+uint32_t* t_palette_index::get_links(uint32_t id, int level)
+{
+    if(level == 0)
+    {
+        return &links0[(size_t)id * (1 + 2 * m)];
+    }
+    return &upper_links[id][(size_t)(level - 1) * (1 + m)];
+}
+
+
+const uint32_t* t_palette_index::get_links(uint32_t id, int level) const
+{
+    return const_cast<t_palette_index*>(this)->get_links(id, level);
+}
+
+
+//
+// The level of a node is drawn from an exponential distribution.  It
+// is derived from the id so a parallel build gives the same levels.
+//
+static int get_random_level(uint32_t id, double scale)
+{
+    uint64_t z = id + 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    z ^= z >> 31;
+
+    const double u = ((z >> 11) + 1) * (1.0 / 9007199254740992.0);
+    const int level = (int)(-log(u) * scale);
+    return level < max_index_level ? level : max_index_level;
+}
+
+
+//
+// Store a palette and make room for its links
+//
+void t_palette_index::append(const std::string &name, const t_palette &palette)
+{
+    const uint32_t id = (uint32_t)names.size();
+    const int level = get_random_level(id, level_scale);
+
+    names.push_back(name);
+    colors.insert(colors.end(), palette.colors.begin(), palette.colors.end());
+    offsets.push_back(colors.size());
+    levels.push_back(level);
+    links0.resize(links0.size() + 1 + 2 * m, 0);
+    upper_links.push_back(std::vector<uint32_t>((size_t)level * (1 + m), 0));
+}
+
+
+//
+// Search one level from 'entry' for the 'ef' nodes nearest 'query'.
+// 'found' is returned nearest first.
+//
+void t_palette_index::search_level(const t_palette &query, uint32_t entry_id, int ef, int level,
+                                   std::vector<t_candidate> &found) const
+{
+    //
+    // nodes are marked visited with a per search tag, so the
+    // visited table is cleared only when the tag wraps
+    //
+    static thread_local std::vector<uint32_t> visited;
+    static thread_local uint32_t tag = 0;
+    static thread_local std::vector<uint32_t> neighbors;
+    if(visited.size() < names.size())
+    {
+        visited.resize(names.size(), 0);
+    }
+    if(++tag == 0)
+    {
+        std::fill(visited.begin(), visited.end(), 0);
+        tag = 1;
+    }
+
+    std::priority_queue<t_candidate, std::vector<t_candidate>, std::greater<t_candidate> > candidates;
+    std::priority_queue<t_candidate> results;
+
+    t_candidate start;
+    start.id = entry_id;
+    start.distance = get_distance(query, entry_id);
+    candidates.push(start);
+    results.push(start);
+    visited[entry_id] = tag;
+
+    while(!candidates.empty())
+    {
+        const t_candidate current = candidates.top();
+        if((int)results.size() >= ef && current.distance > results.top().distance)
+        {
+            break;
+        }
+        candidates.pop();
+
+        //
+        // copy the links so the lock isn't held while measuring distances
+        //
+        {
+            std::lock_guard<std::mutex> lock(node_locks[current.id % lock_stripes]);
+            const uint32_t *links = get_links(current.id, level);
+            neighbors.assign(links + 1, links + 1 + links[0]);
+        }
+
+        for(size_t i = 0; i < neighbors.size(); ++i)
+        {
+            const uint32_t n = neighbors[i];
+            if(visited[n] == tag)
+            {
+                continue;
+            }
+            visited[n] = tag;
+
+            t_candidate c;
+            c.id = n;
+            c.distance = get_distance(query, n);
+            if((int)results.size() < ef || c.distance < results.top().distance)
+            {
+                candidates.push(c);
+                results.push(c);
+                if((int)results.size() > ef)
+                {
+                    results.pop();
+                }
+            }
+        }
+    }
+
+    found.resize(results.size());
+    for(size_t i = found.size(); i > 0; --i)
+    {
+        found[i - 1] = results.top();
+        results.pop();
+    }
+}
+
+
+//
+// Keep at most 'max_links' of the candidates (sorted nearest first),
+// skipping any that is nearer to an already kept neighbor than to the
+// node itself.  This keeps links pointing in different directions,
+// which is what lets the greedy search cross between clusters.
+//
+void t_palette_index::select_neighbors(std::vector<t_candidate> &candidates, int max_links) const
+{
+    if((int)candidates.size() <= max_links)
+    {
+        return;
+    }
+
+    std::vector<t_candidate> selected;
+    for(size_t i = 0; i < candidates.size() && (int)selected.size() < max_links; ++i)
+    {
+        bool keep = true;
+        for(size_t j = 0; j < selected.size(); ++j)
+        {
+            if(get_distance(candidates[i].id, selected[j].id) < candidates[i].distance)
+            {
+                keep = false;
+                break;
+            }
+        }
+        if(keep)
+        {
+            selected.push_back(candidates[i]);
+        }
+    }
+    candidates.swap(selected);
+}
+
+
+//
+// Add a link from 'from' to 'to' on 'level', re-selecting the
+// neighbors of 'from' if it already has as many as it may hold.
+//
+void t_palette_index::link(uint32_t from, uint32_t to, float distance, int level)
+{
+    std::lock_guard<std::mutex> lock(node_locks[from % lock_stripes]);
+    uint32_t *links = get_links(from, level);
+    const int max_links = get_max_links(level);
+
+    for(uint32_t i = 0; i < links[0]; ++i)
+    {
+        if(links[1 + i] == to)
+        {
+            return;
+        }
+    }
+
+    if((int)links[0] < max_links)
+    {
+        links[1 + links[0]] = to;
+        links[0]++;
+        return;
+    }
+
+    std::vector<t_candidate> candidates(links[0] + 1);
+    candidates[0].id = to;
+    candidates[0].distance = distance;
+    for(uint32_t i = 0; i < links[0]; ++i)
+    {
+        candidates[i + 1].id = links[1 + i];
+        candidates[i + 1].distance = get_distance(from, links[1 + i]);
+    }
+    std::sort(candidates.begin(), candidates.end());
+    select_neighbors(candidates, max_links);
+
+    links[0] = (uint32_t)candidates.size();
+    for(size_t i = 0; i < candidates.size(); ++i)
+    {
+        links[1 + i] = candidates[i].id;
+    }
+}
+
+
+//
+// Link a stored palette into the graph
+//
+void t_palette_index::insert(uint32_t id)
+{
+    const int level = levels[id];
+
+    //
+    // a node that raises the top level holds the entry lock
+    // until it is linked and becomes the new entry point
+    //
+    std::unique_lock<std::mutex> entry_guard(entry_lock);
+    if(max_level < 0)
+    {
+        entry = id;
+        max_level = level;
+        return;
+    }
+    uint32_t current = entry;
+    const int top = max_level;
+    if(level <= top)
+    {
+        entry_guard.unlock();
+    }
+
+    t_palette query;
+    query.colors.assign(colors.begin() + offsets[id], colors.begin() + offsets[id + 1]);
+
+    //
+    // greedy descent through the levels above the node's own
+    //
+    float current_distance = get_distance(query, current);
+    for(int l = top; l > level; --l)
+    {
+        bool changed = true;
+        while(changed)
+        {
+            changed = false;
+            std::vector<uint32_t> neighbors;
+            {
+                std::lock_guard<std::mutex> lock(node_locks[current % lock_stripes]);
+                const uint32_t *links = get_links(current, l);
+                neighbors.assign(links + 1, links + 1 + links[0]);
+            }
+            for(size_t i = 0; i < neighbors.size(); ++i)
+            {
+                const float d = get_distance(query, neighbors[i]);
+                if(d < current_distance)
+                {
+                    current = neighbors[i];
+                    current_distance = d;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    std::vector<t_candidate> found;
+    for(int l = std::min(level, top); l >= 0; --l)
+    {
+        search_level(query, current, ef_construction, l, found);
+        current = found[0].id;
+
+        std::vector<t_candidate> selected = found;
+        select_neighbors(selected, m);
+
+        {
+            std::lock_guard<std::mutex> lock(node_locks[id % lock_stripes]);
+            uint32_t *links = get_links(id, l);
+            links[0] = (uint32_t)selected.size();
+            for(size_t i = 0; i < selected.size(); ++i)
+            {
+                links[1 + i] = selected[i].id;
+            }
+        }
+
+        for(size_t i = 0; i < selected.size(); ++i)
+        {
+            link(selected[i].id, id, selected[i].distance, l);
+        }
+    }
+
+    if(level > top)
+    {
+        entry = id;
+        max_level = level;
+    }
+}
+
+
+uint32_t t_palette_index::add(const std::string &name, const t_palette &palette)
+{
+    const uint32_t id = (uint32_t)names.size();
+    append(name, palette);
+    insert(id);
+    return id;
+}
+
+
+uint32_t t_palette_index::add(const std::vector<std::string> &new_names,
+                              const std::vector<t_palette> &palettes, int threads)
+{
+    const uint32_t first = (uint32_t)names.size();
+    for(size_t i = 0; i < palettes.size(); ++i)
+    {
+        append(i < new_names.size() ? new_names[i] : std::string(), palettes[i]);
+    }
+
+    const uint32_t end = (uint32_t)names.size();
+    uint32_t start = first;
+    if(start < end && max_level < 0)
+    {
+        insert(start++);
+    }
+
+    //
+    // every worker takes the next id until all are linked
+    //
+    t_worker_pool pool(threads, true);
+    std::atomic<uint32_t> next(start);
+    for(int w = 0; w < pool.get_worker_count(); ++w)
+    {
+        pool.submit([&](int)
+        {
+            for(uint32_t id = next++; id < end; id = next++)
+            {
+                insert(id);
+            }
+        });
+    }
+    pool.wait_idle();
+
+    return first;
+}
+
+
+std::vector<t_palette_match> t_palette_index::search(const t_palette &query, int k, int ef) const
+{
+    std::vector<t_palette_match> matches;
+    if(max_level < 0 || k <= 0)
+    {
+        return matches;
+    }
+
+    uint32_t current = entry;
+    float current_distance = get_distance(query, current);
+    for(int l = max_level; l > 0; --l)
+    {
+        bool changed = true;
+        while(changed)
+        {
+            changed = false;
+            const uint32_t *links = get_links(current, l);
+            for(uint32_t i = 0; i < links[0]; ++i)
+            {
+                const float d = get_distance(query, links[1 + i]);
+                if(d < current_distance)
+                {
+                    current = links[1 + i];
+                    current_distance = d;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    std::vector<t_candidate> found;
+    search_level(query, current, std::max(ef, k), 0, found);
+
+    for(size_t i = 0; i < found.size() && (int)i < k; ++i)
+    {
+        t_palette_match match;
+        match.id = found[i].id;
+        match.distance = found[i].distance;
+        matches.push_back(match);
+    }
+    return matches;
+}
+
+
+std::vector<t_palette_match> t_palette_index::search_exact(const t_palette &query, int k) const
+{
+    std::vector<t_candidate> all(names.size());
+    for(uint32_t id = 0; id < all.size(); ++id)
+    {
+        all[id].id = id;
+        all[id].distance = get_distance(query, id);
+    }
+
+    const size_t n = std::min(all.size(), (size_t)std::max(k, 0));
+    std::partial_sort(all.begin(), all.begin() + n, all.end());
+
+    std::vector<t_palette_match> matches(n);
+    for(size_t i = 0; i < n; ++i)
+    {
+        matches[i].id = all[i].id;
+        matches[i].distance = all[i].distance;
+    }
+    return matches;
+}
+
+
+//
+// File layout, native byte order:
+//   "DCPI", version, m, ef_construction, count, entry, max_level
+//   offsets[count + 1], colors[offsets[count]], levels[count]
+//   level 0 links, then the upper links of each node above level 0
+//   the names, each as a length and its bytes
+//
+bool t_palette_index::save(const char *path) const
+{
+    FILE *out = fopen(path, "wb");
+    if(!out)
+    {
+        return false;
+    }
+
+    const uint64_t count = names.size();
+    const int32_t header[2] = { m, ef_construction };
+    const int32_t top = max_level;
+
+    bool ok = fwrite(index_magic, 4, 1, out) == 1 &&
+              fwrite(&index_version, sizeof(index_version), 1, out) == 1 &&
+              fwrite(header, sizeof(header), 1, out) == 1 &&
+              fwrite(&count, sizeof(count), 1, out) == 1 &&
+              fwrite(&entry, sizeof(entry), 1, out) == 1 &&
+              fwrite(&top, sizeof(top), 1, out) == 1 &&
+              fwrite(&offsets[0], sizeof(uint64_t), offsets.size(), out) == offsets.size() &&
+              fwrite(colors.data(), sizeof(t_palette_color), colors.size(), out) == colors.size() &&
+              fwrite(levels.data(), sizeof(int), levels.size(), out) == levels.size() &&
+              fwrite(links0.data(), sizeof(uint32_t), links0.size(), out) == links0.size();
+
+    for(size_t i = 0; ok && i < upper_links.size(); ++i)
+    {
+        ok = fwrite(upper_links[i].data(), sizeof(uint32_t), upper_links[i].size(), out) == upper_links[i].size();
+    }
+
+    for(size_t i = 0; ok && i < names.size(); ++i)
+    {
+        const uint32_t length = (uint32_t)names[i].size();
+        ok = fwrite(&length, sizeof(length), 1, out) == 1 &&
+             fwrite(names[i].data(), 1, length, out) == length;
+    }
+
+    return fclose(out) == 0 && ok;
+}
+
+
+bool t_palette_index::load(const char *path)
+{
+    FILE *in = fopen(path, "rb");
+    if(!in)
+    {
+        return false;
+    }
+
+    char magic[4];
+    uint32_t version = 0;
+    int32_t header[2];
+    uint64_t count = 0;
+    uint32_t entry_id = 0;
+    int32_t top = -1;
+
+    bool ok = fread(magic, 4, 1, in) == 1 && memcmp(magic, index_magic, 4) == 0 &&
+              fread(&version, sizeof(version), 1, in) == 1 && version == index_version &&
+              fread(header, sizeof(header), 1, in) == 1 && header[0] >= 2 &&
+              fread(&count, sizeof(count), 1, in) == 1 && count < 0xffffffffull &&
+              fread(&entry_id, sizeof(entry_id), 1, in) == 1 &&
+              fread(&top, sizeof(top), 1, in) == 1 && top <= max_index_level &&
+              (count == 0 ? top == -1 : (entry_id < count && top >= 0));
+
+    if(ok)
+    {
+        m = header[0];
+        ef_construction = header[1];
+        level_scale = 1.0 / log((double)m);
+        entry = entry_id;
+        max_level = top;
+
+        offsets.resize(count + 1);
+        ok = fread(&offsets[0], sizeof(uint64_t), offsets.size(), in) == offsets.size() && offsets[0] == 0;
+        for(size_t i = 1; ok && i < offsets.size(); ++i)
+        {
+            ok = offsets[i] >= offsets[i - 1];
+        }
+    }
+
+    if(ok)
+    {
+        colors.resize(offsets[count]);
+        levels.resize(count);
+        links0.resize(count * (1 + 2 * m));
+        ok = fread(colors.data(), sizeof(t_palette_color), colors.size(), in) == colors.size() &&
+             fread(levels.data(), sizeof(int), levels.size(), in) == levels.size() &&
+             fread(links0.data(), sizeof(uint32_t), links0.size(), in) == links0.size();
+    }
+
+    upper_links.clear();
+    for(size_t i = 0; ok && i < count; ++i)
+    {
+        ok = levels[i] >= 0 && levels[i] <= max_index_level;
+        if(ok)
+        {
+            upper_links.push_back(std::vector<uint32_t>((size_t)levels[i] * (1 + m)));
+            ok = fread(upper_links[i].data(), sizeof(uint32_t), upper_links[i].size(), in) == upper_links[i].size();
+        }
+    }
+
+    names.clear();
+    for(size_t i = 0; ok && i < count; ++i)
+    {
+        uint32_t length = 0;
+        ok = fread(&length, sizeof(length), 1, in) == 1 && length < (1u << 20);
+        if(ok)
+        {
+            std::string name(length, '\0');
+            ok = fread(&name[0], 1, length, in) == length;
+            names.push_back(name);
+        }
+    }
+
+    fclose(in);
+
+    //
+    // every link must point at a node that exists
+    //
+    ok = ok && (count == 0 || levels[entry] == max_level);
+    for(size_t i = 0; ok && i < count; ++i)
+    {
+        for(int l = 0; ok && l <= levels[i]; ++l)
+        {
+            const uint32_t *links = get_links((uint32_t)i, l);
+            ok = (int)links[0] <= get_max_links(l);
+            for(uint32_t j = 0; ok && j < links[0]; ++j)
+            {
+                ok = links[1 + j] < count && levels[links[1 + j]] >= l;
+            }
+        }
+    }
+
+    if(!ok)
+    {
+        names.clear();
+        colors.clear();
+        offsets.assign(1, 0);
+        levels.clear();
+        links0.clear();
+        upper_links.clear();
+        entry = 0;
+        max_level = -1;
+    }
+    return ok;
+}
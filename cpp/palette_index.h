@@ -0,0 +1,115 @@
+//
+// palette_index.h
+//
+// A k nearest neighbor index over palettes under get_palette_distance,
+// built as a hierarchical navigable small world (HNSW) graph.  Each
+// palette is a node linked to up to 'm' of its near neighbors on each of
+// its levels (2*m on level 0); a search descends greedily through the
+// sparse upper levels and then explores level 0 keeping the 'ef' best
+// candidates.  Larger 'ef' trades speed for recall.
+//
+// The palettes are stored flat, so an index of millions of palettes is a
+// handful of large arrays, and the index is saved and loaded as one file.
+//
+
+#ifndef PALETTE_INDEX_H
+#define PALETTE_INDEX_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include "palette.h"
+
+
+typedef struct t_palette_match
+{
+    uint32_t    id;             // order in which the palette was added
+    float       distance;
+} t_palette_match;
+
+
+class t_palette_index
+{
+public:
+    t_palette_index(int m = 16, int ef_construction = 100);
+
+    //
+    // Add one palette, or many on 'threads' workers (0 for one per cpu).
+    // Returns the id of the (first) palette added.  Not safe to call
+    // while searching.
+    //
+    uint32_t add(const std::string &name, const t_palette &palette);
+    uint32_t add(const std::vector<std::string> &names, const std::vector<t_palette> &palettes, int threads);
+
+    //
+    // The 'k' nearest palettes, nearest first.  Safe to call from
+    // many threads at once.
+    //
+    std::vector<t_palette_match> search(const t_palette &query, int k, int ef) const;
+
+    //
+    // The exact 'k' nearest palettes by comparing with every palette
+    //
+    std::vector<t_palette_match> search_exact(const t_palette &query, int k) const;
+
+    size_t size() const;
+    const std::string& get_name(uint32_t id) const;
+
+    bool save(const char *path) const;
+    bool load(const char *path);
+
+private:
+    typedef struct t_candidate
+    {
+        float       distance;
+        uint32_t    id;
+        bool operator<(const t_candidate &other) const { return distance < other.distance; }
+        bool operator>(const t_candidate &other) const { return distance > other.distance; }
+    } t_candidate;
+
+    float get_distance(const t_palette &query, uint32_t id) const;
+    float get_distance(uint32_t a, uint32_t b) const;
+
+    uint32_t* get_links(uint32_t id, int level);
+    const uint32_t* get_links(uint32_t id, int level) const;
+    int get_max_links(int level) const;
+
+    void append(const std::string &name, const t_palette &palette);
+    void insert(uint32_t id);
+    void search_level(const t_palette &query, uint32_t entry, int ef, int level,
+                      std::vector<t_candidate> &found) const;
+    void select_neighbors(std::vector<t_candidate> &candidates, int max_links) const;
+    void link(uint32_t from, uint32_t to, float distance, int level);
+
+    int                                 m;
+    int                                 ef_construction;
+    double                              level_scale;
+
+    std::vector<std::string>            names;
+    std::vector<t_palette_color>        colors;         // every palette's colors back to back
+    std::vector<uint64_t>               offsets;        // palette i is colors[offsets[i] .. offsets[i+1])
+
+    //
+    // Links are stored as a count followed by the ids.  Level 0 is one
+    // array of fixed size slots; the few nodes above level 0 have their
+    // upper levels in 'upper_links'.
+    //
+    std::vector<int>                    levels;
+    std::vector<uint32_t>               links0;
+    std::vector<std::vector<uint32_t> > upper_links;
+
+    uint32_t                            entry;
+    int                                 max_level;
+
+    //
+    // Concurrent inserts lock a node's links through a striped
+    // table of mutexes and the entry point through its own.
+    //
+    static const int                    lock_stripes = 4096;
+    mutable std::mutex                  node_locks[lock_stripes];
+    std::mutex                          entry_lock;
+};
+
+#endif
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#include "palette.h"
+#include "palette_index.h"
+
+
+void print_usage(const char *name)
+{
+    printf("Usage: %s build [options] <index> <palettes>\n", name);
+    printf("       %s query [options] <index> <k> <palettes>\n", name);
+    printf("Palettes are read one per line, as printed by getDominantColors --batch --weights:\n");
+    printf("  <name> #rrggbb:<weight> #rrggbb:<weight> ...\n");
+    printf("Use - to read them from stdin.\n");
+    printf("Options:\n");
+    printf("  --m=<n>                 links per node and level when building (default 16)\n");
+    printf("  --ef-construction=<n>   candidates kept while building (default 100)\n");
+    printf("  --threads=<n>           build threads (default one per cpu)\n");
+    printf("  --ef=<n>                candidates kept while querying (default 64)\n");
+    printf("  --exact                 compare each query with every palette instead\n");
+}
+
+
+//
+// Read palettes from a file, or stdin for "-"
+//
+static bool read_palettes(const char *path, std::vector<std::string> &names, std::vector<t_palette> &palettes)
+{
+    FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if(!in)
+    {
+        fprintf(stderr, "Unable to open the file: %s\n", path);
+        return false;
+    }
+
+    read_palette_file(in, names, palettes);
+    if(in != stdin)
+    {
+        fclose(in);
+    }
+    return true;
+}
+
+
+int main(int argc, char* argv[])
+{
+    int m = 16;
+    int ef_construction = 100;
+    int threads = 0;
+    int ef = 64;
+    bool exact = false;
+
+    std::vector<char*> args;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(strncmp(argv[i], "--m=", 4) == 0)
+        {
+            m = atoi(argv[i] + 4);
+        }
+        else if(strncmp(argv[i], "--ef-construction=", 18) == 0)
+        {
+            ef_construction = atoi(argv[i] + 18);
+        }
+        else if(strncmp(argv[i], "--threads=", 10) == 0)
+        {
+            threads = atoi(argv[i] + 10);
+        }
+        else if(strncmp(argv[i], "--ef=", 5) == 0)
+        {
+            ef = atoi(argv[i] + 5);
+        }
+        else if(strcmp(argv[i], "--exact") == 0)
+        {
+            exact = true;
+        }
+        else if(strncmp(argv[i], "--", 2) == 0)
+        {
+            printf("Unknown option: %s\n", argv[i]);
+            print_usage(argv[0]);
+            return 3;
+        }
+        else
+        {
+            args.push_back(argv[i]);
+        }
+    }
+
+    if(args.size() == 3 && strcmp(args[0], "build") == 0)
+    {
+        std::vector<std::string> names;
+        std::vector<t_palette> palettes;
+        if(!read_palettes(args[2], names, palettes))
+        {
+            return 1;
+        }
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        t_palette_index index(m, ef_construction);
+        index.add(names, palettes, threads);
+        std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+
+        if(!index.save(args[1]))
+        {
+            fprintf(stderr, "Unable to write the index: %s\n", args[1]);
+            return 1;
+        }
+        fprintf(stderr, "Indexed %zu palettes in %.2fs\n", index.size(), d.count());
+        return 0;
+    }
+
+    if(args.size() == 4 && strcmp(args[0], "query") == 0)
+    {
+        t_palette_index index;
+        if(!index.load(args[1]))
+        {
+            fprintf(stderr, "Unable to read the index: %s\n", args[1]);
+            return 1;
+        }
+
+        int k = atoi(args[2]);
+        if(k <= 0)
+        {
+            printf("k needs to be at least 1. You picked: %d\n", k);
+            return 2;
+        }
+
+        std::vector<std::string> names;
+        std::vector<t_palette> palettes;
+        if(!read_palettes(args[3], names, palettes))
+        {
+            return 1;
+        }
+
+        //
+        // one line per query: its name then the matches, nearest first
+        //
+        for(size_t i = 0; i < palettes.size(); ++i)
+        {
+            std::vector<t_palette_match> matches = exact ? index.search_exact(palettes[i], k)
+                                                         : index.search(palettes[i], k, ef);
+            printf("%s", names[i].c_str());
+            for(size_t j = 0; j < matches.size(); ++j)
+            {
+                printf(" %s:%.2f", index.get_name(matches[j].id).c_str(), matches[j].distance);
+            }
+            printf("\n");
+        }
+        return 0;
+    }
+
+    print_usage(argv[0]);
+    return args.empty() ? 0 : 1;
+}
@@ -0,0 +1,265 @@
+#include <string.h>
+#include <errno.h>
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "perf_counters.h"
+
+
+std::atomic<bool> g_perf_counting(false);
+
+static std::atomic<uint64_t> g_perf_runs[PERF_STAGE_COUNT];
+static std::atomic<uint64_t> g_perf_totals[PERF_STAGE_COUNT][PERF_COUNTER_COUNT];
+static std::atomic<bool> g_perf_available[PERF_COUNTER_COUNT];
+
+static const char *perf_stage_names[PERF_STAGE_COUNT] =
+{
+    "decode", "root stats", "split", "render", "encode"
+};
+
+
+//
+// The calling thread's counters, opened on its first stage and
+// closed when the thread exits.  fd -1 marks a counter that
+// couldn't be opened.
+//
+typedef struct t_thread_counters
+{
+    bool        opened;
+    int         fds[PERF_COUNTER_COUNT];
+    int         error;          // errno of the first counter that failed
+
+    t_thread_counters() : opened(false), error(0)
+    {
+        for(int i = 0; i < PERF_COUNTER_COUNT; ++i)
+        {
+            fds[i] = -1;
+        }
+    }
+
+    ~t_thread_counters()
+    {
+#if defined(__linux__)
+        for(int i = 0; i < PERF_COUNTER_COUNT; ++i)
+        {
+            if(fds[i] >= 0)
+            {
+                close(fds[i]);
+            }
+        }
+#endif
+    }
+} t_thread_counters;
+
+static thread_local t_thread_counters g_thread_counters;
+
+
+#if defined(__linux__)
+static int open_counter(uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    //
+    // this thread, on whatever cpu it runs
+    //
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+
+static t_thread_counters& get_thread_counters()
+{
+    t_thread_counters &counters = g_thread_counters;
+    if(!counters.opened)
+    {
+        counters.opened = true;
+#if defined(__linux__)
+        static const uint64_t configs[PERF_COUNTER_COUNT] =
+        {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES
+        };
+        for(int i = 0; i < PERF_COUNTER_COUNT; ++i)
+        {
+            counters.fds[i] = open_counter(configs[i]);
+            if(counters.fds[i] < 0 && counters.error == 0)
+            {
+                counters.error = errno;
+            }
+        }
+#else
+        counters.error = ENOSYS;
+#endif
+    }
+    return counters;
+}
+
+
+//
+// Read the thread's counters, scaled up for any time the kernel had
+// them multiplexed out.  Unavailable counters read 0.
+//
+static void read_thread_counters(const t_thread_counters &counters, uint64_t values[PERF_COUNTER_COUNT])
+{
+    for(int i = 0; i < PERF_COUNTER_COUNT; ++i)
+    {
+        values[i] = 0;
+#if defined(__linux__)
+        uint64_t data[3];
+        if(counters.fds[i] >= 0 && read(counters.fds[i], data, sizeof(data)) == (ssize_t)sizeof(data))
+        {
+            values[i] = data[2] > 0 && data[2] < data[1] ? (uint64_t)((double)data[0] * data[1] / data[2]) : data[0];
+        }
+#endif
+    }
+}
+
+
+bool start_perf_counters(const char **reason)
+{
+    for(int s = 0; s < PERF_STAGE_COUNT; ++s)
+    {
+        g_perf_runs[s].store(0);
+        for(int i = 0; i < PERF_COUNTER_COUNT; ++i)
+        {
+            g_perf_totals[s][i].store(0);
+        }
+    }
+
+    const t_thread_counters &counters = get_thread_counters();
+    bool any = false;
+    for(int i = 0; i < PERF_COUNTER_COUNT; ++i)
+    {
+        g_perf_available[i].store(counters.fds[i] >= 0);
+        any = any || counters.fds[i] >= 0;
+    }
+
+    if(!any)
+    {
+        if(reason)
+        {
+            *reason = counters.error == EACCES || counters.error == EPERM ?
+                          "not permitted, see /proc/sys/kernel/perf_event_paranoid" :
+                      counters.error == ENOENT || counters.error == EOPNOTSUPP ?
+                          "no hardware counters on this cpu or vm" :
+                      counters.error == ENOSYS ? "perf_event_open is not supported" : strerror(counters.error);
+        }
+        return false;
+    }
+
+    g_perf_counting.store(true);
+    return true;
+}
+
+
+void stop_perf_counters()
+{
+    g_perf_counting.store(false);
+}
+
+
+t_perf_counts get_perf_counts(t_perf_stage stage)
+{
+    t_perf_counts counts;
+    counts.runs = g_perf_runs[stage].load();
+    for(int i = 0; i < PERF_COUNTER_COUNT; ++i)
+    {
+        counts.values[i] = g_perf_totals[stage][i].load();
+        counts.available[i] = g_perf_available[i].load();
+    }
+    return counts;
+}
+
+
+//
+// Print a value, or '-' if it isn't available (negative)
+//
+static void print_perf_value(FILE *out, int width, int precision, double value)
+{
+    if(value < 0)
+    {
+        fprintf(out, " %*s", width, "-");
+    }
+    else
+    {
+        fprintf(out, " %*.*f", width, precision, value);
+    }
+}
+
+
+void print_perf_report(FILE *out)
+{
+    fprintf(out, "%-12s %8s %14s %14s %6s %12s %8s %12s %8s\n", "stage", "runs", "cycles", "instructions",
+            "ipc", "llc_misses", "llc_mpki", "br_misses", "br_mpki");
+
+    for(int s = 0; s < PERF_STAGE_COUNT; ++s)
+    {
+        const t_perf_counts counts = get_perf_counts((t_perf_stage)s);
+        if(counts.runs == 0)
+        {
+            continue;
+        }
+
+        double value[PERF_COUNTER_COUNT];
+        for(int i = 0; i < PERF_COUNTER_COUNT; ++i)
+        {
+            value[i] = counts.available[i] ? (double)counts.values[i] : -1;
+        }
+        const double instructions = value[PERF_INSTRUCTIONS];
+
+        fprintf(out, "%-12s %8llu", perf_stage_names[s], (unsigned long long)counts.runs);
+        print_perf_value(out, 14, 0, value[PERF_CYCLES]);
+        print_perf_value(out, 14, 0, instructions);
+        print_perf_value(out, 6, 2, instructions > 0 && value[PERF_CYCLES] > 0 ? instructions / value[PERF_CYCLES] : -1);
+        print_perf_value(out, 12, 0, value[PERF_LLC_MISSES]);
+        print_perf_value(out, 8, 2, instructions > 0 && value[PERF_LLC_MISSES] >= 0 ?
+                                        value[PERF_LLC_MISSES] * 1000 / instructions : -1);
+        print_perf_value(out, 12, 0, value[PERF_BRANCH_MISSES]);
+        print_perf_value(out, 8, 2, instructions > 0 && value[PERF_BRANCH_MISSES] >= 0 ?
+                                        value[PERF_BRANCH_MISSES] * 1000 / instructions : -1);
+        fprintf(out, "\n");
+    }
+}
+
+
+t_perf_scope::t_perf_scope(t_perf_stage stage)
+    : stage(stage), active(is_counting_perf())
+{
+    if(active)
+    {
+        read_thread_counters(get_thread_counters(), start);
+    }
+}
+
+
+t_perf_scope::~t_perf_scope()
+{
+    if(!active)
+    {
+        return;
+    }
+
+    uint64_t end[PERF_COUNTER_COUNT];
+    read_thread_counters(get_thread_counters(), end);
+    g_perf_runs[stage].fetch_add(1, std::memory_order_relaxed);
+    for(int i = 0; i < PERF_COUNTER_COUNT; ++i)
+    {
+        //
+        // scaled counts of a multiplexed counter can step back a little
+        //
+        g_perf_totals[stage][i].fetch_add(end[i] > start[i] ? end[i] - start[i] : 0, std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,87 @@
+//
+// perf_counters.h
+//
+// Optional hardware performance counters per pipeline stage: cycles,
+// instructions, last level cache misses and branch misses, read with
+// perf_event_open around each stage on the thread that runs it.  Each
+// thread opens its own counters on its first stage.  Counters the kernel
+// or the hardware won't provide, as in most containers and VMs, read as
+// unavailable and the rest of the pipeline is unaffected.
+//
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+
+
+typedef enum t_perf_stage
+{
+    PERF_DECODE,
+    PERF_ROOT_STATS,
+    PERF_SPLIT,
+    PERF_RENDER,
+    PERF_ENCODE,
+    PERF_STAGE_COUNT
+} t_perf_stage;
+
+
+typedef enum t_perf_counter
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_COUNTER_COUNT
+} t_perf_counter;
+
+
+typedef struct t_perf_counts
+{
+    uint64_t    runs;                           // times the stage was counted
+    uint64_t    values[PERF_COUNTER_COUNT];
+    bool        available[PERF_COUNTER_COUNT];  // false if the counter couldn't be opened
+} t_perf_counts;
+
+
+extern std::atomic<bool> g_perf_counting;
+
+inline bool is_counting_perf()
+{
+    return g_perf_counting.load(std::memory_order_relaxed);
+}
+
+//
+// Reset the totals and start counting.  Returns false, and leaves
+// counting off, if no counter can be opened on the calling thread;
+// 'reason' then describes why.
+//
+bool start_perf_counters(const char **reason = NULL);
+void stop_perf_counters();
+
+t_perf_counts get_perf_counts(t_perf_stage stage);
+
+//
+// Print the totals per stage with IPC and misses per thousand instructions
+//
+void print_perf_report(FILE *out);
+
+
+//
+// Counts the calling thread's events over the lifetime of the object
+//
+class t_perf_scope
+{
+public:
+    t_perf_scope(t_perf_stage stage);
+    ~t_perf_scope();
+
+private:
+    t_perf_stage    stage;
+    bool            active;
+    uint64_t        start[PERF_COUNTER_COUNT];
+};
+
+#endif
@@ -0,0 +1,76 @@
+#include <math.h>
+#include <vector>
+
+#include "saliency.h"
+
+
+static const int center_map_size = 128;
+static const int thumbnail_size = 64;
+static const int thumbnail_samples = 4;     // per cell along each axis
+
+
+cv::Mat get_center_weights(double sigma)
+{
+    cv::Mat map(center_map_size, center_map_size, CV_8UC1);
+    const double scale = 1.0 / (2 * sigma * sigma);
+    for(int y = 0; y < center_map_size; ++y)
+    {
+        const double dy = (y + 0.5) / (center_map_size / 2) - 1;
+        uchar *ptr = map.ptr<uchar>(y);
+        for(int x = 0; x < center_map_size; ++x)
+        {
+            const double dx = (x + 0.5) / (center_map_size / 2) - 1;
+            ptr[x] = (uchar)lrint(1 + 254 * exp(-(dx * dx + dy * dy) * scale));
+        }
+    }
+    return map;
+}
+
+
+cv::Mat get_spectral_residual_saliency(cv::Mat img)
+{
+    const int n = thumbnail_size;
+
+    //
+    // the gray thumbnail, each cell the mean of a grid of samples
+    //
+    cv::Mat samples, gray, thumbnail;
+    cv::resize(img, samples, cv::Size(n * thumbnail_samples, n * thumbnail_samples), 0, 0, cv::INTER_NEAREST);
+    cv::cvtColor(samples, gray, CV_BGR2GRAY);
+    cv::resize(gray, thumbnail, cv::Size(n, n), 0, 0, cv::INTER_AREA);
+    thumbnail.convertTo(thumbnail, CV_32F);
+
+    cv::Mat spectrum;
+    cv::dft(thumbnail, spectrum, cv::DFT_COMPLEX_OUTPUT);
+
+    //
+    // The spectral residual is the log amplitude less its local mean.
+    // Recombined with the original phase it leaves what is unexpected
+    // in the image.
+    //
+    std::vector<cv::Mat> planes;
+    cv::split(spectrum, planes);
+    cv::Mat amplitude, angle, local, residual;
+    cv::magnitude(planes[0], planes[1], amplitude);
+    cv::phase(planes[0], planes[1], angle);
+    cv::log(amplitude + cv::Scalar(1e-9), amplitude);
+    cv::blur(amplitude, local, cv::Size(3, 3));
+    cv::exp(amplitude - local, residual);
+    cv::polarToCart(residual, angle, planes[0], planes[1]);
+    cv::merge(planes, spectrum);
+    cv::idft(spectrum, spectrum);
+
+    //
+    // the saliency is the squared magnitude, smoothed with a gaussian
+    // and scaled to weights of 1-255
+    //
+    cv::split(spectrum, planes);
+    cv::Mat power;
+    cv::magnitude(planes[0], planes[1], power);
+    power = power.mul(power);
+    cv::GaussianBlur(power, power, cv::Size(13, 13), 2.5, 2.5, cv::BORDER_REPLICATE);
+
+    cv::Mat map;
+    cv::normalize(power, map, 1, 255, cv::NORM_MINMAX, CV_8U);
+    return map;
+}
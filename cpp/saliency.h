@@ -0,0 +1,30 @@
+//
+// saliency.h
+//
+// Pixel weight maps that favor the subject of an image over the rest of
+// the frame.  Maps are small CV_8UC1 images with weights from 1 to 255;
+// the statistics pass samples them at each pixel's relative position, so
+// a map never needs to match the image's size.
+//
+
+#ifndef SALIENCY_H
+#define SALIENCY_H
+
+#include <opencv2/opencv.hpp>
+
+
+//
+// A Gaussian falling off from the center of the frame.  'sigma' is in
+// units of half the frame, so at 0.5 the corners weigh about a fiftieth
+// of the center.
+//
+cv::Mat get_center_weights(double sigma);
+
+//
+// Spectral residual saliency (Hou and Zhang, 2007) of a 64x64 gray
+// thumbnail of the image.  The thumbnail is averaged from a sparse grid
+// of samples, so the cost doesn't grow with the image.
+//
+cv::Mat get_spectral_residual_saliency(cv::Mat img);
+
+#endif
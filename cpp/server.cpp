@@ -0,0 +1,445 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "server.h"
+#include "async.h"
+#include "metrics.h"
+
+
+static volatile sig_atomic_t g_stop_server = 0;
+
+static void on_stop_signal(int)
+{
+    g_stop_server = 1;
+}
+
+
+t_server_config get_default_server_config()
+{
+    t_server_config config;
+    config.port = 8077;
+    config.max_body_bytes = (size_t)256 * 1024 * 1024;
+    config.timeout = 0;
+    config.io_timeout = 30;
+    return config;
+}
+
+
+typedef struct t_http_request
+{
+    std::string             method;
+    std::string             path;
+    std::string             query;
+    std::vector<uchar>      body;
+} t_http_request;
+
+
+static bool send_all(int fd, const char *data, size_t size)
+{
+    while(size > 0)
+    {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+
+static void send_response(int fd, int code, const char *reason, const char *content_type, const std::string &body)
+{
+    char header[256];
+    snprintf(header, sizeof(header),
+             "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+             code, reason, content_type, body.size());
+    if(send_all(fd, header, strlen(header)))
+    {
+        send_all(fd, body.data(), body.size());
+    }
+}
+
+
+static void send_error(int fd, int code, const char *reason)
+{
+    send_response(fd, code, reason, "application/json", std::string("{\"error\":\"") + reason + "\"}\n");
+}
+
+
+//
+// Read the request line, the headers and a Content-Length body.
+// Returns the status code to fail with, or 0 on success.
+//
+static int read_request(int fd, const t_server_config &config, t_http_request &request)
+{
+    std::string head;
+    char buffer[16384];
+    size_t end = std::string::npos;
+    while(end == std::string::npos)
+    {
+        if(head.size() > 65536)
+        {
+            return 431;
+        }
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            return 400;
+        }
+        head.append(buffer, n);
+        end = head.find("\r\n\r\n");
+    }
+
+    //
+    // METHOD /path?query HTTP/1.1
+    //
+    const size_t line_end = head.find("\r\n");
+    const size_t method_end = head.find(' ');
+    const size_t target_end = method_end < line_end ? head.find(' ', method_end + 1) : std::string::npos;
+    if(target_end == std::string::npos || target_end > line_end)
+    {
+        return 400;
+    }
+    request.method = head.substr(0, method_end);
+    const std::string target = head.substr(method_end + 1, target_end - method_end - 1);
+    const size_t question = target.find('?');
+    request.path = target.substr(0, question);
+    request.query = question == std::string::npos ? "" : target.substr(question + 1);
+
+    size_t content_length = 0;
+    for(size_t pos = line_end + 2; pos < end; )
+    {
+        const size_t next = head.find("\r\n", pos);
+        const std::string line = head.substr(pos, next - pos);
+        if(strncasecmp(line.c_str(), "Content-Length:", 15) == 0)
+        {
+            content_length = strtoull(line.c_str() + 15, NULL, 10);
+        }
+        else if(strncasecmp(line.c_str(), "Transfer-Encoding:", 18) == 0)
+        {
+            return 411;
+        }
+        pos = next + 2;
+    }
+    if(content_length > config.max_body_bytes)
+    {
+        return 413;
+    }
+
+    //
+    // what followed the headers in the last read is the start of the body
+    //
+    request.body.assign(head.begin() + end + 4, head.end());
+    if(request.body.size() > content_length)
+    {
+        request.body.resize(content_length);
+    }
+    size_t received = request.body.size();
+    request.body.resize(content_length);
+    while(received < content_length)
+    {
+        ssize_t n = recv(fd, &request.body[received], content_length - received, 0);
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            return 400;
+        }
+        received += n;
+    }
+    return 0;
+}
+
+
+//
+// The value of 'name' in a query string, or false if it isn't there
+//
+static bool get_query_value(const std::string &query, const char *name, std::string &value)
+{
+    const size_t length = strlen(name);
+    for(size_t pos = 0; pos <= query.size(); )
+    {
+        size_t next = query.find('&', pos);
+        if(next == std::string::npos)
+        {
+            next = query.size();
+        }
+        if(query.compare(pos, length, name) == 0 && pos + length < next && query[pos + length] == '=')
+        {
+            value = query.substr(pos + length + 1, next - pos - length - 1);
+            return true;
+        }
+        pos = next + 1;
+    }
+    return false;
+}
+
+
+//
+// The gauges of the library pool and the memory budget, which the
+// metrics layer doesn't depend on
+//
+static void write_service_metrics(std::string &out)
+{
+    const t_memory_budget &budget = get_library_budget();
+    if(budget.get_budget() > 0)
+    {
+        append_metric_gauge(out, "dc_memory_budget_bytes", "The memory budget requests are admitted against.",
+                            (double)budget.get_budget());
+        append_metric_gauge(out, "dc_memory_admitted_bytes", "Estimated bytes of the requests admitted.",
+                            (double)budget.get_used());
+        append_metric_gauge(out, "dc_admission_queue_depth", "Requests waiting for the memory budget.",
+                            (double)budget.get_waiting());
+    }
+
+    const t_worker_pool &pool = get_library_pool();
+    out += "# HELP dc_queue_depth Requests queued on the library pool, not yet started.\n";
+    out += "# TYPE dc_queue_depth gauge\n";
+    append_metric(out, "dc_queue_depth{lane=\"interactive\"} %zu\n", pool.get_queued_count(PRIORITY_INTERACTIVE));
+    append_metric(out, "dc_queue_depth{lane=\"batch\"} %zu\n", pool.get_queued_count(PRIORITY_BATCH));
+
+    std::vector<t_pool_group_stats> stats = pool.get_stats();
+    size_t preemptions = 0;
+    for(size_t i = 0; i < stats.size(); ++i)
+    {
+        preemptions += stats[i].preemptions;
+    }
+    out += "# HELP dc_preemptions_total Interactive requests run at a batch request's split boundary.\n";
+    out += "# TYPE dc_preemptions_total counter\n";
+    append_metric(out, "dc_preemptions_total %zu\n", preemptions);
+
+    append_metric_gauge(out, "dc_active_workers", "Library pool workers running a request.", pool.get_active_count());
+    append_metric_gauge(out, "dc_workers", "Library pool workers.", pool.get_worker_count());
+}
+
+
+static void handle_colors(int fd, const t_server_config &config, t_http_request &request)
+{
+    std::string count;
+    t_find_request find;
+    find.count = get_query_value(request.query, "count", count) ? atoi(count.c_str()) : 0;
+    if(find.count <= 0 || find.count > get_max_color_count(NULL))
+    {
+        send_error(fd, 400, "count must be between 1-65536");
+        return;
+    }
+    if(request.body.empty())
+    {
+        send_error(fd, 400, "no image in the request body");
+        return;
+    }
+    std::string lane;
+    t_task_priority priority = PRIORITY_INTERACTIVE;
+    if(get_query_value(request.query, "priority", lane))
+    {
+        if(lane == "batch")
+        {
+            priority = PRIORITY_BATCH;
+        }
+        else if(lane != "interactive")
+        {
+            send_error(fd, 400, "priority must be interactive or batch");
+            return;
+        }
+    }
+    find.encoded.swap(request.body);
+
+    t_find_result result = find_dominant_colors_async(find, create_cancel_token(config.timeout), priority).get();
+
+    static const char *statuses[] = { "ok", "cancelled", "timed_out", "decode_failed", "failed" };
+    if(result.status == FIND_DECODE_FAILED)
+    {
+        send_error(fd, 415, "the image can't be decoded");
+        return;
+    }
+    if(result.status == FIND_FAILED)
+    {
+        send_error(fd, 500, "the request failed");
+        return;
+    }
+
+    //
+    // colors as hex RGB; OpenCV stores them as BGR
+    //
+    std::string body = std::string("{\"status\":\"") + statuses[result.status] + "\",\"colors\":[";
+    char item[64];
+    for(size_t i = 0; i < result.colors.size(); ++i)
+    {
+        snprintf(item, sizeof(item), "%s\"#%02x%02x%02x\"", i > 0 ? "," : "",
+                 result.colors[i][2], result.colors[i][1], result.colors[i][0]);
+        body += item;
+    }
+    body += "],\"weights\":[";
+    for(size_t i = 0; i < result.weights.size(); ++i)
+    {
+        snprintf(item, sizeof(item), "%s%.6f", i > 0 ? "," : "", result.weights[i]);
+        body += item;
+    }
+    snprintf(item, sizeof(item), "],\"scale\":%d}\n", result.scale);
+    body += item;
+    send_response(fd, 200, "OK", "application/json", body);
+}
+
+
+static void handle_connection(int fd, const t_server_config &config)
+{
+    t_http_request request;
+    const int error = read_request(fd, config, request);
+    if(error)
+    {
+        send_error(fd, error, error == 413 ? "image too large" : error == 411 ? "Content-Length required" :
+                              error == 431 ? "headers too large" : "bad request");
+    }
+    else if(request.path == "/metrics")
+    {
+        if(request.method != "GET")
+        {
+            send_error(fd, 405, "method not allowed");
+        }
+        else
+        {
+            std::string text;
+            write_metrics(text, write_service_metrics);
+            send_response(fd, 200, "OK", "text/plain; version=0.0.4", text);
+        }
+    }
+    else if(request.path == "/colors")
+    {
+        if(request.method != "POST")
+        {
+            send_error(fd, 405, "method not allowed");
+        }
+        else
+        {
+            handle_colors(fd, config, request);
+        }
+    }
+    else
+    {
+        send_error(fd, 404, "not found");
+    }
+    close(fd);
+}
+
+
+bool run_server(const t_server_config &config)
+{
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if(listener < 0)
+    {
+        return false;
+    }
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    //
+    // localhost only; the service has no authentication
+    //
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t)config.port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 128) != 0)
+    {
+        close(listener);
+        return false;
+    }
+
+    g_stop_server = 0;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_stop_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    start_metrics();
+    get_library_pool();
+
+    //
+    // Open connections, so the server can wait for them to be answered
+    // before it returns
+    //
+    std::mutex mutex;
+    std::condition_variable closed;
+    int connections = 0;
+
+    struct timeval io_timeout;
+    io_timeout.tv_sec = (time_t)config.io_timeout;
+    io_timeout.tv_usec = (suseconds_t)((config.io_timeout - io_timeout.tv_sec) * 1e6);
+
+    while(!g_stop_server)
+    {
+        //
+        // wake up now and then to check for a stop signal, which
+        // may have been delivered to another thread
+        //
+        struct pollfd pfd;
+        pfd.fd = listener;
+        pfd.events = POLLIN;
+        if(poll(&pfd, 1, 200) <= 0)
+        {
+            continue;
+        }
+
+        int fd = accept(listener, NULL, NULL);
+        if(fd < 0)
+        {
+            continue;
+        }
+        if(config.io_timeout > 0)
+        {
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &io_timeout, sizeof(io_timeout));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &io_timeout, sizeof(io_timeout));
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            connections++;
+        }
+        std::thread([fd, &config, &mutex, &closed, &connections]()
+        {
+            handle_connection(fd, config);
+            std::lock_guard<std::mutex> lock(mutex);
+            connections--;
+            closed.notify_all();
+        }).detach();
+    }
+
+    close(listener);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while(connections > 0)
+    {
+        closed.wait(lock);
+    }
+    return true;
+}
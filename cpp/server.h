@@ -0,0 +1,49 @@
+//
+// server.h
+//
+// Runs the dominant color engine as a long-running service: a small
+// HTTP/1.1 server bound to localhost.  Requests are decoded and split on
+// the library pool (see async.h); each connection is read and answered on
+// its own thread, which only waits for the result.
+//
+//   POST /colors?count=<n>[&priority=batch]
+//                            body: an encoded image (PNG, JPEG, ...)
+//                            reply: {"status":"ok","colors":["#rrggbb",...],
+//                                    "weights":[...],"scale":1}
+//                            scale > 1 if the image was decoded at 1/scale
+//                            to fit the memory budget; batch requests
+//                            yield to interactive ones, the default
+//   GET  /metrics            the metrics of metrics.h in the Prometheus
+//                            text format
+//
+// One request per connection; the server closes it after the reply.
+//
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stddef.h>
+
+
+typedef struct t_server_config
+{
+    int         port;               // on 127.0.0.1
+    size_t      max_body_bytes;     // larger images are refused with 413
+    double      timeout;            // seconds per request, 0 for none
+    double      io_timeout;         // seconds a client may take to send or receive
+} t_server_config;
+
+
+//
+// The default configuration: port 8077, 256MB images, no request
+// timeout and 30 seconds for a client's socket I/O.
+//
+t_server_config get_default_server_config();
+
+//
+// Serve until SIGINT or SIGTERM, then wait for the open connections to
+// be answered.  Returns false if the port can't be bound.
+//
+bool run_server(const t_server_config &config);
+
+#endif
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <chrono>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+#include "trace.h"
+
+
+std::atomic<bool> g_tracing(false);
+
+
+typedef struct t_trace_event
+{
+    const char      *name;
+    const char      *arg_name;
+    int64_t         arg;
+    int64_t         image;
+    uint64_t        start;
+    uint64_t        end;
+} t_trace_event;
+
+
+//
+// One thread's events.  Only the owning thread writes to the ring, so
+// 'written' is a plain counter published for write_trace.
+//
+typedef struct t_trace_ring
+{
+    std::vector<t_trace_event>  events;
+    std::atomic<uint64_t>       written;
+    int                         tid;
+} t_trace_ring;
+
+
+//
+// Rings live until exit, so a thread may record to its ring without
+// holding the lock even while another thread registers a new one
+//
+static std::mutex g_trace_mutex;
+static std::vector<std::unique_ptr<t_trace_ring> > g_trace_rings;
+static size_t g_trace_capacity = 16384;
+static std::atomic<int64_t> g_trace_epoch(0);
+
+static thread_local t_trace_ring *g_thread_ring = NULL;
+static thread_local int64_t g_thread_image = -1;
+
+
+static int64_t get_steady_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+void start_trace(size_t events_per_thread)
+{
+    std::lock_guard<std::mutex> lock(g_trace_mutex);
+    g_trace_capacity = std::max(events_per_thread, (size_t)1);
+    for(size_t i = 0; i < g_trace_rings.size(); ++i)
+    {
+        g_trace_rings[i]->events.assign(g_trace_capacity, t_trace_event());
+        g_trace_rings[i]->written.store(0);
+    }
+    g_trace_epoch.store(get_steady_ns());
+    g_tracing.store(true);
+}
+
+
+void stop_trace()
+{
+    g_tracing.store(false);
+}
+
+
+uint64_t get_trace_time()
+{
+    return (uint64_t)(get_steady_ns() - g_trace_epoch.load(std::memory_order_relaxed));
+}
+
+
+void set_trace_image(int64_t image)
+{
+    g_thread_image = image;
+}
+
+
+static t_trace_ring* get_thread_ring()
+{
+    if(!g_thread_ring)
+    {
+        std::lock_guard<std::mutex> lock(g_trace_mutex);
+        g_trace_rings.push_back(std::unique_ptr<t_trace_ring>(new t_trace_ring()));
+        g_thread_ring = g_trace_rings.back().get();
+        g_thread_ring->events.assign(g_trace_capacity, t_trace_event());
+        g_thread_ring->written.store(0);
+        g_thread_ring->tid = (int)g_trace_rings.size();
+    }
+    return g_thread_ring;
+}
+
+
+void trace_event(const char *name, uint64_t start, uint64_t end, const char *arg_name, int64_t arg)
+{
+    if(!is_tracing())
+    {
+        return;
+    }
+
+    t_trace_ring *ring = get_thread_ring();
+    const uint64_t n = ring->written.load(std::memory_order_relaxed);
+    t_trace_event &event = ring->events[n % ring->events.size()];
+    event.name = name;
+    event.arg_name = arg_name;
+    event.arg = arg;
+    event.image = g_thread_image;
+    event.start = start;
+    event.end = end;
+    ring->written.store(n + 1, std::memory_order_release);
+}
+
+
+bool write_trace(const char *path)
+{
+    FILE *out = fopen(path, "w");
+    if(!out)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(g_trace_mutex);
+    fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    for(size_t r = 0; r < g_trace_rings.size(); ++r)
+    {
+        const t_trace_ring &ring = *g_trace_rings[r];
+        fprintf(out, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                "\"args\": {\"name\": \"thread %d\"}}", first ? "" : ",\n", ring.tid, ring.tid);
+        first = false;
+
+        //
+        // the ring holds the last 'capacity' events, oldest first from 'written'
+        //
+        const uint64_t written = ring.written.load(std::memory_order_acquire);
+        const uint64_t count = std::min(written, (uint64_t)ring.events.size());
+        for(uint64_t i = written - count; i < written; ++i)
+        {
+            const t_trace_event &event = ring.events[i % ring.events.size()];
+            fprintf(out, ",\n{\"name\": \"%s\", \"cat\": \"dominant_colors\", \"ph\": \"X\", \"pid\": 1, "
+                    "\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": {",
+                    event.name, ring.tid, event.start / 1000.0, (event.end - event.start) / 1000.0);
+
+            const char *separator = "";
+            if(event.image >= 0)
+            {
+                fprintf(out, "\"image\": %lld", (long long)event.image);
+                separator = ", ";
+            }
+            if(event.arg_name)
+            {
+                fprintf(out, "%s\"%s\": %lld", separator, event.arg_name, (long long)event.arg);
+            }
+            fprintf(out, "}}");
+        }
+    }
+    fprintf(out, "\n]}\n");
+    return fclose(out) == 0;
+}
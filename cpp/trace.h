@@ -0,0 +1,94 @@
+//
+// trace.h
+//
+// An optional timeline of the pipeline in the Chrome trace event format,
+// for chrome://tracing and Perfetto.  Every thread records complete events
+// into its own fixed size ring, so recording takes no lock and, after the
+// thread's first event, no allocation.  When a ring fills its oldest
+// events are overwritten.  Tracing is off until start_trace; until then a
+// span costs one relaxed atomic load.
+//
+// Events carry the image the thread is working on, set with
+// set_trace_image, so one image can be followed from its queue wait to
+// its last split.
+//
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+
+extern std::atomic<bool> g_tracing;
+
+inline bool is_tracing()
+{
+    return g_tracing.load(std::memory_order_relaxed);
+}
+
+//
+// Start a new trace, dropping any events recorded before.  Each thread
+// keeps its last 'events_per_thread' events.  Call while no traced work
+// is running.
+//
+void start_trace(size_t events_per_thread = 16384);
+
+//
+// Stop recording.  The events are kept for write_trace.
+//
+void stop_trace();
+
+//
+// Write the recorded events as a Chrome JSON trace.  Call once the
+// traced work has finished.  Returns false if the file can't be written.
+//
+bool write_trace(const char *path);
+
+//
+// Nanoseconds since the trace started
+//
+uint64_t get_trace_time();
+
+//
+// Tag the calling thread's events with an image, -1 for none
+//
+void set_trace_image(int64_t image);
+
+//
+// Record a span from 'start' to 'end' on the calling thread.  'name' and
+// 'arg_name' must be string literals, or otherwise outlive the trace.
+//
+void trace_event(const char *name, uint64_t start, uint64_t end,
+                 const char *arg_name = NULL, int64_t arg = 0);
+
+
+//
+// A span covering the lifetime of the object
+//
+class t_trace_span
+{
+public:
+    t_trace_span(const char *name, const char *arg_name = NULL, int64_t arg = 0)
+        : name(name), arg_name(arg_name), arg(arg), active(is_tracing()), start(active ? get_trace_time() : 0)
+    {
+    }
+
+    ~t_trace_span()
+    {
+        if(active && is_tracing())
+        {
+            trace_event(name, start, get_trace_time(), arg_name, arg);
+        }
+    }
+
+private:
+    const char      *name;
+    const char      *arg_name;
+    int64_t         arg;
+    bool            active;
+    uint64_t        start;
+};
+
+#endif
@@ -0,0 +1,361 @@
+#include <chrono>
+
+#include "worker_pool.h"
+#include "dominant_colors.h"
+
+
+//
+// The virtual time a lane of weight 1 advances per task
+//
+static const uint64_t pass_unit = 1 << 20;
+
+//
+// The lane of the task the calling worker is running, and its
+// group; -1 on threads that aren't running a task
+//
+static thread_local int g_task_priority = -1;
+static thread_local int g_task_group = -1;
+
+
+t_worker_pool::t_worker_pool(int thread_count, bool numa)
+    : pending(0), interactive_queued(0), virtual_time(0), next_group(0), stopping(false)
+{
+    for(int p = 0; p < PRIORITY_COUNT; ++p)
+    {
+        queued[p] = 0;
+        pass[p] = 0;
+    }
+    weights[PRIORITY_INTERACTIVE] = 4;
+    weights[PRIORITY_BATCH] = 1;
+
+    std::vector<t_numa_node> nodes = get_numa_nodes();
+
+    //
+    // Without NUMA all cpus form a single group
+    //
+    if(!numa && nodes.size() > 1)
+    {
+        t_numa_node all;
+        all.id = 0;
+        for(size_t i = 0; i < nodes.size(); ++i)
+        {
+            all.cpus.insert(all.cpus.end(), nodes[i].cpus.begin(), nodes[i].cpus.end());
+        }
+        nodes = std::vector<t_numa_node>(1, all);
+    }
+
+    size_t total_cpus = 0;
+    for(size_t i = 0; i < nodes.size(); ++i)
+    {
+        total_cpus += nodes[i].cpus.size();
+    }
+    if(total_cpus == 0)
+    {
+        total_cpus = 1;
+    }
+    if(thread_count <= 0)
+    {
+        thread_count = (int)total_cpus;
+    }
+
+    //
+    // Split the workers over the nodes in proportion to their cpus.
+    // Every node gets at least one worker.
+    //
+    groups.resize(nodes.size());
+    int assigned = 0;
+    for(size_t i = 0; i < nodes.size(); ++i)
+    {
+        t_group &g = groups[i];
+        g.node = nodes[i];
+        g.stats.node = nodes[i].id;
+        g.stats.workers = (int)(thread_count * nodes[i].cpus.size() / total_cpus);
+        if(g.stats.workers < 1)
+        {
+            g.stats.workers = 1;
+        }
+        g.stats.pinned = false;
+        g.stats.tasks = 0;
+        g.stats.stolen = 0;
+        g.stats.preemptions = 0;
+        g.stats.busy_seconds = 0;
+        assigned += g.stats.workers;
+    }
+
+    //
+    // hand out what rounding left over
+    //
+    for(size_t i = 0; assigned < thread_count; i = (i + 1) % groups.size())
+    {
+        groups[i].stats.workers++;
+        assigned++;
+    }
+
+    for(size_t i = 0; i < groups.size(); ++i)
+    {
+        for(int w = 0; w < groups[i].stats.workers; ++w)
+        {
+            threads.push_back(std::thread(&t_worker_pool::worker_main, this, (int)i));
+        }
+    }
+}
+
+
+t_worker_pool::~t_worker_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    work_ready.notify_all();
+
+    for(size_t i = 0; i < threads.size(); ++i)
+    {
+        threads[i].join();
+    }
+}
+
+
+int t_worker_pool::submit(const t_task &task, int group, t_task_priority priority)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(group < 0 || group >= (int)groups.size())
+        {
+            group = (int)(next_group++ % groups.size());
+        }
+
+        //
+        // a lane that was idle starts at the current virtual time,
+        // so it can't bank a share for the time it had no work
+        //
+        if(queued[priority] == 0 && pass[priority] < virtual_time)
+        {
+            pass[priority] = virtual_time;
+        }
+
+        groups[group].queues[priority].push_back(task);
+        queued[priority]++;
+        pending++;
+        if(priority == PRIORITY_INTERACTIVE)
+        {
+            interactive_queued.store(queued[priority], std::memory_order_relaxed);
+        }
+    }
+    work_ready.notify_all();
+    return group;
+}
+
+
+void t_worker_pool::set_priority_weight(t_task_priority priority, int weight)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    weights[priority] = weight < 1 ? 1 : weight;
+}
+
+
+void t_worker_pool::wait_idle()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while(pending > 0)
+    {
+        idle.wait(lock);
+    }
+}
+
+
+int t_worker_pool::get_group_count() const
+{
+    return (int)groups.size();
+}
+
+
+int t_worker_pool::get_worker_count() const
+{
+    return (int)threads.size();
+}
+
+
+size_t t_worker_pool::get_queued_count() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return queued[PRIORITY_INTERACTIVE] + queued[PRIORITY_BATCH];
+}
+
+
+size_t t_worker_pool::get_queued_count(t_task_priority priority) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return queued[priority];
+}
+
+
+int t_worker_pool::get_active_count() const
+{
+    //
+    // 'pending' counts the queued tasks and those running, including
+    // a batch task preempted on a worker's stack
+    //
+    std::lock_guard<std::mutex> lock(mutex);
+    return (int)(pending - queued[PRIORITY_INTERACTIVE] - queued[PRIORITY_BATCH]);
+}
+
+
+std::vector<t_pool_group_stats> t_worker_pool::get_stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<t_pool_group_stats> stats;
+    for(size_t i = 0; i < groups.size(); ++i)
+    {
+        stats.push_back(groups[i].stats);
+    }
+    return stats;
+}
+
+
+//
+// Take the next task for 'group' from the lane with the smallest pass:
+// from its own queue first, then from the back of the other groups'
+// queues.  With 'interactive_only' nothing is taken unless the
+// interactive lane is next.  Must be called with the mutex held.
+//
+bool t_worker_pool::pop_task(int group, bool interactive_only, t_task &task, bool &stolen, t_task_priority &priority)
+{
+    int lane = -1;
+    for(int p = 0; p < PRIORITY_COUNT; ++p)
+    {
+        if(queued[p] > 0 && (lane < 0 || pass[p] < pass[lane]))
+        {
+            lane = p;
+        }
+    }
+    if(lane < 0 || (interactive_only && lane != PRIORITY_INTERACTIVE))
+    {
+        return false;
+    }
+
+    std::deque<t_task> *queue = &groups[group].queues[lane];
+    stolen = false;
+    for(size_t i = 1; queue->empty() && i < groups.size(); ++i)
+    {
+        queue = &groups[(group + i) % groups.size()].queues[lane];
+        stolen = true;
+    }
+    if(stolen)
+    {
+        task = queue->back();
+        queue->pop_back();
+    }
+    else
+    {
+        task = queue->front();
+        queue->pop_front();
+    }
+
+    priority = (t_task_priority)lane;
+    queued[lane]--;
+    if(lane == PRIORITY_INTERACTIVE)
+    {
+        interactive_queued.store(queued[lane], std::memory_order_relaxed);
+    }
+    virtual_time = pass[lane];
+    pass[lane] += pass_unit / weights[lane];
+    return true;
+}
+
+
+//
+// Called by the split of the task a worker is running.  A batch task
+// gives way to the interactive tasks that are next in line; they run
+// here, on the worker's stack, and the split then carries on.
+//
+void t_worker_pool::run_at_split_boundary(void *context)
+{
+    t_worker_pool *pool = (t_worker_pool*)context;
+    if(g_task_priority != PRIORITY_BATCH || pool->interactive_queued.load(std::memory_order_relaxed) == 0)
+    {
+        return;
+    }
+
+    const int group = g_task_group;
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    t_task task;
+    bool stolen = false;
+    t_task_priority priority;
+    while(pool->pop_task(group, true, task, stolen, priority))
+    {
+        lock.unlock();
+        g_task_priority = PRIORITY_INTERACTIVE;
+        task(group);
+        g_task_priority = PRIORITY_BATCH;
+        lock.lock();
+
+        //
+        // the time is already counted as the batch task's
+        //
+        pool->groups[group].stats.tasks++;
+        pool->groups[group].stats.preemptions++;
+        if(stolen)
+        {
+            pool->groups[group].stats.stolen++;
+        }
+        pool->pending--;
+    }
+}
+
+
+void t_worker_pool::worker_main(int group)
+{
+    //
+    // Pin to the node so that everything this worker allocates
+    // is first touched, and placed, on the node's memory.  With a
+    // single group there is nothing to keep apart and the OS is
+    // left to schedule the workers.
+    //
+    if(groups.size() > 1 && pin_thread_to_cpus(groups[group].node.cpus))
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        groups[group].stats.pinned = true;
+    }
+
+    g_task_group = group;
+    set_split_boundary_hook(run_at_split_boundary, this);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true)
+    {
+        t_task task;
+        bool stolen = false;
+        t_task_priority priority;
+        if(!pop_task(group, false, task, stolen, priority))
+        {
+            if(stopping)
+            {
+                return;
+            }
+            work_ready.wait(lock);
+            continue;
+        }
+
+        lock.unlock();
+        g_task_priority = priority;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        task(group);
+        std::chrono::duration<double> busy = std::chrono::steady_clock::now() - start;
+        g_task_priority = -1;
+        lock.lock();
+
+        groups[group].stats.tasks++;
+        groups[group].stats.busy_seconds += busy.count();
+        if(stolen)
+        {
+            groups[group].stats.stolen++;
+        }
+
+        pending--;
+        if(pending == 0)
+        {
+            idle.notify_all();
+        }
+    }
+}
@@ -0,0 +1,132 @@
+//
+// worker_pool.h
+//
+// A pool of worker threads grouped by NUMA node.  Each group has its own
+// queue and its workers are pinned to the cpus of the node, so a task runs
+// start to finish on one node and the buffers it allocates are first
+// touched (and therefore placed) on that node.  An idle group steals whole
+// tasks from the other groups before it sleeps; a stolen task has not
+// started yet, so it still runs entirely on the thief's node.
+//
+// On a single node host, or with NUMA disabled, there is one group and the
+// workers are not pinned.
+//
+// Tasks are queued in priority lanes, interactive and batch.  Free workers
+// take the next task by weighted fair queuing: each lane advances its own
+// virtual time by 1/weight per task started and the lane furthest behind
+// goes next, so with weights 4:1 a backlogged batch lane still starts one
+// task in five.  A batch task is also preempted at its split boundaries
+// (see set_split_boundary_hook): when the interactive lane is next in line
+// the worker runs interactive tasks there, on its own stack, and then
+// resumes the split.
+//
+
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+
+#include "numa.h"
+
+
+typedef enum t_task_priority
+{
+    PRIORITY_INTERACTIVE,   // latency sensitive, may preempt batch tasks
+    PRIORITY_BATCH,         // throughput work that keeps the cores busy
+    PRIORITY_COUNT
+} t_task_priority;
+
+
+typedef struct t_pool_group_stats
+{
+    int         node;               // NUMA node id of the group
+    int         workers;
+    bool        pinned;             // workers are pinned to the node's cpus
+    size_t      tasks;              // tasks run by the group
+    size_t      stolen;             // of those, tasks taken from another group
+    size_t      preemptions;        // of those, tasks run at a batch task's split boundary
+    double      busy_seconds;       // summed over the group's workers
+} t_pool_group_stats;
+
+
+class t_worker_pool
+{
+public:
+    //
+    // The task is called with the index of the group it runs on
+    //
+    typedef std::function<void(int group)> t_task;
+
+    //
+    // 'threads' is the total worker count, 0 for one per cpu.
+    // With 'numa' set the workers are split over the NUMA nodes
+    // in proportion to their cpus and pinned to them.
+    //
+    t_worker_pool(int threads, bool numa);
+    ~t_worker_pool();
+
+    //
+    // Queue a task on a group.  With group < 0 the groups are used
+    // round robin.  Returns the group the task was queued on.
+    //
+    int submit(const t_task &task, int group = -1, t_task_priority priority = PRIORITY_INTERACTIVE);
+
+    //
+    // The lane's share of the task starts when every lane is backlogged.
+    // The defaults are 4 for interactive and 1 for batch.
+    //
+    void set_priority_weight(t_task_priority priority, int weight);
+
+    //
+    // Block until every queued task has finished
+    //
+    void wait_idle();
+
+    int get_group_count() const;
+    int get_worker_count() const;
+
+    //
+    // Tasks queued and not yet started, and workers running a task
+    //
+    size_t get_queued_count() const;
+    size_t get_queued_count(t_task_priority priority) const;
+    int get_active_count() const;
+
+    std::vector<t_pool_group_stats> get_stats() const;
+
+private:
+    typedef struct t_group
+    {
+        t_numa_node             node;
+        std::deque<t_task>      queues[PRIORITY_COUNT];
+        t_pool_group_stats      stats;
+    } t_group;
+
+    void worker_main(int group);
+    bool pop_task(int group, bool interactive_only, t_task &task, bool &stolen, t_task_priority &priority);
+    static void run_at_split_boundary(void *context);
+
+    std::vector<t_group>        groups;
+    std::vector<std::thread>    threads;
+    mutable std::mutex          mutex;
+    std::condition_variable     work_ready;
+    std::condition_variable     idle;
+    size_t                      pending;
+    size_t                      queued[PRIORITY_COUNT];
+    std::atomic<size_t>         interactive_queued;     // read without the lock at split boundaries
+    int                         weights[PRIORITY_COUNT];
+    uint64_t                    pass[PRIORITY_COUNT];   // each lane's virtual time
+    uint64_t                    virtual_time;           // the pass of the last task started
+    size_t                      next_group;
+    bool                        stopping;
+};
+
+#endif
@@ -0,0 +1,296 @@
+/*
+ * dominant_colors_module.c
+ *
+ * Python bindings over the C ABI in cpp/dominant_colors_c.h.
+ *
+ * Images are taken through the buffer protocol, so NumPy arrays (and
+ * anything else exporting an 8-bit height x width x 3 buffer) are read in
+ * place without a copy.  The GIL is released while the engine runs.
+ *
+ *   import dominant_colors
+ *   colors, weights = dominant_colors.find(array, 6)
+ *   results = dominant_colors.find_batch([a, b, c], 6, threads=8)
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dominant_colors_c.h"
+
+
+/*
+ * Get a read only view of 'obj' and describe it as a dc_image.  Rows may
+ * be padded but the pixels of a row must be packed, as they are for a
+ * C-contiguous array or a slice of rows.  Sets a Python error and
+ * returns 0 if the buffer can't be used without copying.
+ */
+static int get_image(PyObject *obj, Py_buffer *view, dc_image *image)
+{
+    if(PyObject_GetBuffer(obj, view, PyBUF_RECORDS_RO) != 0)
+    {
+        return 0;
+    }
+
+    const char *format = view->format ? view->format : "B";
+    if(format[0] == '<' || format[0] == '>' || format[0] == '=' || format[0] == '|' || format[0] == '@')
+    {
+        format++;
+    }
+
+    if(view->ndim != 3 || view->shape[2] != 3 || view->itemsize != 1 || strcmp(format, "B") != 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "expected a uint8 array of shape (height, width, 3)");
+        PyBuffer_Release(view);
+        return 0;
+    }
+
+    if(view->strides[2] != 1 || view->strides[1] != 3 || view->strides[0] < view->shape[1] * 3)
+    {
+        PyErr_SetString(PyExc_ValueError,
+                        "the pixels of each row must be packed; use numpy.ascontiguousarray");
+        PyBuffer_Release(view);
+        return 0;
+    }
+
+    if(view->shape[0] <= 0 || view->shape[1] <= 0 || view->shape[0] > 0x7fffffff || view->shape[1] > 0x7fffffff)
+    {
+        PyErr_SetString(PyExc_ValueError, "the image is empty or too large");
+        PyBuffer_Release(view);
+        return 0;
+    }
+
+    image->pixels = (const unsigned char*)view->buf;
+    image->height = (int)view->shape[0];
+    image->width = (int)view->shape[1];
+    image->stride = (size_t)view->strides[0];
+    return 1;
+}
+
+
+/*
+ * Build the (colors, weights) result for one image
+ */
+static PyObject* make_result(const unsigned char *colors, const double *weights, int found)
+{
+    PyObject *color_list = PyList_New(found);
+    PyObject *weight_list = PyList_New(found);
+    if(!color_list || !weight_list)
+    {
+        Py_XDECREF(color_list);
+        Py_XDECREF(weight_list);
+        return NULL;
+    }
+
+    for(int i = 0; i < found; ++i)
+    {
+        PyList_SET_ITEM(color_list, i, Py_BuildValue("(BBB)", colors[i*3], colors[i*3 + 1], colors[i*3 + 2]));
+        PyList_SET_ITEM(weight_list, i, PyFloat_FromDouble(weights[i]));
+    }
+
+    PyObject *ret = PyTuple_Pack(2, color_list, weight_list);
+    Py_DECREF(color_list);
+    Py_DECREF(weight_list);
+    return ret;
+}
+
+
+static int check_count(int count)
+{
+    if(count <= 0 || count > 65536)
+    {
+        PyErr_SetString(PyExc_ValueError, "count must be between 1 and 65536");
+        return 0;
+    }
+    return 1;
+}
+
+
+PyDoc_STRVAR(find_doc,
+"find(image, count) -> (colors, weights)\n\n"
+"Find up to 'count' dominant colors of an 8-bit (height, width, 3) image.\n"
+"Colors are tuples in the channel order of the image; weights are the\n"
+"fraction of the pixels closest to each color.");
+
+static PyObject* py_find(PyObject *self, PyObject *args)
+{
+    PyObject *obj;
+    int count;
+    if(!PyArg_ParseTuple(args, "Oi:find", &obj, &count) || !check_count(count))
+    {
+        return NULL;
+    }
+
+    Py_buffer view;
+    dc_image image;
+    if(!get_image(obj, &view, &image))
+    {
+        return NULL;
+    }
+
+    size_t class_map_size = dc_class_map_size(image.width, image.height, count);
+    size_t scratch_size = dc_scratch_size(count);
+    unsigned char *colors = (unsigned char*)malloc(count * 3);
+    double *weights = (double*)malloc(count * sizeof(double));
+    unsigned char *class_map = (unsigned char*)malloc(class_map_size);
+    void *scratch = malloc(scratch_size);
+
+    int found = DC_ERROR_INTERNAL;
+    if(colors && weights && class_map && scratch)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        found = dc_find_dominant_colors(&image, count, colors, weights,
+                                        class_map, class_map_size, scratch, scratch_size);
+        Py_END_ALLOW_THREADS
+    }
+
+    PyObject *ret = NULL;
+    if(found > 0)
+    {
+        ret = make_result(colors, weights, found);
+    }
+    else
+    {
+        PyErr_Format(PyExc_RuntimeError, "dominant color search failed (%d)", found);
+    }
+
+    free(colors);
+    free(weights);
+    free(class_map);
+    free(scratch);
+    PyBuffer_Release(&view);
+    return ret;
+}
+
+
+PyDoc_STRVAR(find_batch_doc,
+"find_batch(images, count, threads=0) -> list\n\n"
+"Find the dominant colors of every image in the sequence on 'threads'\n"
+"worker threads (0 for one per cpu).  Returns a list with a\n"
+"(colors, weights) tuple per image.");
+
+static PyObject* py_find_batch(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = { "images", "count", "threads", NULL };
+    PyObject *seq_obj;
+    int count;
+    int threads = 0;
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "Oi|i:find_batch", keywords, &seq_obj, &count, &threads) ||
+       !check_count(count))
+    {
+        return NULL;
+    }
+
+    PyObject *seq = PySequence_Fast(seq_obj, "images must be a sequence");
+    if(!seq)
+    {
+        return NULL;
+    }
+
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+    Py_buffer *views = (Py_buffer*)calloc(n ? n : 1, sizeof(Py_buffer));
+    dc_image *images = (dc_image*)calloc(n ? n : 1, sizeof(dc_image));
+    unsigned char *colors = (unsigned char*)malloc((n ? n : 1) * (size_t)count * 3);
+    double *weights = (double*)malloc((n ? n : 1) * (size_t)count * sizeof(double));
+    int *found = (int*)malloc((n ? n : 1) * sizeof(int));
+
+    PyObject *ret = NULL;
+    Py_ssize_t acquired = 0;
+    if(!views || !images || !colors || !weights || !found)
+    {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    /*
+     * hold a view of every image for the whole batch
+     */
+    for(; acquired < n; ++acquired)
+    {
+        if(!get_image(PySequence_Fast_GET_ITEM(seq, acquired), &views[acquired], &images[acquired]))
+        {
+            goto done;
+        }
+    }
+
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = dc_find_dominant_colors_batch(images, (size_t)n, count, threads, colors, weights, found);
+    Py_END_ALLOW_THREADS
+
+    if(status != 0)
+    {
+        PyErr_Format(PyExc_RuntimeError, "dominant color batch failed (%d)", status);
+        goto done;
+    }
+
+    ret = PyList_New(n);
+    for(Py_ssize_t i = 0; ret && i < n; ++i)
+    {
+        if(found[i] <= 0)
+        {
+            Py_DECREF(ret);
+            ret = NULL;
+            PyErr_Format(PyExc_RuntimeError, "dominant color search failed for image %zd (%d)", i, found[i]);
+            break;
+        }
+
+        PyObject *item = make_result(colors + i * count * 3, weights + i * count, found[i]);
+        if(!item)
+        {
+            Py_DECREF(ret);
+            ret = NULL;
+            break;
+        }
+        PyList_SET_ITEM(ret, i, item);
+    }
+
+done:
+    for(Py_ssize_t i = 0; i < acquired; ++i)
+    {
+        PyBuffer_Release(&views[i]);
+    }
+    free(views);
+    free(images);
+    free(colors);
+    free(weights);
+    free(found);
+    Py_DECREF(seq);
+    return ret;
+}
+
+
+static PyMethodDef methods[] =
+{
+    { "find", (PyCFunction)py_find, METH_VARARGS, find_doc },
+    { "find_batch", (PyCFunction)(void(*)(void))py_find_batch, METH_VARARGS | METH_KEYWORDS, find_batch_doc },
+    { NULL, NULL, 0, NULL }
+};
+
+
+static struct PyModuleDef module =
+{
+    PyModuleDef_HEAD_INIT,
+    "dominant_colors",
+    "Find the dominant colors of images without copying them.",
+    -1,
+    methods
+};
+
+
+PyMODINIT_FUNC PyInit_dominant_colors(void)
+{
+    if(dc_abi_version() != DC_ABI_VERSION)
+    {
+        PyErr_SetString(PyExc_ImportError, "dominant_colors was built against a different library version");
+        return NULL;
+    }
+
+    PyObject *m = PyModule_Create(&module);
+    if(m)
+    {
+        PyModule_AddIntConstant(m, "ABI_VERSION", DC_ABI_VERSION);
+    }
+    return m;
+}
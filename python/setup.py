@@ -0,0 +1,51 @@
+#
+# Builds the dominant_colors Python extension from the C ABI and the engine
+# sources in ../cpp, listed by LIB_SOURCES in its makefile.  OpenCV is located with pkg-config, as for the command
+# line utility.
+#
+#   python setup.py build_ext --inplace
+#
+
+import os
+import subprocess
+from setuptools import setup, Extension
+
+here = os.path.dirname(os.path.abspath(__file__))
+cpp = os.path.join(here, '..', 'cpp')
+
+
+def pkg_config(*args):
+    return subprocess.check_output(['pkg-config'] + list(args) + ['opencv']).decode().split()
+
+
+#
+# The files of a variable of ../cpp/makefile, so the extension links the
+# same engine sources as the command line utility and the C library
+#
+def makefile_sources(name):
+    with open(os.path.join(cpp, 'makefile')) as f:
+        text = f.read().replace('\\\n', ' ')
+    for line in text.splitlines():
+        key, sep, value = line.partition('=')
+        if sep and key.strip() == name:
+            return value.split()
+    raise RuntimeError('no %s in ../cpp/makefile' % name)
+
+
+engine_sources = makefile_sources('LIB_SOURCES') + ['dominant_colors_c.cpp']
+
+extension = Extension(
+    'dominant_colors',
+    sources=['dominant_colors_module.c'] + [os.path.join(cpp, s) for s in engine_sources],
+    include_dirs=[cpp],
+    language='c++',
+    extra_compile_args=['-O2'] + pkg_config('--cflags'),
+    extra_link_args=['-pthread'] + pkg_config('--libs'),
+)
+
+setup(
+    name='dominant_colors',
+    version='1.0',
+    description='Find the dominant colors of images',
+    ext_modules=[extension],
+)